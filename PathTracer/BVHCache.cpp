@@ -0,0 +1,312 @@
+#include "BVHCache.h"
+#include "GPUBVH.h"
+#include "Timer.h"
+
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace GLSLPathTracer
+{
+    static const char BVHCacheMagic[8] = { 'G', 'P', 'T', 'B', 'V', 'H', 'C', '\0' };
+    static const unsigned int BVHCacheVersion = 2;
+    static const int MaxCacheDepth = 256; // deeper than any builder goes, stops corrupted files from recursing forever
+
+    struct BVHCacheHeader
+    {
+        char magic[8];
+        unsigned int version;
+        unsigned int headerSize;
+        unsigned long long key;
+        unsigned long long payloadHash;
+        int numNodes;
+        int numTriIndices;
+        int numSceneTris;
+        int numSceneVerts;
+
+        // Informational, already part of the key
+        int builder;
+        int objectSplitBins;
+        int minBinnedRefs;
+        int treeletPasses;
+        float splitAlpha;
+        float SAHNodeCost;
+        float SAHTriangleCost;
+        int nodeBatchSize;
+        int triBatchSize;
+        int minLeafSize;
+        int maxLeafSize;
+    };
+
+    // 64-bit FNV-1a
+    struct Hasher
+    {
+        unsigned long long value = 14695981039346656037ull;
+
+        void add(const void *data, size_t size)
+        {
+            const unsigned char *bytes = static_cast<const unsigned char *>(data);
+            for (size_t i = 0; i < size; i++)
+                value = (value ^ bytes[i]) * 1099511628211ull;
+        }
+
+        template <class T> void add(const T &v) { add(&v, sizeof(T)); }
+    };
+
+    // Read-only view of a whole file
+    class MappedFile
+    {
+    public:
+        MappedFile(const std::string &filename) : data(nullptr), size(0)
+        {
+#ifdef _WIN32
+            file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+            mapping = NULL;
+            LARGE_INTEGER fileSize;
+            if (file == INVALID_HANDLE_VALUE || !GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0)
+                return;
+            mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+            if (!mapping)
+                return;
+            data = static_cast<const char *>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+            if (data)
+                size = size_t(fileSize.QuadPart);
+#else
+            fd = open(filename.c_str(), O_RDONLY);
+            struct stat st;
+            if (fd < 0 || fstat(fd, &st) != 0 || st.st_size == 0)
+                return;
+            void *mapped = mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapped == MAP_FAILED)
+                return;
+            data = static_cast<const char *>(mapped);
+            size = size_t(st.st_size);
+#endif
+        }
+
+        ~MappedFile()
+        {
+#ifdef _WIN32
+            if (data)
+                UnmapViewOfFile(data);
+            if (mapping)
+                CloseHandle(mapping);
+            if (file != INVALID_HANDLE_VALUE)
+                CloseHandle(file);
+#else
+            if (data)
+                munmap(const_cast<char *>(data), size);
+            if (fd >= 0)
+                close(fd);
+#endif
+        }
+
+        const char *data;
+        size_t size;
+
+    private:
+#ifdef _WIN32
+        HANDLE file, mapping;
+#else
+        int fd;
+#endif
+    };
+
+    unsigned long long BVHCacheKey(GPUScene *scene, const Platform &platform, const BVH::BuildParams &params)
+    {
+        // Thread count and sort algorithm are left out, every builder is deterministic across them
+        Hasher hash;
+        hash.add(BVHCacheVersion);
+        hash.add(scene->getNumTriangles());
+        hash.add(scene->getNumVertices());
+        hash.add(scene->getTrianglePtr(), sizeof(GPUScene::Triangle) * scene->getNumTriangles());
+        hash.add(scene->getVertexPtr(), sizeof(Vec3f) * scene->getNumVertices());
+        hash.add(params.builder);
+        hash.add(params.splitAlpha);
+        hash.add(params.objectSplitBins);
+        hash.add(params.minBinnedRefs);
+        hash.add(params.treeletPasses);
+        hash.add(platform.getSAHNodeCost());
+        hash.add(platform.getSAHTriangleCost());
+        hash.add(platform.getNodeBatchSize());
+        hash.add(platform.getTriangleBatchSize());
+        hash.add(platform.getMinLeafSize());
+        hash.add(platform.getMaxLeafSize());
+        return hash.value;
+    }
+
+    static BVHNode* RebuildNode(NodeArena &arena, const GPUBVHNode *nodes, int numNodes, int index, int depth, int numTriIndices, int &numVisited)
+    {
+        // Inverse of GPUBVH::traverseBVH. Children always come after their parent in the
+        // array, which rules out cycles in a damaged file. Nodes of a failed rebuild go
+        // away with the arena.
+        const GPUBVHNode& node = nodes[index];
+        AABB bounds(Vec3f(node.BBoxMin.x, node.BBoxMin.y, node.BBoxMin.z), Vec3f(node.BBoxMax.x, node.BBoxMax.y, node.BBoxMax.z));
+        numVisited++;
+
+        if (node.LRLeaf.z == 1)
+        {
+            int first = node.LRLeaf.x;
+            int count = node.LRLeaf.y;
+            if (first < 0 || count < 0 || first + count > numTriIndices)
+                return nullptr;
+            return arena.newLeaf(bounds, first, first + count);
+        }
+
+        int left = node.LRLeaf.x;
+        int right = node.LRLeaf.y;
+        if (depth >= MaxCacheDepth || left <= index || right <= index || left >= numNodes || right >= numNodes || numVisited >= numNodes)
+            return nullptr;
+
+        BVHNode *leftNode = RebuildNode(arena, nodes, numNodes, left, depth + 1, numTriIndices, numVisited);
+        BVHNode *rightNode = leftNode ? RebuildNode(arena, nodes, numNodes, right, depth + 1, numTriIndices, numVisited) : nullptr;
+        if (!rightNode)
+            return nullptr;
+        return arena.newInner(bounds, leftNode, rightNode);
+    }
+
+    BVH* LoadBVHCache(const std::string &filename, unsigned long long key, GPUScene *scene, const Platform &platform)
+    {
+        FW::Timer timer(true);
+        MappedFile file(filename);
+        if (!file.data)
+        {
+            std::cout << "BVH cache miss: no " << filename << "\n";
+            return nullptr;
+        }
+
+        BVHCacheHeader header;
+        if (file.size < sizeof(header))
+        {
+            std::cout << "BVH cache miss: " << filename << " is truncated\n";
+            return nullptr;
+        }
+        memcpy(&header, file.data, sizeof(header));
+
+        if (memcmp(header.magic, BVHCacheMagic, sizeof(BVHCacheMagic)) != 0 || header.version != BVHCacheVersion || header.headerSize != sizeof(header))
+        {
+            std::cout << "BVH cache miss: " << filename << " has an unknown format\n";
+            return nullptr;
+        }
+        if (header.key != key || header.numSceneTris != scene->getNumTriangles() || header.numSceneVerts != scene->getNumVertices())
+        {
+            std::cout << "BVH cache miss: " << filename << " is stale\n";
+            return nullptr;
+        }
+
+        size_t nodeBytes = sizeof(GPUBVHNode) * size_t(header.numNodes);
+        size_t triBytes = sizeof(TriIndexData) * size_t(header.numTriIndices);
+        if (header.numNodes <= 0 || header.numTriIndices < 0 || file.size != sizeof(header) + nodeBytes + triBytes)
+        {
+            std::cout << "BVH cache miss: " << filename << " is truncated\n";
+            return nullptr;
+        }
+
+        Hasher payloadHash;
+        payloadHash.add(file.data + sizeof(header), nodeBytes + triBytes);
+        if (payloadHash.value != header.payloadHash)
+        {
+            std::cout << "BVH cache miss: " << filename << " is corrupted\n";
+            return nullptr;
+        }
+
+        // The triangle order of the leaves is the w component of the GPU triangle indices
+        const GPUBVHNode *nodes = reinterpret_cast<const GPUBVHNode *>(file.data + sizeof(header));
+        const TriIndexData *triIndices = reinterpret_cast<const TriIndexData *>(file.data + sizeof(header) + nodeBytes);
+        Array<S32> order;
+        order.reset(header.numTriIndices);
+        for (int i = 0; i < header.numTriIndices; i++)
+        {
+            order[i] = triIndices[i].indices.w;
+            if (order[i] < 0 || order[i] >= scene->getNumTriangles())
+            {
+                std::cout << "BVH cache miss: " << filename << " is corrupted\n";
+                return nullptr;
+            }
+        }
+
+        NodeArena arena;
+        arena.reserve(header.numNodes);
+        int numVisited = 0;
+        BVHNode *root = RebuildNode(arena, nodes, header.numNodes, 0, 0, header.numTriIndices, numVisited);
+        if (!root || numVisited != header.numNodes)
+        {
+            std::cout << "BVH cache miss: " << filename << " is corrupted\n";
+            return nullptr;
+        }
+
+        BVH *bvh = new BVH(scene, platform, arena, root, header.numNodes, order);
+        printf("BVH cache hit: %s, %d nodes, loaded in %.3fs\n", filename.c_str(), header.numNodes, timer.getElapsed());
+        return bvh;
+    }
+
+    bool SaveBVHCache(const std::string &filename, unsigned long long key, const BVH *bvh, const BVH::BuildParams &params)
+    {
+        GPUBVH flat(bvh, 2);
+        size_t nodeBytes = flat.getNodeBytes();
+        size_t triBytes = sizeof(TriIndexData) * flat.bvhTriangleIndices.size();
+
+        const Platform& platform = bvh->getPlatform();
+        BVHCacheHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, BVHCacheMagic, sizeof(BVHCacheMagic));
+        header.version = BVHCacheVersion;
+        header.headerSize = sizeof(header);
+        header.key = key;
+        header.numNodes = bvh->getNumNodes();
+        header.numTriIndices = int(flat.bvhTriangleIndices.size());
+        header.numSceneTris = bvh->getScene()->getNumTriangles();
+        header.numSceneVerts = bvh->getScene()->getNumVertices();
+        header.builder = params.builder;
+        header.objectSplitBins = params.objectSplitBins;
+        header.minBinnedRefs = params.minBinnedRefs;
+        header.treeletPasses = params.treeletPasses;
+        header.splitAlpha = params.splitAlpha;
+        header.SAHNodeCost = platform.getSAHNodeCost();
+        header.SAHTriangleCost = platform.getSAHTriangleCost();
+        header.nodeBatchSize = platform.getNodeBatchSize();
+        header.triBatchSize = platform.getTriangleBatchSize();
+        header.minLeafSize = platform.getMinLeafSize();
+        header.maxLeafSize = platform.getMaxLeafSize();
+
+        Hasher payloadHash;
+        payloadHash.add(flat.gpuNodes, nodeBytes);
+        if (triBytes)
+            payloadHash.add(&flat.bvhTriangleIndices[0], triBytes);
+        header.payloadHash = payloadHash.value;
+
+        // Write to a temporary file first so an interrupted save never leaves a half-written cache
+        std::string tempFilename = filename + ".tmp";
+        FILE *file = fopen(tempFilename.c_str(), "wb");
+        if (!file)
+        {
+            std::cout << "Unable to write BVH cache " << filename << "\n";
+            return false;
+        }
+        bool written = fwrite(&header, sizeof(header), 1, file) == 1 &&
+            fwrite(flat.gpuNodes, nodeBytes, 1, file) == 1 &&
+            (!triBytes || fwrite(&flat.bvhTriangleIndices[0], triBytes, 1, file) == 1);
+        written &= fclose(file) == 0;
+
+        remove(filename.c_str());
+        if (!written || rename(tempFilename.c_str(), filename.c_str()) != 0)
+        {
+            remove(tempFilename.c_str());
+            std::cout << "Unable to write BVH cache " << filename << "\n";
+            return false;
+        }
+        std::cout << "BVH cached in " << filename << "\n";
+        return true;
+    }
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+#include "BVH.h"
+#include <string>
+
+namespace GLSLPathTracer
+{
+    // Finished BVHs are cached next to the scene file as the flattened binary node array and the
+    // leaf triangle indices, so relaunching or switching back to a scene skips the build.
+    // The key hashes the geometry, the build parameters and the platform costs; a file with a
+    // different key, version or checksum is ignored and overwritten by the next build.
+
+    unsigned long long BVHCacheKey(GPUScene *scene, const Platform &platform, const BVH::BuildParams &params);
+
+    // Returns a BVH over scene, or nullptr if the file is missing, stale or corrupted
+    BVH* LoadBVHCache(const std::string &filename, unsigned long long key, GPUScene *scene, const Platform &platform);
+    bool SaveBVHCache(const std::string &filename, unsigned long long key, const BVH *bvh, const BVH::BuildParams &params);
+}
@@ -0,0 +1,713 @@
+#include <algorithm>
+#include <cmath>
+#include <random>
+
+#include "Benchmark.h"
+#include "Camera.h"
+#include "Scene.h"
+#include "Timer.h"
+
+namespace GLSLPathTracer
+{
+    static float LightTreeImportance(const GPUBVHNode &node, const LightTreeData &data, const glm::vec3 &position, const glm::vec3 &normal)
+    {
+        // Power over squared distance, bounded by the best cosines any point of the box can reach at the
+        // shading point and in the emission cone. Zero only where no light below can contribute.
+        // LightImportance in the shaders has to give the same numbers
+        glm::vec3 center = 0.5f * (node.BBoxMin + node.BBoxMax);
+        glm::vec3 toCenter = center - position;
+        float radius2 = 0.25f * glm::dot(node.BBoxMax - node.BBoxMin, node.BBoxMax - node.BBoxMin);
+        float dist2 = glm::dot(toCenter, toCenter);
+        if (dist2 <= radius2)
+            return data.power / radius2;
+        glm::vec3 dir = toCenter / sqrtf(dist2);
+
+        // Cosines of the angles less the half angle of the box as seen from the shading point,
+        // clamped at zero angle: cos(max(theta - thetaU, 0))
+        float sinThetaU2 = radius2 / dist2;
+        float cosThetaU = sqrtf(1.0f - sinThetaU2), sinThetaU = sqrtf(sinThetaU2);
+
+        float cosThetaI = glm::dot(normal, dir);
+        float cosI = cosThetaI > cosThetaU ? 1.0f : cosThetaI * cosThetaU + sqrtf(std::max(0.0f, 1.0f - cosThetaI * cosThetaI)) * sinThetaU;
+        if (cosI <= 0.0f)
+            return 0.0f;
+
+        // Same for the emission, first the normal cone of the lights: cos(max(thetaW - thetaO - thetaU, 0))
+        float cosThetaW = -glm::dot(data.axis, dir);
+        float sinThetaW = sqrtf(std::max(0.0f, 1.0f - cosThetaW * cosThetaW));
+        float sinThetaO = sqrtf(std::max(0.0f, 1.0f - data.cosThetaO * data.cosThetaO));
+        float cosThetaX = cosThetaW > data.cosThetaO ? 1.0f : cosThetaW * data.cosThetaO + sinThetaW * sinThetaO;
+        float sinThetaX = cosThetaW > data.cosThetaO ? 0.0f : sqrtf(std::max(0.0f, 1.0f - cosThetaX * cosThetaX));
+        float cosThetaP = cosThetaX > cosThetaU ? 1.0f : cosThetaX * cosThetaU + sinThetaX * sinThetaU;
+        if (cosThetaP <= data.cosThetaE)
+            return 0.0f;
+
+        return data.power * cosI * cosThetaP / dist2;
+    }
+
+    static int SampleLightTree(const std::vector<GPUBVHNode> &nodes, const std::vector<LightTreeData> &tree, const glm::vec3 &position, const glm::vec3 &normal,
+        std::mt19937 &rng, float &pdf)
+    {
+        // Down the tree picking children in proportion to their importance, as SampleLightTree in the shaders
+        std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+        pdf = 1.0f;
+        int idx = 0;
+        while (nodes[idx].LRLeaf.z == 0)
+        {
+            int left = nodes[idx].LRLeaf.x, right = nodes[idx].LRLeaf.y;
+            float leftImportance = LightTreeImportance(nodes[left], tree[left], position, normal);
+            float rightImportance = LightTreeImportance(nodes[right], tree[right], position, normal);
+            if (leftImportance + rightImportance <= 0.0f)
+                return -1;
+            float leftProbability = leftImportance / (leftImportance + rightImportance);
+            bool goLeft = uniform(rng) < leftProbability;
+            pdf *= goLeft ? leftProbability : 1.0f - leftProbability;
+            idx = goLeft ? left : right;
+        }
+        return nodes[idx].LRLeaf.x;
+    }
+
+    static float HeadlightShade(const GPUBVH &gpuBVH, const Vec3f *vertices, const glm::vec3 &origin, const glm::vec3 &direction, int &triangle)
+    {
+        // Cosine between the ray and the geometric normal of the closest hit, 0 for misses
+        int slot, numVisits = 0;
+        triangle = -1;
+        if (gpuBVH.intersect(vertices, origin, direction, slot, numVisits) == FW_F32_MAX)
+            return 0.0f;
+        const glm::ivec4& triIndex = gpuBVH.bvhTriangleIndices[slot].indices;
+        triangle = triIndex.w;
+        glm::vec3 v0(vertices[triIndex.x].x, vertices[triIndex.x].y, vertices[triIndex.x].z);
+        glm::vec3 v1(vertices[triIndex.y].x, vertices[triIndex.y].y, vertices[triIndex.y].z);
+        glm::vec3 v2(vertices[triIndex.z].x, vertices[triIndex.z].y, vertices[triIndex.z].z);
+        glm::vec3 n = glm::cross(v1 - v0, v2 - v0);
+        float length = glm::length(n);
+        return length > 0.0f ? fabsf(glm::dot(n, direction)) / length : 0.0f;
+    }
+
+    static float IntersectLight(const LightData &light, const glm::vec3 &origin, const glm::vec3 &direction)
+    {
+        // As the shaders: quads are one-sided, hits closer than 0.001 are ignored. FW_F32_MAX for misses
+        if (light.radiusAreaType.z == 0.0f)
+        {
+            glm::vec3 normal = glm::normalize(glm::cross(light.u, light.v));
+            float cosTheta = glm::dot(normal, direction);
+            if (cosTheta > 0.0f)
+                return FW_F32_MAX;
+            float t = glm::dot(normal, light.position - origin) / cosTheta;
+            if (!(t > 0.001f))
+                return FW_F32_MAX;
+            glm::vec3 offset = origin + direction * t - light.position;
+            float a1 = glm::dot(light.u, offset) / glm::dot(light.u, light.u);
+            float a2 = glm::dot(light.v, offset) / glm::dot(light.v, light.v);
+            return (a1 >= 0.0f && a1 <= 1.0f && a2 >= 0.0f && a2 <= 1.0f) ? t : FW_F32_MAX;
+        }
+
+        glm::vec3 op = light.position - origin;
+        float b = glm::dot(op, direction);
+        float det = b * b - glm::dot(op, op) + light.radiusAreaType.x * light.radiusAreaType.x;
+        if (det < 0.0f)
+            return FW_F32_MAX;
+        det = sqrtf(det);
+        if (b - det > 0.001f)
+            return b - det;
+        if (b + det > 0.001f)
+            return b + det;
+        return FW_F32_MAX;
+    }
+
+    static float IntersectLights(const std::vector<GPUBVHNode> &nodes, const std::vector<LightData> &lights, const glm::vec3 &origin, const glm::vec3 &direction, int &numTests)
+    {
+        // The walk of SceneIntersect over the light BVH, closest light hit or FW_F32_MAX
+        glm::vec3 invDir;
+        for (int i = 0; i < 3; i++)
+            invDir[i] = 1.0f / (fabsf(direction[i]) < 1e-20f ? (direction[i] >= 0.0f ? 1e-20f : -1e-20f) : direction[i]);
+        glm::vec3 oInvDir = origin * invDir;
+        float t = FW_F32_MAX;
+
+        int stack[64];
+        int ptr = 0;
+        stack[ptr++] = -1;
+        int idx = 0;
+        while (idx > -1)
+        {
+            const GPUBVHNode& node = nodes[idx];
+            if (node.LRLeaf.z == 1)
+            {
+                for (int i = node.LRLeaf.x; i < node.LRLeaf.x + node.LRLeaf.y; i++)
+                {
+                    numTests++;
+                    t = std::min(t, IntersectLight(lights[i], origin, direction));
+                }
+            }
+            else
+            {
+                float hits[2];
+                for (int i = 0; i < 2; i++)
+                {
+                    const GPUBVHNode& child = nodes[node.LRLeaf[i]];
+                    glm::vec3 f = child.BBoxMax * invDir - oInvDir;
+                    glm::vec3 n = child.BBoxMin * invDir - oInvDir;
+                    float t1 = std::min(std::min(glm::max(f, n).x, std::min(glm::max(f, n).y, glm::max(f, n).z)), t);
+                    float t0 = std::max(std::max(glm::min(f, n).x, std::max(glm::min(f, n).y, glm::min(f, n).z)), 0.0f);
+                    hits[i] = (t0 <= t1) ? t0 : FW_F32_MAX;
+                }
+
+                if (hits[0] < FW_F32_MAX && hits[1] < FW_F32_MAX)
+                {
+                    int first = hits[1] < hits[0] ? 1 : 0;
+                    idx = node.LRLeaf[first];
+                    stack[ptr++] = node.LRLeaf[1 - first];
+                    continue;
+                }
+                else if (hits[0] < FW_F32_MAX || hits[1] < FW_F32_MAX)
+                {
+                    idx = node.LRLeaf[hits[0] < FW_F32_MAX ? 0 : 1];
+                    continue;
+                }
+            }
+            idx = stack[--ptr];
+        }
+        return t;
+    }
+
+    glm::vec3 CameraRayDirection(const Camera &camera, int x, int y, int width, int height)
+    {
+        float scale = tanf(camera.fov * 0.5f);
+        float aspect = float(width) / float(height);
+        float dx = (2.0f * (x + 0.5f) / width - 1.0f) * aspect * scale;
+        float dy = (2.0f * (y + 0.5f) / height - 1.0f) * scale;
+        return glm::normalize(dx * camera.right + dy * camera.up + camera.forward);
+    }
+
+    void TraceCameraHits(const Scene &scene, const GPUBVH &bvh, int width, int height, CameraHits &hits)
+    {
+        hits.origins.clear();
+        hits.normals.clear();
+        hits.slots.clear();
+        const Camera& camera = *scene.camera;
+        for (int y = 0; y < height; y++)
+        {
+            for (int x = 0; x < width; x++)
+            {
+                glm::vec3 direction = CameraRayDirection(camera, x, y, width, height);
+                int slot, numVisits = 0;
+                float t = bvh.intersect(scene.gpuScene->getVertexPtr(), camera.position, direction, slot, numVisits);
+                if (t == FW_F32_MAX)
+                    continue;
+
+                const glm::ivec4& triIndex = bvh.bvhTriangleIndices[slot].indices;
+                const std::vector<VertexData>& vertices = scene.vertexData;
+                glm::vec3 normal = glm::normalize(glm::cross(vertices[triIndex.y].vertex - vertices[triIndex.x].vertex, vertices[triIndex.z].vertex - vertices[triIndex.x].vertex));
+                if (glm::dot(normal, direction) > 0.0f)
+                    normal = -normal;
+                hits.origins.push_back(camera.position + direction * t + normal * 0.001f);
+                hits.normals.push_back(normal);
+                hits.slots.push_back(slot);
+            }
+        }
+    }
+
+    void BenchmarkLightSampling(const Scene &scene, const GPUBVH &bvh)
+    {
+        std::mt19937 rng(1);
+        std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+        CameraHits hits;
+        TraceCameraHits(scene, bvh, scene.renderOptions.resolution.x / 4, scene.renderOptions.resolution.y / 4, hits);
+        const std::vector<glm::vec3>& hitOrigins = hits.origins;
+        const std::vector<glm::vec3>& hitNormals = hits.normals;
+
+        int numPixels = int(hitOrigins.size());
+        auto renderDirectLight = [&](bool useTree, int samplesPerPixel, std::vector<float> &image)
+        {
+            image.assign(numPixels, 0.0f);
+            for (int i = 0; i < numPixels; i++)
+            {
+                for (int s = 0; s < samplesPerPixel; s++)
+                {
+                    int index;
+                    float pickPdf;
+                    if (useTree)
+                        index = SampleLightTree(scene.lightBVHNodes, scene.lightTreeData, hitOrigins[i], hitNormals[i], rng, pickPdf);
+                    else
+                    {
+                        index = std::min(int(uniform(rng) * scene.lightData.size()), int(scene.lightData.size()) - 1);
+                        pickPdf = 1.0f / scene.lightData.size();
+                    }
+                    if (index < 0)
+                        continue;
+
+                    const LightData& light = scene.lightData[index];
+                    float r1 = uniform(rng), r2 = uniform(rng);
+                    glm::vec3 lightPos, lightNormal;
+                    if (light.radiusAreaType.z == 0.0f)
+                    {
+                        lightPos = light.position + light.u * r1 + light.v * r2;
+                        lightNormal = glm::normalize(glm::cross(light.u, light.v));
+                    }
+                    else
+                    {
+                        float z = 1.0f - 2.0f * r1, r = sqrtf(std::max(0.0f, 1.0f - z * z)), phi = 2.0f * Pi * r2;
+                        lightNormal = glm::vec3(r * cosf(phi), r * sinf(phi), z);
+                        lightPos = light.position + lightNormal * light.radiusAreaType.x;
+                    }
+
+                    glm::vec3 toLight = lightPos - hitOrigins[i];
+                    float dist2 = glm::dot(toLight, toLight);
+                    glm::vec3 lightDir = toLight / sqrtf(dist2);
+                    float cosSurface = glm::dot(lightDir, hitNormals[i]), cosLight = -glm::dot(lightDir, lightNormal);
+                    if (cosSurface <= 0.0f || cosLight <= 0.0f)
+                        continue;
+
+                    int numVisits = 0;
+                    if (bvh.occluded(scene.gpuScene->getVertexPtr(), hitOrigins[i], lightDir, sqrtf(dist2) - 0.001f, false, numVisits))
+                        continue;
+
+                    float lightPdf = pickPdf * dist2 / (light.radiusAreaType.y * cosLight);
+                    image[i] += Luminance(light.emission) * cosSurface / Pi / lightPdf;
+                }
+                image[i] /= samplesPerPixel;
+            }
+        };
+
+        std::vector<float> reference, image;
+        renderDirectLight(true, 256, reference);
+        double referenceMean = 0.0;
+        for (float value : reference)
+            referenceMean += value;
+        referenceMean /= std::max(numPixels, 1);
+
+        for (int useTree = 0; useTree < 2 && referenceMean > 0.0; useTree++)
+        {
+            for (int samplesPerPixel = 1; samplesPerPixel <= 64; samplesPerPixel *= 4)
+            {
+                FW::Timer timer(true);
+                renderDirectLight(useTree != 0, samplesPerPixel, image);
+                float renderTime = timer.end();
+                double squaredError = 0.0;
+                for (int i = 0; i < numPixels; i++)
+                    squaredError += double(image[i] - reference[i]) * (image[i] - reference[i]);
+                printf("  Light sampling, %s: %2d spp %.3fs, relative RMSE %.3f\n", useTree ? "tree   " : "uniform",
+                    samplesPerPixel, renderTime, sqrt(squaredError / numPixels) / referenceMean);
+            }
+        }
+    }
+
+    void BenchmarkEmissiveTriangles(const Scene &scene, const GPUBVH &bvh)
+    {
+        std::mt19937 rng(1);
+        std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+
+        // Luminance of the emissive triangle a ray hits first, with the cosine at it and the squared distance
+        auto traceEmission = [&](const glm::vec3 &origin, const glm::vec3 &direction, float &cosLight, float &dist2)
+        {
+            int slot, numVisits = 0;
+            float t = bvh.intersect(scene.gpuScene->getVertexPtr(), origin, direction, slot, numVisits);
+            if (t == FW_F32_MAX)
+                return 0.0f;
+            const glm::ivec4& triIndex = bvh.bvhTriangleIndices[slot].indices;
+            float emission = Luminance(glm::vec3(scene.materialData[scene.triangleMaterials[triIndex.w]].emission));
+            if (emission <= 0.0f)
+                return 0.0f;
+            glm::vec3 normal = glm::normalize(glm::cross(scene.vertexData[triIndex.y].vertex - scene.vertexData[triIndex.x].vertex, scene.vertexData[triIndex.z].vertex - scene.vertexData[triIndex.x].vertex));
+            cosLight = fabsf(glm::dot(normal, direction));
+            dist2 = t * t;
+            return emission;
+        };
+
+        // Camera hits on emitters are left out, only the light arriving elsewhere is compared
+        CameraHits hits;
+        TraceCameraHits(scene, bvh, scene.renderOptions.resolution.x / 8, scene.renderOptions.resolution.y / 8, hits);
+        std::vector<glm::vec3> hitOrigins, hitNormals;
+        for (size_t i = 0; i < hits.slots.size(); i++)
+        {
+            const glm::ivec4& triIndex = bvh.bvhTriangleIndices[hits.slots[i]].indices;
+            if (Luminance(glm::vec3(scene.materialData[scene.triangleMaterials[triIndex.w]].emission)) > 0.0f)
+                continue;
+            hitOrigins.push_back(hits.origins[i]);
+            hitNormals.push_back(hits.normals[i]);
+        }
+
+        int numPixels = int(hitOrigins.size());
+        auto renderEmission = [&](bool sampleLights, int samplesPerPixel, std::vector<float> &image)
+        {
+            image.assign(numPixels, 0.0f);
+            for (int i = 0; i < numPixels; i++)
+            {
+                const glm::vec3& normal = hitNormals[i];
+                glm::vec3 tangent = glm::normalize(glm::cross(fabsf(normal.x) > 0.5f ? glm::vec3(0.0f, 1.0f, 0.0f) : glm::vec3(1.0f, 0.0f, 0.0f), normal));
+                glm::vec3 bitangent = glm::cross(normal, tangent);
+                for (int s = 0; s < samplesPerPixel; s++)
+                {
+                    // Cosine sampled white diffuse bounce, its weight is the emission it finds
+                    float r1 = uniform(rng), phi = 2.0f * Pi * uniform(rng);
+                    float cosSurface = sqrtf(r1), sinSurface = sqrtf(1.0f - r1);
+                    glm::vec3 direction = tangent * (sinSurface * cosf(phi)) + bitangent * (sinSurface * sinf(phi)) + normal * cosSurface;
+                    float cosLight, dist2;
+                    float emission = traceEmission(hitOrigins[i], direction, cosLight, dist2);
+                    if (emission > 0.0f)
+                    {
+                        float weight = 1.0f;
+                        if (sampleLights)
+                        {
+                            float bsdfPdf = cosSurface / Pi, lightPdf = emission / scene.emissivePower * dist2 / cosLight;
+                            weight = bsdfPdf * bsdfPdf / (bsdfPdf * bsdfPdf + lightPdf * lightPdf);
+                        }
+                        image[i] += weight * emission;
+                    }
+                    if (!sampleLights)
+                        continue;
+
+                    // Alias table pick, uniform point on the triangle
+                    int index = std::min(int(uniform(rng) * scene.emissiveTriangles.size()), int(scene.emissiveTriangles.size()) - 1);
+                    if (uniform(rng) >= scene.emissiveTriangles[index].aliasThreshold)
+                        index = scene.emissiveTriangles[index].alias;
+                    const EmissiveTriangleData& triangle = scene.emissiveTriangles[index];
+                    float su = sqrtf(uniform(rng)), r2 = uniform(rng);
+                    glm::vec3 toLight = triangle.v0 + triangle.edge1 * (su * (1.0f - r2)) + triangle.edge2 * (su * r2) - hitOrigins[i];
+                    dist2 = glm::dot(toLight, toLight);
+                    glm::vec3 lightDir = toLight / sqrtf(dist2);
+                    cosSurface = glm::dot(lightDir, normal);
+                    cosLight = fabsf(glm::dot(lightDir, glm::normalize(glm::cross(triangle.edge1, triangle.edge2))));
+                    if (cosSurface <= 0.0f || cosLight <= 0.0f)
+                        continue;
+
+                    int numVisits = 0;
+                    if (bvh.occluded(scene.gpuScene->getVertexPtr(), hitOrigins[i], lightDir, sqrtf(dist2) - 0.001f, false, numVisits))
+                        continue;
+
+                    emission = Luminance(glm::vec3(triangle.emission));
+                    float bsdfPdf = cosSurface / Pi, lightPdf = emission / scene.emissivePower * dist2 / cosLight;
+                    image[i] += lightPdf * lightPdf / (bsdfPdf * bsdfPdf + lightPdf * lightPdf) * emission * cosSurface / Pi / lightPdf;
+                }
+                image[i] /= samplesPerPixel;
+            }
+        };
+
+        std::vector<float> first, second;
+        for (int sampleLights = 0; sampleLights < 2 && numPixels > 0; sampleLights++)
+        {
+            const int samplesPerPixel = 64;
+            FW::Timer timer(true);
+            renderEmission(sampleLights != 0, samplesPerPixel, first);
+            float renderTime = timer.end();
+            renderEmission(sampleLights != 0, samplesPerPixel, second);
+            double mean = 0.0, squaredError = 0.0;
+            for (int i = 0; i < numPixels; i++)
+            {
+                mean += 0.5 * (first[i] + second[i]);
+                squaredError += 0.5 * double(first[i] - second[i]) * (first[i] - second[i]);
+            }
+            mean /= numPixels;
+            double rmse = mean > 0.0 ? sqrt(squaredError / numPixels) / mean : 0.0;
+            double targetSamples = samplesPerPixel * (rmse / 0.1) * (rmse / 0.1);
+            printf("  Emissive triangles, %s: mean %.4f, %d spp %.3fs relative RMSE %.3f, 10%% RMSE after %.0f spp %.2fs\n",
+                sampleLights ? "light samples + MIS" : "BSDF samples only  ", mean, samplesPerPixel, renderTime, rmse, targetSamples, renderTime * targetSamples / samplesPerPixel);
+        }
+    }
+
+    void BenchmarkShadowRays(const Scene &scene, const GPUBVH &bvh)
+    {
+        std::mt19937 rng(1);
+        std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+        CameraHits hits;
+        TraceCameraHits(scene, bvh, scene.renderOptions.resolution.x / 2, scene.renderOptions.resolution.y / 2, hits);
+        std::vector<glm::vec3> shadowOrigins, shadowDirections;
+        std::vector<float> shadowDistances;
+        for (size_t i = 0; i < hits.origins.size(); i++)
+        {
+            const glm::vec3& origin = hits.origins[i];
+            const glm::vec3& normal = hits.normals[i];
+            if (!scene.lightData.empty())
+            {
+                const LightData& light = scene.lightData[0];
+                glm::vec3 target = light.position;
+                if (light.radiusAreaType.z == 0.0f)
+                    target += uniform(rng) * light.u + uniform(rng) * light.v;
+                glm::vec3 toLight = target - origin;
+                float distance = glm::length(toLight);
+                shadowOrigins.push_back(origin);
+                shadowDirections.push_back(toLight / distance);
+                shadowDistances.push_back(distance - 0.001f);
+            }
+
+            float z = uniform(rng), phi = 2.0f * 3.14159265f * uniform(rng);
+            float r = sqrtf(1.0f - z * z);
+            glm::vec3 tangent = glm::normalize(glm::cross(fabsf(normal.x) > 0.5f ? glm::vec3(0.0f, 1.0f, 0.0f) : glm::vec3(1.0f, 0.0f, 0.0f), normal));
+            glm::vec3 bitangent = glm::cross(normal, tangent);
+            shadowOrigins.push_back(origin);
+            shadowDirections.push_back(tangent * (r * cosf(phi)) + bitangent * (r * sinf(phi)) + normal * z);
+            shadowDistances.push_back(FW_F32_MAX);
+        }
+
+        int numShadowRays = int(shadowOrigins.size());
+        for (int nearestFirst = 1; nearestFirst >= 0 && numShadowRays > 0; nearestFirst--)
+        {
+            int numVisits = 0, numOccluded = 0;
+            FW::Timer timer(true);
+            for (int i = 0; i < numShadowRays; i++)
+                numOccluded += bvh.occluded(scene.gpuScene->getVertexPtr(), shadowOrigins[i], shadowDirections[i], shadowDistances[i], nearestFirst != 0, numVisits);
+            float traceTime = timer.end();
+            printf("  Shadow rays, %s: %.2f Mrays/s, %.1f nodes/ray, %d of %d occluded\n", nearestFirst ? "nearest first" : "unordered",
+                numShadowRays / traceTime * 1e-6f, float(numVisits) / numShadowRays, numOccluded, numShadowRays);
+        }
+    }
+
+    void BenchmarkShadingLocality(const Scene &scene, const GPUBVH &bvh)
+    {
+        const int width = scene.renderOptions.resolution.x / 2, height = scene.renderOptions.resolution.y / 2;
+        long long attribLines = 0, sceneLines = 0, leafLines = 0;
+        int numTiles = 0;
+        std::vector<size_t> lines;
+        for (int tileY = 0; tileY + 4 <= height; tileY += 4)
+        {
+            for (int tileX = 0; tileX + 8 <= width; tileX += 8)
+            {
+                std::vector<int> slots;
+                for (int y = tileY; y < tileY + 4; y++)
+                {
+                    for (int x = tileX; x < tileX + 8; x++)
+                    {
+                        glm::vec3 direction = CameraRayDirection(*scene.camera, x, y, width, height);
+                        int slot, numVisits = 0;
+                        if (bvh.intersect(scene.gpuScene->getVertexPtr(), scene.camera->position, direction, slot, numVisits) < FW_F32_MAX)
+                            slots.push_back(slot);
+                    }
+                }
+                if (slots.empty())
+                    continue;
+
+                for (int fetch = 0; fetch < 3; fetch++)
+                {
+                    lines.clear();
+                    for (size_t i = 0; i < slots.size(); i++)
+                    {
+                        const glm::ivec4& triIndex = bvh.bvhTriangleIndices[slots[i]].indices;
+                        if (fetch == 0)
+                        {
+                            for (int j = 0; j < 3; j++)
+                                lines.push_back(triIndex[j] * sizeof(VertexAttribData) / 128);
+                        }
+                        else
+                            lines.push_back(size_t(fetch == 1 ? triIndex.w : slots[i]) * scene.triangleMaterialBytes / 128);
+                    }
+                    std::sort(lines.begin(), lines.end());
+                    long long numLines = std::unique(lines.begin(), lines.end()) - lines.begin();
+                    (fetch == 0 ? attribLines : fetch == 1 ? sceneLines : leafLines) += numLines;
+                }
+                numTiles++;
+            }
+        }
+        if (numTiles > 0)
+            printf("  Shading fetches per warp of camera rays: %.1f lines of vertex attributes, material IDs %.1f lines in scene order, %.1f in leaf order\n",
+                double(attribLines) / numTiles, double(sceneLines) / numTiles, double(leafLines) / numTiles);
+    }
+
+    void BenchmarkQuantizedVertices(Scene &scene, const Platform &platform, const BVH::BuildParams &params, const BVH &fullBVH)
+    {
+        std::vector<QuantizedVertexData> keptVertices;
+        std::vector<VertexFrameData> keptFrames;
+        keptVertices.swap(scene.quantizedVertices);
+        keptFrames.swap(scene.vertexFrames);
+
+        BVH quantizedBVH(scene.gpuScene, platform, params);
+        scene.quantizedVertices.resize(scene.vertexData.size());
+        scene.quantizeVertices(&quantizedBVH, 0, VertexClusterSize(quantizedBVH.getTriIndices().getSize(), 1));
+        std::vector<Vec3f> decoded(scene.vertexData.size());
+        for (size_t i = 0; i < decoded.size(); i++)
+        {
+            glm::vec3 p = DecodeVertex(scene.quantizedVertices[i], scene.vertexFrames);
+            decoded[i] = Vec3f(p.x, p.y, p.z);
+        }
+        size_t fullBytes = sizeof(VertexData) * scene.vertexData.size();
+        size_t quantizedBytes = sizeof(QuantizedVertexData) * scene.quantizedVertices.size() + sizeof(VertexFrameData) * scene.vertexFrames.size();
+
+        GPUBVH vertexBVH(&fullBVH, 2);
+        GPUBVH quantizedGPUBVH(&quantizedBVH, 2);
+        const int width = scene.renderOptions.resolution.x, height = scene.renderOptions.resolution.y;
+        double squaredError = 0.0;
+        int otherTriangle = 0, lostHits = 0;
+        for (int y = 0; y < height; y++)
+        {
+            for (int x = 0; x < width; x++)
+            {
+                glm::vec3 direction = CameraRayDirection(*scene.camera, x, y, width, height);
+                int fullTriangle, quantizedTriangle;
+                float full = HeadlightShade(vertexBVH, scene.gpuScene->getVertexPtr(), scene.camera->position, direction, fullTriangle);
+                float quantized = HeadlightShade(quantizedGPUBVH, &decoded[0], scene.camera->position, direction, quantizedTriangle);
+                squaredError += double(full - quantized) * (full - quantized);
+                otherTriangle += fullTriangle != quantizedTriangle;
+                lostHits += fullTriangle >= 0 && quantizedTriangle < 0;
+            }
+        }
+        printf("  Quantized vertices: %.1f KB of positions instead of %.1f KB (%.0f%% less), %d frames\n",
+            quantizedBytes / 1024.0, fullBytes / 1024.0, 100.0 - 100.0 * quantizedBytes / fullBytes, int(scene.vertexFrames.size()));
+        printf("  Quantized vertices: headlight image RMSE %.2e, %d of %d pixels hit another triangle, %d lost their hit\n",
+            sqrt(squaredError / (width * height)), otherTriangle, width * height, lostHits);
+
+        scene.quantizedVertices.swap(keptVertices);
+        scene.vertexFrames.swap(keptFrames);
+    }
+
+    void BenchmarkLightBVH(const Scene &scene)
+    {
+        const int width = scene.renderOptions.resolution.x / 2, height = scene.renderOptions.resolution.y / 2;
+        for (int useBVH = 0; useBVH < 2; useBVH++)
+        {
+            int numTests = 0, numHits = 0;
+            FW::Timer timer(true);
+            for (int y = 0; y < height; y++)
+            {
+                for (int x = 0; x < width; x++)
+                {
+                    glm::vec3 direction = CameraRayDirection(*scene.camera, x, y, width, height);
+                    float t = FW_F32_MAX;
+                    if (useBVH)
+                        t = IntersectLights(scene.lightBVHNodes, scene.lightData, scene.camera->position, direction, numTests);
+                    else
+                    {
+                        for (const LightData& light : scene.lightData)
+                            t = std::min(t, IntersectLight(light, scene.camera->position, direction));
+                        numTests += int(scene.lightData.size());
+                    }
+                    numHits += t < FW_F32_MAX;
+                }
+            }
+            float traceTime = timer.end();
+            printf("  Lights, %s: %.2f Mrays/s, %.1f lights tested/ray, %d hits\n", useBVH ? "BVH " : "loop",
+                width * height / traceTime * 1e-6f, float(numTests) / (width * height), numHits);
+        }
+    }
+
+    void BenchmarkEnvMapSampling(const Scene &scene)
+    {
+        const int width = scene.hdrLoaderRes.width, height = scene.hdrLoaderRes.height;
+        const int numSamples = 1 << 22;
+        std::mt19937 rng(1);
+        std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+        auto luminance = [&](float u, float v)
+        {
+            int x = std::min(int(u * width), width - 1), y = std::min(int(v * height), height - 1);
+            return Luminance(glm::make_vec3(&scene.hdrLoaderRes.cols[(size_t(y) * width + x) * 3]));
+        };
+        auto report = [&](const char *name, double tableBytes, float buildTime, float sampleTime, double sum, double sumSq)
+        {
+            double mean = sum / numSamples;
+            printf("  Envmap sampling, %s: %6.1f MB, built in %.2fs, %.1f ns/sample, irradiance %.4g, relative std. dev. %.2f\n", name,
+                tableBytes / 1048576.0, buildTime, sampleTime * 1e9f / numSamples, mean, sqrt(std::max(sumSq / numSamples - mean * mean, 0.0)) / mean);
+        };
+        // Irradiance summed over the pixels for reference
+        auto sumIrradiance = [&](const float *cols)
+        {
+            double irradiance = 0.0;
+            for (int y = 0; y < height; y++)
+            {
+                float theta = (y + 0.5f) * Pi / height;
+                for (int x = 0; x < width; x++)
+                    irradiance += Luminance(glm::make_vec3(&cols[(size_t(y) * width + x) * 3])) * std::max(cosf(theta), 0.0f) * sinf(theta);
+            }
+            return irradiance * 2.0 * Pi * Pi / (double(width) * height);
+        };
+        double irradiance = sumIrradiance(scene.hdrLoaderRes.cols);
+        printf("Environment map sampling benchmark (%dx%d, %d samples, irradiance %.4g)\n", width, height, numSamples, irradiance);
+
+        // Texel formats against the loaded texels: GPU memory, what a bilinear lookup reads, the error of the
+        // rounded luminance and how far the irradiance the sampling tables are built from moves
+        printf("  Envmap texels, RGB32F: %6.1f MB, %2d bytes/lookup\n", double(width) * height * 12 / 1048576.0, 4 * 12);
+        for (int format = HDR_RGB16F; format <= HDR_RGB9E5; format++)
+        {
+            HDRLoaderResult converted = scene.hdrLoaderRes;
+            converted.cols = new float[size_t(width) * height * 3];
+            std::copy(scene.hdrLoaderRes.cols, scene.hdrLoaderRes.cols + size_t(width) * height * 3, converted.cols);
+            converted.packedCols = NULL;
+            converted.aliasData = NULL;
+            FW::Timer timer(true);
+            HDRLoader::convert(converted, format);
+            float convertTime = timer.end();
+
+            double squaredError = 0.0, squaredSum = 0.0;
+            for (size_t i = 0; i < size_t(width) * height; i++)
+            {
+                double reference = Luminance(glm::make_vec3(&scene.hdrLoaderRes.cols[i * 3]));
+                double rounded = Luminance(glm::make_vec3(&converted.cols[i * 3]));
+                squaredError += (rounded - reference) * (rounded - reference);
+                squaredSum += reference * reference;
+            }
+            printf("  Envmap texels, %s: %6.1f MB with %d mips, %2d bytes/lookup, converted in %.2fs, luminance relative RMSE %.1e, irradiance %+.3f%%\n",
+                format == HDR_RGB16F ? "RGB16F" : "RGB9E5", converted.textureBytes() / 1048576.0, converted.numLevels - 1, 4 * converted.texelBytes(),
+                convertTime, sqrt(squaredError / squaredSum), 100.0 * (sumIrradiance(converted.cols) / irradiance - 1.0));
+            delete[] converted.cols;
+            delete[] converted.packedCols;
+        }
+
+        {
+            FW::Timer timer(true);
+            std::vector<glm::vec2> marginal(height), conditional(size_t(width) * height);
+            HDRLoader::buildDistributions(scene.hdrLoaderRes, marginal.data(), conditional.data());
+            float buildTime = timer.end();
+
+            double sum = 0.0, sumSq = 0.0;
+            for (int i = 0; i < numSamples; i++)
+            {
+                // Row from the marginal table, column from that row's conditional table, pdf from both
+                float v = marginal[std::min(int(uniform(rng) * height), height - 1)].x;
+                int row = std::min(int(v * height), height - 1);
+                float u = conditional[size_t(row) * width + std::min(int(uniform(rng) * width), width - 1)].x;
+                int col = std::min(int(u * width), width - 1);
+                float theta = v * Pi;
+                float pdf = conditional[size_t(row) * width + col].y * marginal[row].y * width * height / (2.0f * Pi * Pi * sinf(theta));
+                if (pdf > 0.0f)
+                {
+                    double estimate = luminance(u, v) * std::max(cosf(theta), 0.0f) / pdf;
+                    sum += estimate;
+                    sumSq += estimate * estimate;
+                }
+            }
+            report("CDF tables  ", (height + double(width) * height) * sizeof(glm::vec2), buildTime, timer.end(), sum, sumSq);
+        }
+
+        for (int cellSize = 1; cellSize <= 4; cellSize *= 2)
+        {
+            HDRLoaderResult aliasRes = scene.hdrLoaderRes;
+            aliasRes.aliasData = NULL;
+            FW::Timer timer(true);
+            HDRLoader::buildAliasTable(aliasRes, cellSize);
+            float buildTime = timer.end();
+            if (aliasRes.aliasCellSize != cellSize)
+            {
+                // Too many cells for 25 bits, the next size up comes anyway
+                delete[] aliasRes.aliasData;
+                continue;
+            }
+
+            const int aliasWidth = aliasRes.aliasWidth, aliasHeight = aliasRes.aliasHeight, numCells = aliasWidth * aliasHeight;
+            double sum = 0.0, sumSq = 0.0;
+            for (int i = 0; i < numSamples; i++)
+            {
+                // Cell per axis, a second entry for the pdf of an alias
+                int cell = std::min(int(uniform(rng) * aliasHeight), aliasHeight - 1) * aliasWidth + std::min(int(uniform(rng) * aliasWidth), aliasWidth - 1);
+                glm::uvec2 entry = aliasRes.aliasData[cell];
+                if (uniform(rng) * 127.0f >= float(entry.x & 0x7F))
+                {
+                    cell = int(entry.x >> 7);
+                    entry = aliasRes.aliasData[cell];
+                }
+                float pdf = glm::uintBitsToFloat(entry.y);
+                float u = (cell % aliasWidth + uniform(rng)) / aliasWidth;
+                float v = (cell / aliasWidth + uniform(rng)) / aliasHeight;
+                float theta = v * Pi;
+                pdf /= 2.0f * Pi * Pi * sinf(theta);
+                if (pdf > 0.0f)
+                {
+                    double estimate = luminance(u, v) * std::max(cosf(theta), 0.0f) / pdf;
+                    sum += estimate;
+                    sumSq += estimate * estimate;
+                }
+            }
+            float sampleTime = timer.end();
+            char name[32];
+            snprintf(name, sizeof(name), "alias %dx%d   ", aliasRes.aliasCellSize, aliasRes.aliasCellSize);
+            report(name, double(numCells) * sizeof(glm::uvec2), buildTime, sampleTime, sum, sumSq);
+            delete[] aliasRes.aliasData;
+        }
+    }
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include "GPUBVH.h"
+#include <glm/glm.hpp>
+#include <vector>
+
+namespace GLSLPathTracer
+{
+    class Camera;
+    class Scene;
+
+    // Primary hits the CPU benchmarks shade, in scanline order with the misses left out: the hit point
+    // pushed 0.001 off the surface along the geometric normal, the normal flipped to face the ray, and
+    // the slot of the triangle in the BVH leaves
+    struct CameraHits
+    {
+        std::vector<glm::vec3> origins;
+        std::vector<glm::vec3> normals;
+        std::vector<int> slots;
+    };
+
+    // Pinhole camera ray through the center of pixel (x, y) of a width x height image
+    glm::vec3 CameraRayDirection(const Camera &camera, int x, int y, int width, int height);
+
+    // Closest hits of the camera rays through every pixel against the scene vertices
+    void TraceCameraHits(const Scene &scene, const GPUBVH &bvh, int width, int height, CameraHits &hits);
+
+    // Light sampling convergence: direct light on white diffuse surfaces at the camera hits, lights picked
+    // uniformly or down the light tree, each against 256 tree samples per pixel. For scenes with lights
+    void BenchmarkLightSampling(const Scene &scene, const GPUBVH &bvh);
+
+    // Emissive triangles: direct light at the camera hits from BSDF samples alone, all there was before, and
+    // with light samples from the alias table weighted against them by MIS. The noise of each comes from two
+    // independent 64 spp images, the time to 10% RMSE follows from it. For scenes with emissive triangles
+    void BenchmarkEmissiveTriangles(const Scene &scene, const GPUBVH &bvh);
+
+    // Shadow rays from the camera hits, toward a point on the first light and along a cosine distributed
+    // direction as for the environment map, visiting the children nearest first and unordered. Any hit ends them
+    void BenchmarkShadowRays(const Scene &scene, const GPUBVH &bvh);
+
+    // Shading fetch locality of camera rays: distinct 128-byte lines of vertex attributes and material IDs
+    // per 8x4 pixel tile (a warp), with the material IDs in scene and in leaf order
+    void BenchmarkShadingLocality(const Scene &scene, const GPUBVH &bvh);
+
+    // Quantized vertices: position memory, and a headlight image of the camera rays against the one of
+    // fullBVH over the full precision vertices. The scene's own quantized vertices are put aside meanwhile
+    void BenchmarkQuantizedVertices(Scene &scene, const Platform &platform, const BVH::BuildParams &params, const BVH &fullBVH);
+
+    // Emitter hits of camera rays: every light in turn, as the shaders used to, against the light BVH
+    void BenchmarkLightBVH(const Scene &scene);
+
+    // Environment map sampling: the per-row and per-pixel CDF tables the shaders used before against the
+    // alias table at a few cell sizes. Table memory, time per sample doing the lookups the shaders do, and
+    // the mean and spread of one-sample estimates of the irradiance from above. The texel formats first
+    void BenchmarkEnvMapSampling(const Scene &scene);
+}
@@ -1,8 +1,21 @@
 #include "GPUBVH.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
 #include <iostream>
 
 namespace GLSLPathTracer
 {
+    static const int BreadthFirstLevels = 8; // top 255 nodes of NodeOrder_BreadthFirst
+
+    int GPUBVH::appendBVH()
+    {
+        // Writes leafBVH starting at node current, returns its root
+        int root = leafBVH->isFlat() ? copyFlatBVH() : traverseBVH(leafBVH->getRoot());
+        reorderNodes(root, current + 1 - root);
+        return root;
+    }
+
     int GPUBVH::traverseBVH(BVHNode *root)
     {
         AABB *cbox = &root->m_bounds;
@@ -14,43 +27,608 @@ namespace GLSLPathTracer
         gpuNodes[current].BBoxMax[1] = cbox->max().y;
         gpuNodes[current].BBoxMax[2] = cbox->max().z;
 
-        gpuNodes[current].LRLeaf[2] = 0.0f;
+        gpuNodes[current].LRLeaf[2] = 0;
 
         int index = current;
+        nodeSources[index] = root;
 
-        if (root->isLeaf())
+        if (root->isLeaf() && instanceLeaves)
         {
+            // Top level, one instance per leaf
             const LeafNode* leaf = reinterpret_cast<const LeafNode*>(root);
-            int start = int(bvhTriangleIndices.size());
+            FW_ASSERT(leaf->getNumTriangles() == 1);
+            gpuNodes[current].LRLeaf[0] = leafBVH->getTriIndices()[leaf->m_lo];
+            gpuNodes[current].LRLeaf[1] = 0;
+            gpuNodes[current].LRLeaf[2] = 2;
+        }
+        else if (root->isLeaf())
+        {
+            const LeafNode* leaf = reinterpret_cast<const LeafNode*>(root);
+            int start = addLeafTriangles(leaf);
+
+            gpuNodes[current].LRLeaf[0] = start;
+            gpuNodes[current].LRLeaf[1] = leaf->m_hi - leaf->m_lo;
+            gpuNodes[current].LRLeaf[2] = 1;
+        }
+        else
+        {
+            current++;
+            gpuNodes[index].LRLeaf[0] = traverseBVH(root->getChildNode(0));
+            current++;
+            gpuNodes[index].LRLeaf[1] = traverseBVH(root->getChildNode(1));
+        }
+        return index;
+    }
 
-            gpuNodes[current].LRLeaf[0] = float(start); // strange cast here. loss of data for big numbers
-            gpuNodes[current].LRLeaf[1] = float(leaf->m_hi - leaf->m_lo);
-            gpuNodes[current].LRLeaf[2] = 1.0f;
+    int GPUBVH::copyFlatBVH()
+    {
+        // The builder already wrote the nodes parent first, only the indices need converting.
+        // Leaves keep their ranges, the whole triangle list is added in one go.
+        const Array<BVH::FlatNode>& nodes = leafBVH->getFlatNodes();
+        int root = current;
+        int firstTriangle = 0;
+        if (!instanceLeaves)
+        {
+            bvhTriangleIndices.reserve(bvhTriangleIndices.size() + leafBVH->getTriIndices().getSize());
+            firstTriangle = addTriangles(0, leafBVH->getTriIndices().getSize());
+        }
 
-            for (int i = leaf->m_lo; i < leaf->m_hi; i++)
+        for (int i = 0; i < nodes.getSize(); i++)
+        {
+            const BVH::FlatNode& node = nodes[i];
+            GPUBVHNode& gpuNode = gpuNodes[root + i];
+            gpuNode.BBoxMin = glm::vec3(node.bounds.min().x, node.bounds.min().y, node.bounds.min().z);
+            gpuNode.BBoxMax = glm::vec3(node.bounds.max().x, node.bounds.max().y, node.bounds.max().z);
+
+            if (!node.isLeaf)
+                gpuNode.LRLeaf = glm::ivec3(root + node.left, root + node.right, 0);
+            else if (instanceLeaves)
             {
-                int index = bvh->getTriIndices()[i];
-                const Vec3i& vtxInds = bvh->getScene()->getTriangle(index).vertices;
-                bvhTriangleIndices.push_back(TriIndexData{ glm::vec4(vtxInds.x,vtxInds.y,vtxInds.z, index) });
+                FW_ASSERT(node.right - node.left == 1);
+                gpuNode.LRLeaf = glm::ivec3(leafBVH->getTriIndices()[node.left], 0, 2);
             }
+            else
+                gpuNode.LRLeaf = glm::ivec3(firstTriangle + node.left, node.right - node.left, 1);
+        }
+        current = root + nodes.getSize() - 1;
+        return root;
+    }
+
+    int GPUBVH::addLeafTriangles(const LeafNode *leaf)
+    {
+        return addTriangles(leaf->m_lo, leaf->m_hi);
+    }
+
+    int GPUBVH::addTriangles(int lo, int hi)
+    {
+        int start = int(bvhTriangleIndices.size());
+        for (int i = lo; i < hi; i++)
+        {
+            int index = leafBVH->getTriIndices()[i];
+            const Vec3i& vtxInds = leafBVH->getScene()->getTriangle(index).vertices;
+            glm::ivec3 vertices = glm::ivec3(vtxInds.x, vtxInds.y, vtxInds.z) + leafVertexOffset;
+            bvhTriangleIndices.push_back(TriIndexData{ glm::ivec4(vertices, index + leafTriangleOffset) });
         }
+        return start;
+    }
+
+    int GPUBVH::traverseWideBVH(const BVHNode *root)
+    {
+        // Collapse: start from the binary children and keep opening the inner child
+        // with the largest surface area until there are 4 of them
+        const BVHNode* children[4];
+        int numChildren = 0;
+        if (root->isLeaf())
+            children[numChildren++] = root;
         else
         {
-            current++;
-            gpuNodes[index].LRLeaf[0] = float(traverseBVH(root->getChildNode(0)));
-            current++;
-            gpuNodes[index].LRLeaf[1] = float(traverseBVH(root->getChildNode(1)));
+            children[numChildren++] = root->getChildNode(0);
+            children[numChildren++] = root->getChildNode(1);
+        }
+
+        while (numChildren < 4)
+        {
+            int largest = -1;
+            for (int i = 0; i < numChildren; i++)
+                if (!children[i]->isLeaf() && (largest < 0 || children[i]->getArea() > children[largest]->getArea()))
+                    largest = i;
+            if (largest < 0)
+                break;
+
+            const BVHNode* expand = children[largest];
+            children[largest] = expand->getChildNode(0);
+            children[numChildren++] = expand->getChildNode(1);
+        }
+
+        int index = int(wideNodes.size());
+        GPUBVHNode4 node;
+        node.BBoxMinX = node.BBoxMinY = node.BBoxMinZ = glm::vec4(FW_F32_MAX);
+        node.BBoxMaxX = node.BBoxMaxY = node.BBoxMaxZ = glm::vec4(-FW_F32_MAX);
+        node.child = glm::ivec4(-1);
+        node.numTris = glm::ivec4(0);
+
+        size_t firstSource = nodeSources.size();
+        nodeSources.resize(firstSource + 4, nullptr);
+        for (int i = 0; i < numChildren; i++)
+        {
+            if (children[i]->getNumTriangles() == 0 && children[i]->isLeaf())
+                continue; // empty leaf, leave the slot empty
+            nodeSources[firstSource + i] = children[i];
+
+            const AABB& cbox = children[i]->m_bounds;
+            node.BBoxMinX[i] = cbox.min().x;
+            node.BBoxMaxX[i] = cbox.max().x;
+            node.BBoxMinY[i] = cbox.min().y;
+            node.BBoxMaxY[i] = cbox.max().y;
+            node.BBoxMinZ[i] = cbox.min().z;
+            node.BBoxMaxZ[i] = cbox.max().z;
+
+            if (children[i]->isLeaf())
+            {
+                const LeafNode* leaf = reinterpret_cast<const LeafNode*>(children[i]);
+                node.numTris[i] = leaf->m_hi - leaf->m_lo;
+                node.child[i] = addLeafTriangles(leaf);
+            }
+        }
+        wideNodes.push_back(node);
+
+        for (int i = 0; i < numChildren; i++)
+        {
+            if (!children[i]->isLeaf())
+            {
+                int childIndex = traverseWideBVH(children[i]);
+                wideNodes[index].child[i] = childIndex;
+            }
         }
         return index;
     }
 
-    GPUBVH::GPUBVH(const BVH* bvh)
+    static unsigned int floatBits(float f)
+    {
+        unsigned int bits;
+        memcpy(&bits, &f, sizeof(bits));
+        return bits;
+    }
+
+    GPUBVHNode4Compressed GPUBVH::compressNode(const GPUBVHNode4 &node)
+    {
+        GPUBVHNode4Compressed packed;
+        packed.originExp = glm::uvec4(0u);
+        packed.boundsXY = glm::uvec4(0u);
+        packed.boundsZCounts = glm::uvec4(0u);
+        packed.child = glm::uvec4(0xFFFFFFFFu);
+
+        glm::vec4 mins[3] = { node.BBoxMinX, node.BBoxMinY, node.BBoxMinZ };
+        glm::vec4 maxs[3] = { node.BBoxMaxX, node.BBoxMaxY, node.BBoxMaxZ };
+
+        glm::vec3 lo(FW_F32_MAX), hi(-FW_F32_MAX);
+        for (int i = 0; i < 4; i++)
+        {
+            if (node.child[i] < 0)
+                continue;
+            for (int axis = 0; axis < 3; axis++)
+            {
+                lo[axis] = std::min(lo[axis], mins[axis][i]);
+                hi[axis] = std::max(hi[axis], maxs[axis][i]);
+            }
+        }
+
+        for (int axis = 0; axis < 3; axis++)
+        {
+            if (lo[axis] > hi[axis])
+                lo[axis] = hi[axis] = 0.0f; // no children at all
+
+            // Smallest power of two that covers the node extent in 255 steps
+            int exponent;
+            frexp((hi[axis] - lo[axis]) / 255.0f, &exponent);
+            exponent = std::max(exponent, -126);
+            while (lo[axis] + 255.0f * ldexp(1.0f, exponent) < hi[axis])
+                exponent++;
+            float scale = ldexp(1.0f, exponent);
+
+            packed.originExp[axis] = floatBits(lo[axis]);
+            packed.originExp.w |= unsigned(exponent + 127) << (8 * axis);
+
+            for (int i = 0; i < 4; i++)
+            {
+                if (node.child[i] < 0)
+                    continue;
+
+                // Round outward, then check against the decoded value the shader will see
+                int qlo = std::min(std::max(int(floor((mins[axis][i] - lo[axis]) / scale)), 0), 255);
+                int qhi = std::min(std::max(int(ceil((maxs[axis][i] - lo[axis]) / scale)), 0), 255);
+                while (qlo > 0 && lo[axis] + float(qlo) * scale > mins[axis][i])
+                    qlo--;
+                while (qhi < 255 && lo[axis] + float(qhi) * scale < maxs[axis][i])
+                    qhi++;
+
+                glm::uvec4& words = (axis < 2) ? packed.boundsXY : packed.boundsZCounts;
+                int word = (axis < 2) ? axis * 2 : 0;
+                words[word + 0] |= unsigned(qlo) << (8 * i);
+                words[word + 1] |= unsigned(qhi) << (8 * i);
+            }
+        }
+
+        for (int i = 0; i < 4; i++)
+        {
+            if (node.child[i] < 0)
+                continue;
+            if (node.numTris[i] > 65535)
+                std::cout << "Warning: leaf with " << node.numTris[i] << " triangles does not fit a compressed BVH node\n";
+            packed.child[i] = unsigned(node.child[i]);
+            packed.boundsZCounts[2 + i / 2] |= (unsigned(node.numTris[i]) & 0xFFFFu) << (16 * (i & 1));
+        }
+        return packed;
+    }
+
+    static float SurfaceArea(float dx, float dy, float dz)
+    {
+        return (dx < 0.0f) ? 0.0f : dx * dy + dy * dz + dz * dx;
+    }
+
+    int GPUBVH::getChildren(int node, int children[4], float areas[4]) const
+    {
+        // Inner children only, largest surface area first. Binary leaves are nodes of their
+        // own and count as children, 4-wide leaves live in their parent's slots.
+        int numChildren = 0;
+        if (width == 2)
+        {
+            const GPUBVHNode& gpuNode = gpuNodes[node];
+            if (gpuNode.LRLeaf.z != 0)
+                return 0;
+            for (int i = 0; i < 2; i++)
+            {
+                const GPUBVHNode& child = gpuNodes[gpuNode.LRLeaf[i]];
+                glm::vec3 size = child.BBoxMax - child.BBoxMin;
+                children[numChildren] = gpuNode.LRLeaf[i];
+                areas[numChildren++] = SurfaceArea(size.x, size.y, size.z);
+            }
+        }
+        else
+        {
+            const GPUBVHNode4& gpuNode = wideNodes[node];
+            for (int i = 0; i < 4; i++)
+            {
+                if (gpuNode.child[i] < 0 || gpuNode.numTris[i] > 0)
+                    continue;
+                children[numChildren] = gpuNode.child[i];
+                areas[numChildren++] = SurfaceArea(gpuNode.BBoxMaxX[i] - gpuNode.BBoxMinX[i], gpuNode.BBoxMaxY[i] - gpuNode.BBoxMinY[i], gpuNode.BBoxMaxZ[i] - gpuNode.BBoxMinZ[i]);
+            }
+        }
+
+        for (int i = 1; i < numChildren; i++)
+            for (int j = i; j > 0 && areas[j] > areas[j - 1]; j--)
+            {
+                std::swap(areas[j], areas[j - 1]);
+                std::swap(children[j], children[j - 1]);
+            }
+        return numChildren;
+    }
+
+    static void LargerChildFirst(const GPUBVH &gpuBVH, int root, std::vector<int> &order)
+    {
+        std::vector<int> stack(1, root);
+        while (!stack.empty())
+        {
+            int node = stack.back();
+            stack.pop_back();
+            order.push_back(node);
+
+            int children[4];
+            float areas[4];
+            for (int i = gpuBVH.getChildren(node, children, areas) - 1; i >= 0; i--)
+                stack.push_back(children[i]);
+        }
+    }
+
+    static void VanEmdeBoas(const GPUBVH &gpuBVH, int node, int levels, std::vector<int> &order, std::vector<int> &below)
+    {
+        // Lays out the top levels of the subtree at node: the upper half of them recursively,
+        // then every subtree hanging off that half. Nodes just under the cut go to below.
+        int children[4];
+        float areas[4];
+        if (levels == 1)
+        {
+            order.push_back(node);
+            int numChildren = gpuBVH.getChildren(node, children, areas);
+            below.insert(below.end(), children, children + numChildren);
+            return;
+        }
+
+        int topLevels = (levels + 1) / 2;
+        std::vector<int> middle;
+        VanEmdeBoas(gpuBVH, node, topLevels, order, middle);
+        for (size_t i = 0; i < middle.size(); i++)
+            VanEmdeBoas(gpuBVH, middle[i], levels - topLevels, order, below);
+    }
+
+    void GPUBVH::computeNodeOrder(int root, std::vector<int> &order) const
+    {
+        // New position to node index for the tree at root
+        int children[4];
+        float areas[4];
+        order.clear();
+
+        if (nodeOrder == NodeOrder_LargerChildFirst)
+            LargerChildFirst(*this, root, order);
+        else if (nodeOrder == NodeOrder_BreadthFirst)
+        {
+            std::vector<int> level(1, root), next;
+            for (int depth = 0; depth < BreadthFirstLevels && !level.empty(); depth++)
+            {
+                next.clear();
+                for (size_t i = 0; i < level.size(); i++)
+                {
+                    order.push_back(level[i]);
+                    int numChildren = getChildren(level[i], children, areas);
+                    next.insert(next.end(), children, children + numChildren);
+                }
+                level.swap(next);
+            }
+            for (size_t i = 0; i < level.size(); i++)
+                LargerChildFirst(*this, level[i], order);
+        }
+        else if (nodeOrder == NodeOrder_VanEmdeBoas)
+        {
+            // Number of levels, the deepest path decides
+            int levels = 0;
+            std::vector<glm::ivec2> stack(1, glm::ivec2(root, 1));
+            while (!stack.empty())
+            {
+                glm::ivec2 entry = stack.back();
+                stack.pop_back();
+                levels = std::max(levels, entry.y);
+                int numChildren = getChildren(entry.x, children, areas);
+                for (int i = 0; i < numChildren; i++)
+                    stack.push_back(glm::ivec2(children[i], entry.y + 1));
+            }
+
+            std::vector<int> below;
+            VanEmdeBoas(*this, root, levels, order, below);
+        }
+    }
+
+    void GPUBVH::reorderNodes(int root, int count)
+    {
+        // Moves the count nodes of the tree at root into nodeOrder. The root keeps its index.
+        if (nodeOrder == NodeOrder_DepthFirst)
+            return;
+
+        std::vector<int> order;
+        computeNodeOrder(root, order);
+        FW_ASSERT(int(order.size()) == count && order[0] == root);
+        std::vector<int> newIndex(count);
+        for (int i = 0; i < count; i++)
+            newIndex[order[i] - root] = root + i;
+
+        int sourcesPerNode = (width == 2) ? 1 : 4;
+        if (!nodeSources.empty())
+        {
+            std::vector<const BVHNode *> sources(nodeSources.begin() + size_t(root) * sourcesPerNode, nodeSources.begin() + size_t(root + count) * sourcesPerNode);
+            for (int i = 0; i < count; i++)
+                for (int j = 0; j < sourcesPerNode; j++)
+                    nodeSources[size_t(root + i) * sourcesPerNode + j] = sources[size_t(order[i] - root) * sourcesPerNode + j];
+        }
+
+        if (width == 4)
+        {
+            std::vector<GPUBVHNode4> nodes(wideNodes.begin() + root, wideNodes.begin() + root + count);
+            for (int i = 0; i < count; i++)
+            {
+                GPUBVHNode4 node = nodes[order[i] - root];
+                for (int j = 0; j < 4; j++)
+                    if (node.child[j] >= 0 && node.numTris[j] == 0)
+                        node.child[j] = newIndex[node.child[j] - root];
+                wideNodes[root + i] = node;
+            }
+            return;
+        }
+
+        std::vector<GPUBVHNode> nodes(gpuNodes + root, gpuNodes + root + count);
+        for (int i = 0; i < count; i++)
+        {
+            GPUBVHNode node = nodes[order[i] - root];
+            if (node.LRLeaf.z == 0)
+                node.LRLeaf = glm::ivec3(newIndex[node.LRLeaf.x - root], newIndex[node.LRLeaf.y - root], 0);
+            gpuNodes[root + i] = node;
+        }
+
+        // Refitting a flat BVH finds the flat node of every binary node through here
+        if (leafBVH == bvh && bvh->isFlat())
+        {
+            flatSources.resize(count);
+            for (int i = 0; i < count; i++)
+                flatSources[i] = order[i];
+        }
+    }
+
+    float GPUBVH::intersect(const Vec3f *vertices, const glm::vec3 &origin, const glm::vec3 &direction, int &triID, int &numVisits) const
+    {
+        return trace(vertices, origin, direction, FW_F32_MAX, false, true, triID, numVisits);
+    }
+
+    bool GPUBVH::occluded(const Vec3f *vertices, const glm::vec3 &origin, const glm::vec3 &direction, float maxDist, bool nearestFirst, int &numVisits) const
+    {
+        int triID;
+        trace(vertices, origin, direction, maxDist, true, nearestFirst, triID, numVisits);
+        return triID >= 0;
+    }
+
+    float GPUBVH::trace(const Vec3f *vertices, const glm::vec3 &origin, const glm::vec3 &direction, float maxDist, bool anyHit, bool nearestFirst, int &triID, int &numVisits) const
+    {
+        // The walk of SceneTraverse in the shaders, on single-level binary nodes. Leaves use
+        // the Woop triangles once they have been created.
+        FW_ASSERT(width == 2 && meshRoots.empty());
+        // Zero components are nudged off zero so origin * invDir stays finite
+        glm::vec3 invDir;
+        for (int i = 0; i < 3; i++)
+            invDir[i] = 1.0f / (fabsf(direction[i]) < 1e-20f ? (direction[i] >= 0.0f ? 1e-20f : -1e-20f) : direction[i]);
+        glm::vec3 oInvDir = origin * invDir;
+        float t = maxDist;
+        triID = -1; // leaf slot, as in the shaders
+
+        int stack[64];
+        int ptr = 0;
+        stack[ptr++] = -1;
+        int idx = 0;
+
+        while (idx > -1)
+        {
+            numVisits++;
+            const GPUBVHNode& node = gpuNodes[idx];
+            if (node.LRLeaf.z == 1)
+            {
+                for (int i = 0; i < node.LRLeaf.y; i++)
+                {
+                    int slot = node.LRLeaf.x + i;
+                    float d, u, v;
+                    if (!woopTriangles.empty())
+                    {
+                        const WoopTriangleData& woop = woopTriangles[slot];
+                        d = (woop.rows[0].w - glm::dot(origin, glm::vec3(woop.rows[0]))) / glm::dot(direction, glm::vec3(woop.rows[0]));
+                        glm::vec3 p = origin + direction * d;
+                        u = woop.rows[1].w + glm::dot(p, glm::vec3(woop.rows[1]));
+                        v = woop.rows[2].w + glm::dot(p, glm::vec3(woop.rows[2]));
+                    }
+                    else
+                    {
+                        const glm::ivec4& triIndex = bvhTriangleIndices[slot].indices;
+                        glm::vec3 v0(vertices[triIndex.x].x, vertices[triIndex.x].y, vertices[triIndex.x].z);
+                        glm::vec3 e0 = glm::vec3(vertices[triIndex.y].x, vertices[triIndex.y].y, vertices[triIndex.y].z) - v0;
+                        glm::vec3 e1 = glm::vec3(vertices[triIndex.z].x, vertices[triIndex.z].y, vertices[triIndex.z].z) - v0;
+                        glm::vec3 pv = glm::cross(direction, e1);
+                        float invDet = 1.0f / glm::dot(e0, pv);
+                        glm::vec3 tv = origin - v0;
+                        glm::vec3 qv = glm::cross(tv, e0);
+                        u = glm::dot(tv, pv) * invDet;
+                        v = glm::dot(direction, qv) * invDet;
+                        d = glm::dot(e1, qv) * invDet;
+                    }
+                    if (u >= 0.0f && v >= 0.0f && u + v <= 1.0f && d >= 0.0f && d < t)
+                    {
+                        t = d;
+                        triID = slot;
+                        if (anyHit)
+                            return t;
+                    }
+                }
+            }
+            else
+            {
+                float hits[2];
+                for (int i = 0; i < 2; i++)
+                {
+                    const GPUBVHNode& child = gpuNodes[node.LRLeaf[i]];
+                    glm::vec3 f = child.BBoxMax * invDir - oInvDir;
+                    glm::vec3 n = child.BBoxMin * invDir - oInvDir;
+                    glm::vec3 tmax = glm::max(f, n);
+                    glm::vec3 tmin = glm::min(f, n);
+                    float t1 = std::min(std::min(tmax.x, std::min(tmax.y, tmax.z)), t);
+                    float t0 = std::max(std::max(tmin.x, std::max(tmin.y, tmin.z)), 0.0f);
+                    hits[i] = (t0 <= t1) ? t0 : FW_F32_MAX;
+                }
+
+                // Clipped to the closest hit so far, so boxes behind it are culled
+                if (hits[0] < FW_F32_MAX && hits[1] < FW_F32_MAX)
+                {
+                    int first = (nearestFirst && hits[1] < hits[0]) ? 1 : 0;
+                    idx = node.LRLeaf[first];
+                    stack[ptr++] = node.LRLeaf[1 - first];
+                    continue;
+                }
+                else if (hits[0] < FW_F32_MAX || hits[1] < FW_F32_MAX)
+                {
+                    idx = node.LRLeaf[hits[0] < FW_F32_MAX ? 0 : 1];
+                    continue;
+                }
+            }
+            idx = stack[--ptr];
+        }
+        return t;
+    }
+
+    void GPUBVH::createWoopTriangles(const glm::vec3 *vertices)
+    {
+        // Rows of the inverse of [e0 e1 n v0], inverted in double precision. Degenerate
+        // triangles get rows that never report a hit.
+        woopTriangles.resize(bvhTriangleIndices.size());
+        for (size_t i = 0; i < bvhTriangleIndices.size(); i++)
+        {
+            const glm::ivec4& triIndex = bvhTriangleIndices[i].indices;
+            glm::dvec3 v0(vertices[triIndex.x]);
+            glm::dvec3 e0 = glm::dvec3(vertices[triIndex.y]) - v0;
+            glm::dvec3 e1 = glm::dvec3(vertices[triIndex.z]) - v0;
+            glm::dvec3 n = glm::cross(e0, e1);
+
+            WoopTriangleData& woop = woopTriangles[i];
+            double det = glm::dot(n, n);
+            if (!(det > 0.0))
+            {
+                woop.rows[0] = woop.rows[1] = woop.rows[2] = glm::vec4(0.0f, 0.0f, 0.0f, -1.0f);
+                continue;
+            }
+
+            glm::dmat4 m(glm::dvec4(e0, 0.0), glm::dvec4(e1, 0.0), glm::dvec4(n, 0.0), glm::dvec4(v0, 1.0));
+            glm::dmat4 inv = glm::inverse(m);
+            glm::dvec4 rowU(inv[0][0], inv[1][0], inv[2][0], inv[3][0]);
+            glm::dvec4 rowV(inv[0][1], inv[1][1], inv[2][1], inv[3][1]);
+            glm::dvec4 rowT(inv[0][2], inv[1][2], inv[2][2], inv[3][2]);
+
+            // t = (w - dot(o, n')) / dot(d, n'), u and v are affine in the hit point
+            woop.rows[0] = glm::vec4(glm::vec3(rowT), float(-rowT.w));
+            woop.rows[1] = glm::vec4(rowU);
+            woop.rows[2] = glm::vec4(rowV);
+        }
+    }
+
+    GPUBVH::GPUBVH(const BVH* bvh, int width, bool compressed, NodeOrder nodeOrder)
     {
         this->bvh = bvh;
+        this->width = compressed ? 4 : width;
+        this->compressed = compressed;
+        this->nodeOrder = nodeOrder;
+        gpuNodes = nullptr;
 		current = 0;
+        numNodes = bvh->getNumNodes();
+        leafBVH = bvh;
+        leafVertexOffset = leafTriangleOffset = 0;
+        instanceLeaves = false;
         createGPUBVH();
     }
 
+    GPUBVH::GPUBVH(const BVH *topLevel, const std::vector<MeshBVH> &meshes, NodeOrder nodeOrder)
+    {
+        // Two-level layout, binary nodes only: the top-level tree first, then every mesh tree.
+        // Mesh trees are built over mesh-local triangles and vertices, the offsets make their
+        // leaves point into the scene-wide arrays.
+        bvh = topLevel;
+        width = 2;
+        compressed = false;
+        this->nodeOrder = nodeOrder;
+        numNodes = topLevel->getNumNodes();
+        for (size_t i = 0; i < meshes.size(); i++)
+            numNodes += meshes[i].bvh->getNumNodes();
+
+        gpuNodes = new GPUBVHNode[numNodes];
+        nodeSources.resize(numNodes);
+        current = 0;
+
+        leafBVH = topLevel;
+        leafVertexOffset = leafTriangleOffset = 0;
+        instanceLeaves = true;
+        appendBVH();
+
+        instanceLeaves = false;
+        for (size_t i = 0; i < meshes.size(); i++)
+        {
+            current++;
+            leafBVH = meshes[i].bvh;
+            leafVertexOffset = meshes[i].firstVertex;
+            leafTriangleOffset = meshes[i].firstTriangle;
+            meshRoots.push_back(appendBVH());
+        }
+    }
+
 	GPUBVH::~GPUBVH()
 	{
 		delete[] gpuNodes;
@@ -58,7 +636,126 @@ namespace GLSLPathTracer
 
     void GPUBVH::createGPUBVH()
     {
-        gpuNodes = new GPUBVHNode[bvh->getNumNodes()];
-        traverseBVH(bvh->getRoot());
+        if (width == 4)
+        {
+            FW_ASSERT(!bvh->isFlat()); // collapsing needs the node tree
+            wideNodes.reserve(bvh->getNumNodes() / 2 + 1);
+            traverseWideBVH(bvh->getRoot());
+            reorderNodes(0, int(wideNodes.size()));
+
+            if (compressed)
+            {
+                compressedNodes.resize(wideNodes.size());
+                for (size_t i = 0; i < wideNodes.size(); i++)
+                    compressedNodes[i] = compressNode(wideNodes[i]);
+                std::vector<GPUBVHNode4>().swap(wideNodes);
+            }
+        }
+        else
+        {
+            gpuNodes = new GPUBVHNode[numNodes];
+            if (!bvh->isFlat())
+                nodeSources.resize(numNodes);
+            appendBVH();
+        }
+    }
+
+    size_t GPUBVH::getNodeBytes() const
+    {
+        if (compressed)
+            return sizeof(GPUBVHNode4Compressed) * compressedNodes.size();
+        if (width == 4)
+            return sizeof(GPUBVHNode4) * wideNodes.size();
+        return sizeof(GPUBVHNode) * numNodes;
+    }
+
+    size_t GPUBVH::getNodeStride() const
+    {
+        if (compressed)
+            return sizeof(GPUBVHNode4Compressed);
+        if (width == 4)
+            return sizeof(GPUBVHNode4);
+        return sizeof(GPUBVHNode);
+    }
+
+    const void *GPUBVH::getNodeData() const
+    {
+        if (compressed)
+            return &compressedNodes[0];
+        if (width == 4)
+            return &wideNodes[0];
+        return gpuNodes;
+    }
+
+    glm::ivec2 GPUBVH::refit()
+    {
+        // Topology and node order are unchanged, so every node is rewritten in place from
+        // the BVH node it was flattened from, or the flat node at the same index
+        int numNodes = int(getNodeBytes() / getNodeStride());
+        int first = numNodes, last = 0;
+
+        for (int i = 0; i < numNodes; i++)
+        {
+            bool changed;
+            if (width == 2)
+            {
+                const AABB& cbox = bvh->isFlat() ? bvh->getFlatNodes()[flatSources.empty() ? i : flatSources[i]].bounds : nodeSources[i]->m_bounds;
+                glm::vec3 bboxMin(cbox.min().x, cbox.min().y, cbox.min().z);
+                glm::vec3 bboxMax(cbox.max().x, cbox.max().y, cbox.max().z);
+                changed = gpuNodes[i].BBoxMin != bboxMin || gpuNodes[i].BBoxMax != bboxMax;
+                gpuNodes[i].BBoxMin = bboxMin;
+                gpuNodes[i].BBoxMax = bboxMax;
+            }
+            else
+            {
+                GPUBVHNode4 node;
+                if (compressed)
+                {
+                    const GPUBVHNode4Compressed& packed = compressedNodes[i];
+                    for (int j = 0; j < 4; j++)
+                    {
+                        node.child[j] = int(packed.child[j]);
+                        node.numTris[j] = int((packed.boundsZCounts[2 + j / 2] >> (16 * (j & 1))) & 0xFFFFu);
+                    }
+                }
+                else
+                    node = wideNodes[i];
+
+                node.BBoxMinX = node.BBoxMinY = node.BBoxMinZ = glm::vec4(FW_F32_MAX);
+                node.BBoxMaxX = node.BBoxMaxY = node.BBoxMaxZ = glm::vec4(-FW_F32_MAX);
+                for (int j = 0; j < 4; j++)
+                {
+                    const BVHNode* source = nodeSources[i * 4 + j];
+                    if (!source)
+                        continue;
+                    const AABB& cbox = source->m_bounds;
+                    node.BBoxMinX[j] = cbox.min().x;
+                    node.BBoxMaxX[j] = cbox.max().x;
+                    node.BBoxMinY[j] = cbox.min().y;
+                    node.BBoxMaxY[j] = cbox.max().y;
+                    node.BBoxMinZ[j] = cbox.min().z;
+                    node.BBoxMaxZ[j] = cbox.max().z;
+                }
+
+                if (compressed)
+                {
+                    GPUBVHNode4Compressed packed = compressNode(node);
+                    changed = memcmp(&packed, &compressedNodes[i], sizeof(packed)) != 0;
+                    compressedNodes[i] = packed;
+                }
+                else
+                {
+                    changed = memcmp(&node, &wideNodes[i], sizeof(node)) != 0;
+                    wideNodes[i] = node;
+                }
+            }
+
+            if (changed)
+            {
+                first = std::min(first, i);
+                last = i + 1;
+            }
+        }
+        return first < last ? glm::ivec2(first, last) : glm::ivec2(0, 0);
     }
-}
\ No newline at end of file
+}
@@ -6,28 +6,110 @@
 
 namespace GLSLPathTracer
 {
+    // Three RGB32I texels, the bounds are float bits so every index stays exact past 2^24
     struct GPUBVHNode
     {
         glm::vec3 BBoxMin;
         glm::vec3 BBoxMax;
-        glm::vec3 LRLeaf;
+        glm::ivec3 LRLeaf;
     };
 
+    // 4-wide node, one RGBA32I texel per row so the shader can test all children with vec4 math
+    struct GPUBVHNode4
+    {
+        glm::vec4 BBoxMinX;
+        glm::vec4 BBoxMaxX;
+        glm::vec4 BBoxMinY;
+        glm::vec4 BBoxMaxY;
+        glm::vec4 BBoxMinZ;
+        glm::vec4 BBoxMaxZ;
+        glm::ivec4 child;    // node index of inner children, first triangle of leaves, -1 for empty slots
+        glm::ivec4 numTris;  // 0 for inner children
+    };
+
+    // Compressed 4-wide node, RGBA32I texels the shader reads back with uvec4(). Child bounds are 8-bit
+    // offsets from the node origin in units of a power of two per axis, rounded outward so the decoded
+    // boxes always contain the children
+    struct GPUBVHNode4Compressed
+    {
+        glm::uvec4 originExp;      // xyz: float bits of the node origin, w: biased exponents x | y << 8 | z << 16
+        glm::uvec4 boundsXY;       // quantized lo.x, hi.x, lo.y, hi.y, one byte per child
+        glm::uvec4 boundsZCounts;  // quantized lo.z, hi.z, then 16-bit triangle counts (children 0|1 << 16, 2|3 << 16)
+        glm::uvec4 child;          // node index of inner children, first triangle of leaves, 0xFFFFFFFF for empty slots
+    };
+
+    // RGBA32I: the three vertex indices and the scene triangle index
     struct TriIndexData
     {
-        glm::vec4 indices;
+        glm::ivec4 indices;
+    };
+
+    // Three RGBA32F texels per leaf triangle: the rows of the affine map taking the triangle to
+    // the unit triangle (t row first, then u and v), so a ray needs no vertex fetches or cross products
+    struct WoopTriangleData
+    {
+        glm::vec4 rows[3];
+    };
+
+    // Bottom level of a two-level hierarchy, a BVH over one mesh's triangles
+    struct MeshBVH
+    {
+        const BVH *bvh;
+        int firstTriangle; // of the mesh in the scene-wide triangle array
+        int firstVertex;
+    };
+
+    // Order of the nodes in the buffer. Parents always come before their children.
+    enum NodeOrder
+    {
+        NodeOrder_DepthFirst,       // as the builder emitted them
+        NodeOrder_LargerChildFirst, // depth first, the child with the larger surface area right after its parent
+        NodeOrder_BreadthFirst,     // the top levels breadth first, the subtrees below them larger child first
+        NodeOrder_VanEmdeBoas       // cache oblivious, the top half of the levels first, then every subtree below it
     };
 
     class GPUBVH
     {
     public:
-        GPUBVH(const BVH *bvh);
+        GPUBVH(const BVH *bvh, int width = 2, bool compressed = false, NodeOrder nodeOrder = NodeOrder_DepthFirst);
+        GPUBVH(const BVH *topLevel, const std::vector<MeshBVH> &meshes, NodeOrder nodeOrder = NodeOrder_DepthFirst);
 		~GPUBVH();
         void createGPUBVH();
+        int appendBVH();
         int traverseBVH(BVHNode *root);
+        int copyFlatBVH();
+        int traverseWideBVH(const BVHNode *root);
+        int addLeafTriangles(const LeafNode *leaf);
+        int addTriangles(int lo, int hi);
+        static GPUBVHNode4Compressed compressNode(const GPUBVHNode4 &node);
+        int getChildren(int node, int children[4], float areas[4]) const;
+        void computeNodeOrder(int root, std::vector<int> &order) const;
+        void reorderNodes(int root, int count);
+        void createWoopTriangles(const glm::vec3 *vertices);
+        float intersect(const Vec3f *vertices, const glm::vec3 &origin, const glm::vec3 &direction, int &triID, int &numVisits) const; // CPU closest hit on binary nodes, for benchmarks
+        bool occluded(const Vec3f *vertices, const glm::vec3 &origin, const glm::vec3 &direction, float maxDist, bool nearestFirst, int &numVisits) const; // CPU any hit, children in stored order unless nearestFirst
+        float trace(const Vec3f *vertices, const glm::vec3 &origin, const glm::vec3 &direction, float maxDist, bool anyHit, bool nearestFirst, int &triID, int &numVisits) const;
+        size_t getNodeBytes() const;
+        size_t getNodeStride() const;
+        const void *getNodeData() const;
+        glm::ivec2 refit(); // after BVH::refit(), returns the [first, last) range of nodes that changed
         GPUBVHNode *gpuNodes;
-        const BVH *bvh;
+        std::vector<GPUBVHNode4> wideNodes;
+        std::vector<GPUBVHNode4Compressed> compressedNodes;
+        std::vector<const BVHNode *> nodeSources; // per binary node, or per 4-wide child slot (nullptr when empty); empty for flat BVHs
+        std::vector<int> flatSources; // flat node of each binary node once a flat BVH has been reordered
+        const BVH *bvh; // top level for two-level hierarchies
+        std::vector<int> meshRoots; // two-level: root node of each mesh BVH
+        const BVH *leafBVH; // tree being flattened and where its triangles sit in the scene arrays
+        int leafVertexOffset;
+        int leafTriangleOffset;
+        bool instanceLeaves; // leaves hold instances (LRLeaf.z == 2) instead of triangles
+        int numNodes; // binary nodes
+        int width; // 2 = binary nodes in gpuNodes, 4 = wideNodes or compressedNodes
+        bool compressed; // 4-wide only
+        NodeOrder nodeOrder;
 		int current;
         std::vector<TriIndexData> bvhTriangleIndices;
+        std::vector<WoopTriangleData> woopTriangles; // same order as bvhTriangleIndices, empty unless created
     };
-}
\ No newline at end of file
+}
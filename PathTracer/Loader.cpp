@@ -44,7 +44,34 @@ namespace GLSLPathTracer
     static const int kMaxLineLength = 2048;
     int(*Log)(const char* szFormat, ...) = printf;
 
-    bool LoadModel(Scene *scene, const std::string &filename, float materialId)
+    // Translation * rotation about z, y, x (degrees) * scale
+    static glm::mat4 InstanceTransform(const glm::vec3 &position, const glm::vec3 &rotation, const glm::vec3 &scale)
+    {
+        glm::vec3 c(cosf(rotation.x * M_PI / 180.0f), cosf(rotation.y * M_PI / 180.0f), cosf(rotation.z * M_PI / 180.0f));
+        glm::vec3 s(sinf(rotation.x * M_PI / 180.0f), sinf(rotation.y * M_PI / 180.0f), sinf(rotation.z * M_PI / 180.0f));
+
+        glm::mat4 transform(1.0f);
+        transform[0] = glm::vec4(c.y * c.z, c.y * s.z, -s.y, 0.0f) * scale.x;
+        transform[1] = glm::vec4(s.x * s.y * c.z - c.x * s.z, s.x * s.y * s.z + c.x * c.z, s.x * c.y, 0.0f) * scale.y;
+        transform[2] = glm::vec4(c.x * s.y * c.z + s.x * s.z, c.x * s.y * s.z - s.x * c.z, c.x * c.y, 0.0f) * scale.z;
+        transform[3] = glm::vec4(position, 1.0f);
+        return transform;
+    }
+
+    // Octahedral mapping of the unit sphere onto [-1, 1]^2, 16 bits per coordinate
+    static glm::uint EncodeNormal(glm::vec3 n)
+    {
+        float length = fabsf(n.x) + fabsf(n.y) + fabsf(n.z);
+        if (!(length > 0.0f))
+            return glm::packSnorm2x16(glm::vec2(0.0f)); // degenerate, +z
+        n /= length;
+        glm::vec2 p(n.x, n.y);
+        if (n.z < 0.0f)
+            p = glm::vec2((1.0f - fabsf(n.y)) * (n.x >= 0.0f ? 1.0f : -1.0f), (1.0f - fabsf(n.x)) * (n.y >= 0.0f ? 1.0f : -1.0f));
+        return glm::packSnorm2x16(p);
+    }
+
+    bool LoadModel(Scene *scene, const std::string &filename, int materialId)
     {
         tinyobj::attrib_t attrib;
         std::vector<tinyobj::shape_t> shapes;
@@ -58,11 +85,15 @@ namespace GLSLPathTracer
             return false;
         }
 
-        // Load vertices
-        int vertCount = int(attrib.vertices.size() / 3);
+        // Weld the face corners into unique vertices, one per combination of position, normal
+        // and texcoord. The variants of an OBJ position are chained through nextVariant.
+        int objVertCount = int(attrib.vertices.size() / 3);
         size_t vertStartIndex = scene->vertexData.size();
-        for (int i = 0; i < vertCount; i++)
-            scene->vertexData.push_back(VertexData{ glm::vec3(attrib.vertices[3 * i + 0], attrib.vertices[3 * i + 1], attrib.vertices[3 * i + 2]) });
+        size_t triStartIndex = scene->triangleIndices.size();
+        std::vector<int> firstVariant(objVertCount, -1);
+        std::vector<int> nextVariant;
+        std::vector<glm::ivec2> variantKeys; // normal and texcoord index, flat normals get -2 - face
+        int faceIndex = 0;
 
         // Loop over shapes
         for (size_t s = 0; s < shapes.size(); s++)
@@ -70,49 +101,29 @@ namespace GLSLPathTracer
             // Loop over faces(polygon)
             int index_offset = 0;
 
-            for (size_t f = 0; f < shapes[s].mesh.num_face_vertices.size(); f++)
+            for (size_t f = 0; f < shapes[s].mesh.num_face_vertices.size(); f++, faceIndex++)
             {
-                glm::vec4 indices;
+                glm::ivec3 indices;
                 glm::vec3 v[3], n[3], t[3];
                 bool hasNormals = true;
-                float vx, vy, vz, nx, ny, nz, tx, ty;
 
                 int fv = shapes[s].mesh.num_face_vertices[f];
                 for (int i = 0; i < fv; i++)
                 {
                     tinyobj::index_t idx = tinyobj::index_t(shapes[s].mesh.indices[index_offset + i]);
-                    indices[i] = float(vertStartIndex + (3 * idx.vertex_index + i) / 3);
-
-                    vx = attrib.vertices[3 * idx.vertex_index + 0];
-                    vy = attrib.vertices[3 * idx.vertex_index + 1];
-                    vz = attrib.vertices[3 * idx.vertex_index + 2];
+                    v[i] = glm::vec3(attrib.vertices[3 * idx.vertex_index + 0], attrib.vertices[3 * idx.vertex_index + 1], attrib.vertices[3 * idx.vertex_index + 2]);
 
                     //Normals
                     if (idx.normal_index != -1)
-                    {
-                        nx = attrib.normals[3 * idx.normal_index + 0];
-                        ny = attrib.normals[3 * idx.normal_index + 1];
-                        nz = attrib.normals[3 * idx.normal_index + 2];
-                    }
+                        n[i] = glm::vec3(attrib.normals[3 * idx.normal_index + 0], attrib.normals[3 * idx.normal_index + 1], attrib.normals[3 * idx.normal_index + 2]);
                     else
-                    {
                         hasNormals = false;
-                    }
 
-                    //TexCoords
+                    //TexCoords, default to 0 when the model has none
                     if (idx.texcoord_index != -1)
-                    {
-                        tx = attrib.texcoords[2 * idx.texcoord_index + 0];
-                        ty = 1.0f - attrib.texcoords[2 * idx.texcoord_index + 1];
-                    }
+                        t[i] = glm::vec3(attrib.texcoords[2 * idx.texcoord_index + 0], 1.0f - attrib.texcoords[2 * idx.texcoord_index + 1], 0.0f);
                     else
-                    {
-                        //If model has no texture Coords then default to 0
-                        tx = ty = 0;
-                    }
-
-                    n[i] = glm::vec3(nx, ny, nz);
-                    t[i] = glm::vec3(tx, ty, materialId);
+                        t[i] = glm::vec3(0.0f);
                 }
                 if (!hasNormals)
                 {
@@ -121,15 +132,81 @@ namespace GLSLPathTracer
                     n[0] = n[1] = n[2] = flatNormal;
                 }
 
+                for (int i = 0; i < fv; i++)
+                {
+                    tinyobj::index_t idx = tinyobj::index_t(shapes[s].mesh.indices[index_offset + i]);
+                    glm::ivec2 key(hasNormals ? idx.normal_index : -2 - faceIndex, idx.texcoord_index);
+                    int variant = firstVariant[idx.vertex_index];
+                    while (variant != -1 && variantKeys[variant] != key)
+                        variant = nextVariant[variant];
+
+                    if (variant == -1)
+                    {
+                        variant = int(variantKeys.size());
+                        variantKeys.push_back(key);
+                        nextVariant.push_back(firstVariant[idx.vertex_index]);
+                        firstVariant[idx.vertex_index] = variant;
+                        scene->vertexData.push_back(VertexData{ v[i] });
+                        scene->vertexAttribs.push_back(VertexAttribData{ EncodeNormal(n[i]), glm::packHalf2x16(glm::vec2(t[i])) });
+                    }
+                    indices[i] = int(vertStartIndex) + variant;
+                }
+
                 scene->triangleIndices.push_back(TriangleData{ indices });
-                scene->normalTexData.push_back(NormalTexData{ n[0], n[1], n[2], t[0], t[1], t[2] });
+                scene->triangleMaterials.push_back(materialId);
 
                 index_offset += fv;
             }
         }
+
+        int vertCount = int(scene->vertexData.size() - vertStartIndex);
+        scene->meshes.push_back(MeshData{ filename, int(triStartIndex), int(scene->triangleIndices.size() - triStartIndex), int(vertStartIndex), vertCount });
         return true;
     }
 
+    static void ReplicateMesh(Scene *scene, glm::ivec3 count, glm::vec3 spacing)
+    {
+        // Grows the last mesh into a count.x * count.y * count.z grid of real copies, for
+        // stress scenes far larger than any asset we ship
+        MeshData& mesh = scene->meshes.back();
+        long long numCopies = (long long)count.x * count.y * count.z;
+        if (numCopies <= 1)
+            return;
+        if (numCopies * mesh.numTriangles >= (1ll << 31) || numCopies * mesh.numVertices >= (1ll << 31))
+        {
+            Log("Mesh array of %lld copies is too large\n", numCopies);
+            return;
+        }
+
+        scene->vertexData.reserve(scene->vertexData.size() + size_t(numCopies - 1) * mesh.numVertices);
+        scene->triangleIndices.reserve(scene->triangleIndices.size() + size_t(numCopies - 1) * mesh.numTriangles);
+        scene->triangleMaterials.reserve(scene->triangleMaterials.size() + size_t(numCopies - 1) * mesh.numTriangles);
+        scene->vertexAttribs.reserve(scene->vertexAttribs.size() + size_t(numCopies - 1) * mesh.numVertices);
+
+        for (int z = 0; z < count.z; z++)
+            for (int y = 0; y < count.y; y++)
+                for (int x = 0; x < count.x; x++)
+                {
+                    if (x == 0 && y == 0 && z == 0)
+                        continue;
+                    glm::vec3 offset = glm::vec3(x, y, z) * spacing;
+                    int vertexOffset = int(scene->vertexData.size()) - mesh.firstVertex;
+                    for (int i = 0; i < mesh.numVertices; i++)
+                    {
+                        scene->vertexData.push_back(VertexData{ scene->vertexData[mesh.firstVertex + i].vertex + offset });
+                        scene->vertexAttribs.push_back(scene->vertexAttribs[mesh.firstVertex + i]);
+                    }
+                    for (int i = 0; i < mesh.numTriangles; i++)
+                    {
+                        scene->triangleIndices.push_back(TriangleData{ scene->triangleIndices[mesh.firstTriangle + i].indices + vertexOffset });
+                        scene->triangleMaterials.push_back(scene->triangleMaterials[mesh.firstTriangle + i]);
+                    }
+                }
+
+        mesh.numTriangles *= int(numCopies);
+        mesh.numVertices *= int(numCopies);
+    }
+
     Scene* LoadScene(const std::string &filename)
     {
         FILE* file;
@@ -350,18 +427,104 @@ namespace GLSLPathTracer
                     sscanf(line, " maxSamples %i", &scene->renderOptions.maxSamples);
                     sscanf(line, " numTilesX %i", &scene->renderOptions.numTilesX);
                     sscanf(line, " numTilesY %i", &scene->renderOptions.numTilesY);
+                    sscanf(line, " bvhThreads %i", &scene->renderOptions.bvhThreads);
+                    sscanf(line, " bvhObjectBins %i", &scene->renderOptions.bvhObjectBins);
+                    sscanf(line, " bvhTreeletPasses %i", &scene->renderOptions.bvhTreeletPasses);
+                    sscanf(line, " bvhRebuildThreshold %f", &scene->renderOptions.bvhRebuildThreshold);
+
+                    int bvhWidth;
+                    if (sscanf(line, " bvhWidth %i", &bvhWidth) == 1)
+                        scene->renderOptions.bvhWidth = (bvhWidth == 4) ? 4 : 2;
+
+                    int bvhCompressed;
+                    if (sscanf(line, " bvhCompressed %i", &bvhCompressed) == 1)
+                        scene->renderOptions.bvhCompressed = bvhCompressed != 0;
+
+                    char bvhNodeOrder[20];
+                    if (sscanf(line, " bvhNodeOrder %19s", bvhNodeOrder) == 1)
+                    {
+                        if (strcmp(bvhNodeOrder, "largerfirst") == 0)
+                            scene->renderOptions.bvhNodeOrder = NodeOrder_LargerChildFirst;
+                        else if (strcmp(bvhNodeOrder, "breadthfirst") == 0)
+                            scene->renderOptions.bvhNodeOrder = NodeOrder_BreadthFirst;
+                        else if (strcmp(bvhNodeOrder, "veb") == 0)
+                            scene->renderOptions.bvhNodeOrder = NodeOrder_VanEmdeBoas;
+                        else
+                            scene->renderOptions.bvhNodeOrder = NodeOrder_DepthFirst;
+                    }
+
+                    int bvhWoopTriangles;
+                    if (sscanf(line, " bvhWoopTriangles %i", &bvhWoopTriangles) == 1)
+                        scene->renderOptions.bvhWoopTriangles = bvhWoopTriangles != 0;
 
-                    if (strcmp(envMap, "None") != 0)
+                    int bvhQuantizedVertices;
+                    if (sscanf(line, " bvhQuantizedVertices %i", &bvhQuantizedVertices) == 1)
+                        scene->renderOptions.bvhQuantizedVertices = bvhQuantizedVertices != 0;
+
+                    char shadowRays[20];
+                    if (sscanf(line, " shadowRays %19s", shadowRays) == 1)
+                    {
+                        if (strcmp(shadowRays, "off") == 0)
+                            scene->renderOptions.shadowRays = ShadowRays_Off;
+                        else if (strcmp(shadowRays, "nearestfirst") == 0)
+                            scene->renderOptions.shadowRays = ShadowRays_NearestFirst;
+                        else
+                            scene->renderOptions.shadowRays = ShadowRays_AnyHit;
+                    }
+
+                    char lightSampling[20];
+                    if (sscanf(line, " lightSampling %19s", lightSampling) == 1)
+                        scene->renderOptions.lightSampling = strcmp(lightSampling, "uniform") == 0 ? LightSampling_Uniform : LightSampling_Tree;
+
+                    int sampleEmissiveTriangles;
+                    if (sscanf(line, " sampleEmissiveTriangles %i", &sampleEmissiveTriangles) == 1)
+                        scene->renderOptions.sampleEmissiveTriangles = sampleEmissiveTriangles != 0;
+
+                    sscanf(line, " envMapCellSize %i", &scene->renderOptions.envMapCellSize);
+
+                    char envMapFormat[20];
+                    if (sscanf(line, " envMapFormat %19s", envMapFormat) == 1)
                     {
-                        HDRLoader hdrLoader;
-                        hdrLoader.load(envMap, scene->hdrLoaderRes);
-                        scene->renderOptions.useEnvMap = true;
+                        if (strcmp(envMapFormat, "rgb16f") == 0)
+                            scene->renderOptions.envMapFormat = HDR_RGB16F;
+                        else if (strcmp(envMapFormat, "rgb9e5") == 0)
+                            scene->renderOptions.envMapFormat = HDR_RGB9E5;
+                        else
+                            scene->renderOptions.envMapFormat = HDR_RGB32F;
                     }
+
+                    int bvhCache;
+                    if (sscanf(line, " bvhCache %i", &bvhCache) == 1)
+                        scene->renderOptions.bvhCache = bvhCache != 0;
+
+                    char bvhBuilder[20];
+                    if (sscanf(line, " bvhBuilder %19s", bvhBuilder) == 1)
+                    {
+                        if (strcmp(bvhBuilder, "fast") == 0)
+                            scene->renderOptions.bvhBuilder = BVH::Builder_Fast;
+                        else if (strcmp(bvhBuilder, "sah") == 0)
+                            scene->renderOptions.bvhBuilder = BVH::Builder_SAH;
+                        else
+                            scene->renderOptions.bvhBuilder = BVH::Builder_SBVH;
+                    }
+
+                    int bvhBenchmark;
+                    if (sscanf(line, " bvhBenchmark %i", &bvhBenchmark) == 1)
+                        scene->renderOptions.bvhBenchmark = bvhBenchmark != 0;
+
                     if (std::string(rendererType) == "Tiled")
                         scene->renderOptions.rendererType = Renderer_Tiled;
                     else
                         scene->renderOptions.rendererType = Renderer_Progressive;
                 }
+
+                // Loaded once after the whole block, envMapCellSize and envMapFormat may follow envMap
+                if (strcmp(envMap, "None") != 0)
+                {
+                    HDRLoader hdrLoader;
+                    hdrLoader.load(envMap, scene->hdrLoaderRes, scene->renderOptions.envMapCellSize, scene->renderOptions.envMapFormat);
+                    scene->renderOptions.useEnvMap = true;
+                }
             }
 
 
@@ -371,7 +534,10 @@ namespace GLSLPathTracer
             if (strstr(line, "mesh"))
             {
                 std::string meshPath;
-                float materialId = 0.0f; // Default Material ID
+                std::string meshName;
+                int materialId = 0; // Default Material ID
+                glm::ivec3 arrayCount(1);
+                glm::vec3 arraySpacing(0.0f);
                 while (fgets(line, kMaxLineLength, file))
                 {
                     // end group
@@ -386,12 +552,17 @@ namespace GLSLPathTracer
                         meshPath = path;
                     }
 
+                    if (sscanf(line, " name %s", path) == 1)
+                        meshName = path;
+
+                    sscanf(line, " array %d %d %d %f %f %f", &arrayCount.x, &arrayCount.y, &arrayCount.z, &arraySpacing.x, &arraySpacing.y, &arraySpacing.z);
+
                     if (sscanf(line, " material %s", path) == 1)
                     {
                         // look up material in dictionary
                         if (materialMap.find(path) != materialMap.end())
                         {
-                            materialId = float(materialMap[path].id);
+                            materialId = materialMap[path].id;
                         }
                         else
                         {
@@ -406,13 +577,76 @@ namespace GLSLPathTracer
                     {
                         return false;
                     }
+                    ReplicateMesh(scene, arrayCount, arraySpacing);
+                    if (!meshName.empty())
+                        scene->meshes.back().name = meshName;
+                }
+            }
+
+            //--------------------------------------------
+            // Instance of a named mesh. A mesh that has instances is only drawn through them.
+
+            if (strstr(line, "instance"))
+            {
+                std::string meshName;
+                glm::vec3 position(0.0f), rotation(0.0f), scale(1.0f);
+                glm::mat4 transform(1.0f);
+                bool hasTransform = false;
+
+                while (fgets(line, kMaxLineLength, file))
+                {
+                    // end group
+                    if (strchr(line, '}'))
+                        break;
+
+                    if (sscanf(line, " mesh %s", name) == 1)
+                        meshName = name;
+
+                    sscanf(line, " position %f %f %f", &position.x, &position.y, &position.z);
+                    sscanf(line, " rotation %f %f %f", &rotation.x, &rotation.y, &rotation.z);
+                    if (sscanf(line, " scale %f %f %f", &scale.x, &scale.y, &scale.z) == 1)
+                        scale.y = scale.z = scale.x;
+
+                    // 3x4 object to world matrix, row by row
+                    float m[12];
+                    if (sscanf(line, " transform %f %f %f %f %f %f %f %f %f %f %f %f", &m[0], &m[1], &m[2], &m[3], &m[4], &m[5], &m[6], &m[7], &m[8], &m[9], &m[10], &m[11]) == 12)
+                    {
+                        for (int row = 0; row < 3; row++)
+                            for (int col = 0; col < 4; col++)
+                                transform[col][row] = m[row * 4 + col];
+                        hasTransform = true;
+                    }
                 }
+
+                if (!hasTransform)
+                    transform = InstanceTransform(position, rotation, scale);
+
+                int meshID = -1;
+                for (size_t i = 0; i < scene->meshes.size(); i++)
+                    if (scene->meshes[i].name == meshName)
+                        meshID = int(i);
+
+                if (meshID >= 0)
+                    scene->instances.push_back(InstanceData{ meshID, transform });
+                else
+                    Log("Could not find mesh %s\n", meshName.c_str());
             }
         }
 
         if (!cameraAdded)
             scene->camera = defaultCamera;
 
+        // With instancing every mesh becomes an instance, meshes without instance blocks stay where they are
+        if (!scene->instances.empty())
+        {
+            std::vector<bool> instanced(scene->meshes.size(), false);
+            for (size_t i = 0; i < scene->instances.size(); i++)
+                instanced[scene->instances[i].meshID] = true;
+            for (size_t i = 0; i < scene->meshes.size(); i++)
+                if (!instanced[i])
+                    scene->instances.push_back(InstanceData{ int(i), glm::mat4(1.0f) });
+        }
+
         //Load all textures 
         //(Assume for now that all textures have same width and height as their group (albedo, metallic etc))
         int width, height;
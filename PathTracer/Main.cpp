@@ -8,6 +8,7 @@
 
 #include <time.h>
 #include <math.h>
+#include <algorithm>
 
 #include "Scene.h"
 #include "TiledRenderer.h"
@@ -38,6 +39,14 @@ Scene *scene = nullptr;
 Renderer *renderer = nullptr;
 
 RenderOptions renderOptions;
+float pathTraceTimes[3]; // last measured per ShadowRayMode, only comparable within one scene and setup
+
+// Vertex animation through the BVH refit: the scene twists back and forth around the vertical axis
+// through its center, more toward the top. Rest positions are taken when it is switched on, shading
+// normals keep the rest pose
+bool animateVertices = false;
+float animationTime = 0.0f;
+std::vector<glm::vec3> restVertices;
 
 void loadScene(int index)
 {
@@ -51,16 +60,24 @@ void loadScene(int index)
         "hyperion.scene",
         "rank3police.scene",
         "spaceship.scene",
-        "staircase.scene" };
+        "staircase.scene",
+        "instances.scene",
+        "manyLights.scene",
+        "emissiveMesh.scene" };
 
     delete scene;
 	scene = LoadScene(std::string("./assets/")+sceneFilenames[index]);
-    scene->renderOptions = renderOptions;
 	if (!scene)
 	{
 		std::cout << "Unable to load scene\n";
 		exit(0);
 	}
+	// Options from the scene file's Renderer block become the UI state
+	renderOptions = scene->renderOptions;
+	for (int i = 0; i < 3; i++)
+		pathTraceTimes[i] = 0.0f;
+	animateVertices = false;
+	restVertices.clear();
 	std::cout << "Scene Loaded\n\n";
 
 	scene->buildBVH();
@@ -70,14 +87,33 @@ void loadScene(int index)
 	std::cout << "Triangles: " << scene->triangleIndices.size() << std::endl;
 	std::cout << "Triangle Indices: " << scene->gpuBVH->bvhTriangleIndices.size() << std::endl;
 	std::cout << "Vertices: " << scene->vertexData.size() << std::endl;
+	if (scene->isInstanced())
+		std::cout << "Instances: " << scene->instances.size() << " of " << scene->meshes.size() << " meshes" << std::endl;
+	std::cout << "BVH nodes: " << scene->gpuBVH->getNodeBytes() / 1024 << " KB" << std::endl;
+
+	// Welded vertices with encoded normals and half texcoords, plus a material ID per slot
+	long long shading_data_bytes = sizeof(VertexAttribData) * scene->vertexAttribs.size() + scene->leafTriangleMaterials.size();
+	std::cout << "Shading data: " << shading_data_bytes / 1024 << " KB (" << double(shading_data_bytes) / scene->triangleIndices.size() << " bytes per triangle)" << std::endl;
+
+	// Full precision or 16-bit inside their frames
+	long long full_vertex_bytes = sizeof(VertexData) * scene->vertexData.size();
+	long long vertex_bytes = full_vertex_bytes;
+	if (!scene->quantizedVertices.empty())
+	{
+		vertex_bytes = sizeof(QuantizedVertexData) * scene->quantizedVertices.size() + sizeof(VertexFrameData) * scene->vertexFrames.size();
+		std::cout << "Vertex positions: " << vertex_bytes / 1024 << " KB quantized in " << scene->vertexFrames.size() << " frames, " << (full_vertex_bytes - vertex_bytes) / 1024 << " KB saved" << std::endl;
+	}
 
 	long long scene_data_bytes =
-		sizeof(GPUBVHNode) * scene->gpuBVH->bvh->getNumNodes() +
-		sizeof(TriangleData) * scene->gpuBVH->bvhTriangleIndices.size() +
-		sizeof(VertexData) * scene->vertexData.size() +
-		sizeof(NormalTexData) * scene->normalTexData.size() +
-		sizeof(MaterialData) * scene->materialData.size() +
-		sizeof(LightData) * scene->lightData.size();
+		scene->gpuBVH->getNodeBytes() +
+		sizeof(TriIndexData) * scene->gpuBVH->bvhTriangleIndices.size() +
+		sizeof(WoopTriangleData) * scene->gpuBVH->woopTriangles.size() +
+		vertex_bytes +
+		shading_data_bytes +
+		sizeof(glm::vec4) * (5 * scene->lightData.size() + 3 * scene->lightBVHNodes.size()) +
+		sizeof(LightTreeData) * scene->lightTreeData.size() +
+		sizeof(EmissiveTriangleData) * scene->emissiveTriangles.size() +
+		sizeof(GPUInstanceData) * scene->gpuInstanceData.size();
 
 	std::cout << "GPU Memory used for BVH and scene data: " << scene_data_bytes / 1048576 << " MB" << std::endl;
 
@@ -85,7 +121,8 @@ void loadScene(int index)
 		int(scene->texData.albedoTextureSize.x * scene->texData.albedoTextureSize.y) * scene->texData.albedoTexCount * 3 +
 		int(scene->texData.metallicRoughnessTextureSize.x * scene->texData.metallicRoughnessTextureSize.y) * scene->texData.metallicRoughnessTexCount * 3 +
 		int(scene->texData.normalTextureSize.x * scene->texData.normalTextureSize.y) * scene->texData.normalTexCount * 3 +
-		scene->hdrLoaderRes.width * scene->hdrLoaderRes.height * sizeof(GL_FLOAT) * 3;
+		scene->hdrLoaderRes.textureBytes() +
+		scene->hdrLoaderRes.aliasWidth * scene->hdrLoaderRes.aliasHeight * sizeof(glm::uvec2);
 
 	std::cout << "GPU Memory used for Textures: " << tex_data_bytes / 1048576 << " MB" << std::endl;
 
@@ -114,6 +151,35 @@ bool initRenderer()
     return true;
 }
 
+void twistVertices(float maxAngle)
+{
+	glm::vec3 lo = restVertices[0], hi = restVertices[0];
+	for (const glm::vec3& p : restVertices)
+	{
+		lo = glm::min(lo, p);
+		hi = glm::max(hi, p);
+	}
+	glm::vec3 center = 0.5f * (lo + hi);
+	float height = std::max(hi.y - lo.y, 1e-6f);
+
+	std::vector<glm::vec3> moved(restVertices.size());
+	for (size_t i = 0; i < moved.size(); i++)
+	{
+		const glm::vec3& p = restVertices[i];
+		float angle = maxAngle * (p.y - lo.y) / height;
+		float dx = p.x - center.x, dz = p.z - center.z;
+		moved[i] = glm::vec3(center.x + dx * cosf(angle) - dz * sinf(angle), p.y, center.z + dx * sinf(angle) + dz * cosf(angle));
+	}
+	scene->updateVertices(0, int(moved.size()), &moved[0]);
+
+	// A refit only rewrites what moved, a rebuild needs every buffer anew
+	glm::ivec2 changedNodes;
+	if (scene->refitBVH(changedNodes))
+		initRenderer();
+	else
+		renderer->updateGeometry(glm::ivec2(0, int(moved.size())), changedNodes);
+}
+
 void render(GLFWwindow *window)
 {
 	renderer->render();
@@ -160,6 +226,14 @@ void update(float secondsElapsed, GLFWwindow *window)
         scene->camera->isMoving = true;
         ImGui::ResetMouseDragDelta();
     }
+
+	// Moving geometry restarts the accumulation like a moving camera
+	if (animateVertices)
+	{
+		animationTime += secondsElapsed;
+		twistVertices(0.5f * sinf(animationTime));
+		scene->camera->isMoving = true;
+	}
 }
 
 void main()
@@ -228,7 +302,17 @@ void main()
             ImGui::Begin("GLSL PathTracer");                          // Create a window called "Hello, world!" and append into it.
 
             ImGui::Text("Application average %.3f ms/frame (%.1f FPS)", 1000.0f / ImGui::GetIO().Framerate, ImGui::GetIO().Framerate);
-            if (ImGui::Combo("Scene", &currentSceneIndex, "cornell\0ajax\0bathroom\0boy\0coffee\0diningroom\0glassBoy\0hyperion\0rank3police\0spaceship\0staircase\0"))
+
+            // Shadow ray share of the path trace pass: its time with the current mode against shadow rays off
+            float pathTraceTime = renderer->getPathTraceTime();
+            if (pathTraceTime > 0.0f)
+                pathTraceTimes[renderOptions.shadowRays] = pathTraceTime;
+            ImGui::Text("Path trace pass %.3f ms per megapixel", pathTraceTime);
+            float noShadowsTime = pathTraceTimes[ShadowRays_Off];
+            if (renderOptions.shadowRays != ShadowRays_Off && noShadowsTime > 0.0f && pathTraceTime > 0.0f)
+                ImGui::Text("Shadow rays %.3f ms per megapixel (%.0f%%)", pathTraceTime - noShadowsTime, 100.0f * (pathTraceTime - noShadowsTime) / pathTraceTime);
+
+            if (ImGui::Combo("Scene", &currentSceneIndex, "cornell\0ajax\0bathroom\0boy\0coffee\0diningroom\0glassBoy\0hyperion\0rank3police\0spaceship\0staircase\0instances\0manyLights\0emissiveMesh\0"))
             {
                 loadScene(currentSceneIndex);
                 initRenderer();
@@ -243,10 +327,54 @@ void main()
             renderOptionsChanged |= ImGui::InputInt("Tiles Y", &renderOptions.numTilesY);
             renderOptionsChanged |= ImGui::Checkbox("Use envmap", &renderOptions.useEnvMap);
             renderOptionsChanged |= ImGui::InputFloat("HDR multiplier", &renderOptions.hdrMultiplier);
+            bool envMapCellSizeChanged = ImGui::InputInt("Envmap sampling cell size", &renderOptions.envMapCellSize);
+            renderOptionsChanged |= ImGui::Combo("Light sampling", &renderOptions.lightSampling, "Uniform\0Light tree\0");
+            renderOptionsChanged |= ImGui::Checkbox("Sample emissive triangles", &renderOptions.sampleEmissiveTriangles);
+
+            bool wideBVH = renderOptions.bvhWidth == 4;
+            bool bvhLayoutChanged = ImGui::Checkbox("4-wide BVH", &wideBVH);
+            bvhLayoutChanged |= ImGui::Checkbox("Compressed BVH nodes", &renderOptions.bvhCompressed);
+            renderOptions.bvhWidth = (wideBVH || renderOptions.bvhCompressed) ? 4 : 2;
+            bvhLayoutChanged |= ImGui::Checkbox("Woop triangles", &renderOptions.bvhWoopTriangles);
+            bvhLayoutChanged |= ImGui::Checkbox("Quantized vertices", &renderOptions.bvhQuantizedVertices);
+            bvhLayoutChanged |= ImGui::Combo("BVH node order", &renderOptions.bvhNodeOrder, "Depth first\0Larger child first\0Breadth first top\0van Emde Boas\0");
+            bool shadowRaysChanged = ImGui::Combo("Shadow rays", &renderOptions.shadowRays, "Off (timing only)\0Nearest first\0Any hit\0");
+
+            // Instanced scenes rebuild their mesh BVHs instead of refitting, not worth animating
+            if (!scene->isInstanced() && ImGui::Checkbox("Animate vertices (BVH refit)", &animateVertices))
+            {
+                if (animateVertices)
+                {
+                    restVertices.resize(scene->vertexData.size());
+                    for (size_t i = 0; i < restVertices.size(); i++)
+                        restVertices[i] = scene->vertexData[i].vertex;
+                    animationTime = 0.0f;
+                }
+                else
+                {
+                    twistVertices(0.0f);
+                    restVertices.clear();
+                }
+            }
 
-            if (renderOptionsChanged)
+            if (envMapCellSizeChanged)
+            {
+                if (renderOptions.envMapCellSize < 0)
+                    renderOptions.envMapCellSize = 0;
+                if (scene->hdrLoaderRes.cols)
+                    HDRLoader::buildAliasTable(scene->hdrLoaderRes, renderOptions.envMapCellSize);
+                renderOptionsChanged = true;
+            }
+            if (renderOptionsChanged || bvhLayoutChanged)
+            {
+                for (int i = 0; i < 3; i++)
+                    pathTraceTimes[i] = 0.0f;
+            }
+            if (renderOptionsChanged || bvhLayoutChanged || shadowRaysChanged)
             {
                 scene->renderOptions = renderOptions;
+                if (bvhLayoutChanged)
+                    scene->createGPUBVH();
                 initRenderer();
             }
             ImGui::End();
@@ -16,8 +16,21 @@ namespace GLSLPathTracer
         , metallicRoughnessTextures(0)
         , normalTextures(0)
         , hdrTexture(0)
-        , hdrMarginalDistTexture(0)
-        , hdrConditionalDistTexture(0)
+        , hdrAliasTexture(0)
+        , instancesTexture(0)
+        , instanceArrayBuffer(0)
+        , woopTrianglesTexture(0)
+        , woopTriangleBuffer(0)
+        , vertexFramesTexture(0)
+        , vertexFrameBuffer(0)
+        , lightBVHOffset(0)
+        , lightTreeOffset(0)
+        , emissiveTrianglesOffset(0)
+        , pathTraceQuery(0)
+        , pathTraceQueryActive(false)
+        , pathTraceQueryPending(false)
+        , pathTracePixels(0)
+        , pathTraceTime(0.0f)
         , initialized(false)
         , scene(scene)
         , screenSize(scene->renderOptions.resolution)
@@ -40,25 +53,118 @@ namespace GLSLPathTracer
         glDeleteTextures(1, &verticesTexture);
         glDeleteTextures(1, &materialsTexture);
         glDeleteTextures(1, &lightsTexture);
-        glDeleteTextures(1, &normalsTexCoordsTexture);
+        glDeleteTextures(1, &vertexAttribsTexture);
         glDeleteTextures(1, &albedoTextures);
         glDeleteTextures(1, &metallicRoughnessTextures);
         glDeleteTextures(1, &normalTextures);
         glDeleteTextures(1, &hdrTexture);
-        glDeleteTextures(1, &hdrMarginalDistTexture);
-        glDeleteTextures(1, &hdrConditionalDistTexture);
+        glDeleteTextures(1, &hdrAliasTexture);
+        glDeleteTextures(1, &instancesTexture);
+        glDeleteTextures(1, &triangleMaterialsTexture);
+        glDeleteTextures(1, &woopTrianglesTexture);
+        glDeleteTextures(1, &vertexFramesTexture);
 
         glDeleteBuffers(1, &materialArrayBuffer);
         glDeleteBuffers(1, &triangleBuffer);
         glDeleteBuffers(1, &verticesBuffer);
         glDeleteBuffers(1, &lightArrayBuffer);
         glDeleteBuffers(1, &BVHBuffer);
-        glDeleteBuffers(1, &normalTexCoordBuffer);
+        glDeleteBuffers(1, &vertexAttribBuffer);
+        glDeleteBuffers(1, &instanceArrayBuffer);
+        glDeleteBuffers(1, &triangleMaterialBuffer);
+        glDeleteBuffers(1, &woopTriangleBuffer);
+        glDeleteBuffers(1, &vertexFrameBuffer);
+
+        glDeleteQueries(1, &pathTraceQuery);
+        pathTraceQuery = 0;
+        pathTraceQueryActive = false;
+        pathTraceQueryPending = false;
+        pathTraceTime = 0.0f;
 
         initialized = false;
         Log("Renderer finished!\n");
     }
 
+    void Renderer::updateGeometry(glm::ivec2 vertexRange, glm::ivec2 nodeRange)
+    {
+        // Uploads what a refit changed; ranges are [first, last)
+        if (!initialized)
+            return;
+
+        if (vertexRange.y > vertexRange.x)
+        {
+            // Moved vertices can change the frames of any other vertex, quantized ones are all rewritten
+            if (!scene->quantizedVertices.empty())
+            {
+                glBindBuffer(GL_TEXTURE_BUFFER, verticesBuffer);
+                glBufferSubData(GL_TEXTURE_BUFFER, 0, sizeof(QuantizedVertexData) * scene->quantizedVertices.size(), &scene->quantizedVertices[0]);
+                glBindBuffer(GL_TEXTURE_BUFFER, vertexFrameBuffer);
+                glBufferSubData(GL_TEXTURE_BUFFER, 0, sizeof(VertexFrameData) * scene->vertexFrames.size(), &scene->vertexFrames[0]);
+            }
+            else
+            {
+                glBindBuffer(GL_TEXTURE_BUFFER, verticesBuffer);
+                glBufferSubData(GL_TEXTURE_BUFFER, sizeof(VertexData) * vertexRange.x, sizeof(VertexData) * (vertexRange.y - vertexRange.x), &scene->vertexData[vertexRange.x]);
+            }
+
+            // Leaf order has no relation to vertex order, the whole buffer is rewritten
+            if (!scene->gpuBVH->woopTriangles.empty())
+            {
+                glBindBuffer(GL_TEXTURE_BUFFER, woopTriangleBuffer);
+                glBufferSubData(GL_TEXTURE_BUFFER, 0, sizeof(WoopTriangleData) * scene->gpuBVH->woopTriangles.size(), &scene->gpuBVH->woopTriangles[0]);
+            }
+
+            // Same count as before, the emission comes from the materials; the alias table is rebuilt as a whole
+            if (!scene->emissiveTriangles.empty())
+            {
+                glBindBuffer(GL_TEXTURE_BUFFER, lightArrayBuffer);
+                glBufferSubData(GL_TEXTURE_BUFFER, sizeof(glm::vec4) * emissiveTrianglesOffset, sizeof(EmissiveTriangleData) * scene->emissiveTriangles.size(), &scene->emissiveTriangles[0]);
+            }
+        }
+
+        if (nodeRange.y > nodeRange.x)
+        {
+            size_t stride = scene->gpuBVH->getNodeStride();
+            glBindBuffer(GL_TEXTURE_BUFFER, BVHBuffer);
+            glBufferSubData(GL_TEXTURE_BUFFER, stride * nodeRange.x, stride * (nodeRange.y - nodeRange.x), static_cast<const char *>(scene->gpuBVH->getNodeData()) + stride * nodeRange.x);
+        }
+        glBindBuffer(GL_TEXTURE_BUFFER, 0);
+    }
+
+    void Renderer::beginPathTraceTimer(int numPixels)
+    {
+        // One query in flight, its result is picked up once available so the CPU never waits.
+        // Passes started while it is pending go untimed.
+        if (pathTraceQueryPending)
+        {
+            GLint available = 0;
+            glGetQueryObjectiv(pathTraceQuery, GL_QUERY_RESULT_AVAILABLE, &available);
+            if (!available)
+                return;
+
+            // Nanoseconds per pixel are milliseconds per million pixels
+            GLuint64 elapsed = 0;
+            glGetQueryObjectui64v(pathTraceQuery, GL_QUERY_RESULT, &elapsed);
+            float time = float(elapsed) / float(pathTracePixels);
+            pathTraceTime = (pathTraceTime == 0.0f) ? time : 0.9f * pathTraceTime + 0.1f * time;
+            pathTraceQueryPending = false;
+        }
+
+        glBeginQuery(GL_TIME_ELAPSED, pathTraceQuery);
+        pathTracePixels = numPixels;
+        pathTraceQueryActive = true;
+    }
+
+    void Renderer::endPathTraceTimer()
+    {
+        if (!pathTraceQueryActive)
+            return;
+
+        glEndQuery(GL_TIME_ELAPSED);
+        pathTraceQueryActive = false;
+        pathTraceQueryPending = true;
+    }
+
     void Renderer::init()
     {
         if (initialized)
@@ -71,14 +177,15 @@ namespace GLSLPathTracer
         }
 
         quad = new Quad();
+        glGenQueries(1, &pathTraceQuery);
 
         //Create Texture for BVH Tree
         glGenBuffers(1, &BVHBuffer);
         glBindBuffer(GL_TEXTURE_BUFFER, BVHBuffer);
-        glBufferData(GL_TEXTURE_BUFFER, sizeof(GPUBVHNode) * scene->gpuBVH->bvh->getNumNodes(), &scene->gpuBVH->gpuNodes[0], GL_STATIC_DRAW);
+        glBufferData(GL_TEXTURE_BUFFER, scene->gpuBVH->getNodeBytes(), scene->gpuBVH->getNodeData(), GL_STATIC_DRAW);
         glGenTextures(1, &BVHTexture);
         glBindTexture(GL_TEXTURE_BUFFER, BVHTexture);
-        glTexBuffer(GL_TEXTURE_BUFFER, GL_RGB32F, BVHBuffer);
+        glTexBuffer(GL_TEXTURE_BUFFER, scene->gpuBVH->compressed || scene->gpuBVH->width == 4 ? GL_RGBA32I : GL_RGB32I, BVHBuffer);
 
         //Create Buffer and Texture for TriangleIndices
         glGenBuffers(1, &triangleBuffer);
@@ -86,23 +193,56 @@ namespace GLSLPathTracer
         glBufferData(GL_TEXTURE_BUFFER, sizeof(TriIndexData) * scene->gpuBVH->bvhTriangleIndices.size(), &scene->gpuBVH->bvhTriangleIndices[0], GL_STATIC_DRAW);
         glGenTextures(1, &triangleIndicesTexture);
         glBindTexture(GL_TEXTURE_BUFFER, triangleIndicesTexture);
-        glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, triangleBuffer);
+        glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32I, triangleBuffer);
 
-        //Create Buffer and Texture for Vertices
+        //Create Buffer and Texture for the Woop triangles
+        if (!scene->gpuBVH->woopTriangles.empty())
+        {
+            glGenBuffers(1, &woopTriangleBuffer);
+            glBindBuffer(GL_TEXTURE_BUFFER, woopTriangleBuffer);
+            glBufferData(GL_TEXTURE_BUFFER, sizeof(WoopTriangleData) * scene->gpuBVH->woopTriangles.size(), &scene->gpuBVH->woopTriangles[0], GL_STATIC_DRAW);
+            glGenTextures(1, &woopTrianglesTexture);
+            glBindTexture(GL_TEXTURE_BUFFER, woopTrianglesTexture);
+            glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, woopTriangleBuffer);
+        }
+
+        //Create Buffer and Texture for Vertices, full precision as float bits or quantized inside their frames
+        bool quantized = !scene->quantizedVertices.empty();
         glGenBuffers(1, &verticesBuffer);
         glBindBuffer(GL_TEXTURE_BUFFER, verticesBuffer);
-        glBufferData(GL_TEXTURE_BUFFER, sizeof(VertexData) * scene->vertexData.size(), &scene->vertexData[0], GL_STATIC_DRAW);
+        if (quantized)
+            glBufferData(GL_TEXTURE_BUFFER, sizeof(QuantizedVertexData) * scene->quantizedVertices.size(), &scene->quantizedVertices[0], GL_STATIC_DRAW);
+        else
+            glBufferData(GL_TEXTURE_BUFFER, sizeof(VertexData) * scene->vertexData.size(), &scene->vertexData[0], GL_STATIC_DRAW);
         glGenTextures(1, &verticesTexture);
         glBindTexture(GL_TEXTURE_BUFFER, verticesTexture);
-        glTexBuffer(GL_TEXTURE_BUFFER, GL_RGB32F, verticesBuffer);
+        glTexBuffer(GL_TEXTURE_BUFFER, quantized ? GL_RGBA16UI : GL_RGB32UI, verticesBuffer);
+
+        if (quantized)
+        {
+            glGenBuffers(1, &vertexFrameBuffer);
+            glBindBuffer(GL_TEXTURE_BUFFER, vertexFrameBuffer);
+            glBufferData(GL_TEXTURE_BUFFER, sizeof(VertexFrameData) * scene->vertexFrames.size(), &scene->vertexFrames[0], GL_STATIC_DRAW);
+            glGenTextures(1, &vertexFramesTexture);
+            glBindTexture(GL_TEXTURE_BUFFER, vertexFramesTexture);
+            glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32UI, vertexFrameBuffer);
+        }
 
-        //Create Buffer and Normals and TexCoords
-        glGenBuffers(1, &normalTexCoordBuffer);
-        glBindBuffer(GL_TEXTURE_BUFFER, normalTexCoordBuffer);
-        glBufferData(GL_TEXTURE_BUFFER, sizeof(NormalTexData) * scene->normalTexData.size(), &scene->normalTexData[0], GL_STATIC_DRAW);
-        glGenTextures(1, &normalsTexCoordsTexture);
-        glBindTexture(GL_TEXTURE_BUFFER, normalsTexCoordsTexture);
-        glTexBuffer(GL_TEXTURE_BUFFER, GL_RGB32F, normalTexCoordBuffer);
+        //Create Buffer and Texture for the encoded normals and TexCoords of the vertices
+        glGenBuffers(1, &vertexAttribBuffer);
+        glBindBuffer(GL_TEXTURE_BUFFER, vertexAttribBuffer);
+        glBufferData(GL_TEXTURE_BUFFER, sizeof(VertexAttribData) * scene->vertexAttribs.size(), &scene->vertexAttribs[0], GL_STATIC_DRAW);
+        glGenTextures(1, &vertexAttribsTexture);
+        glBindTexture(GL_TEXTURE_BUFFER, vertexAttribsTexture);
+        glTexBuffer(GL_TEXTURE_BUFFER, GL_RG32UI, vertexAttribBuffer);
+
+        //Create Buffer and Texture for the material ID of each triangle
+        glGenBuffers(1, &triangleMaterialBuffer);
+        glBindBuffer(GL_TEXTURE_BUFFER, triangleMaterialBuffer);
+        glBufferData(GL_TEXTURE_BUFFER, scene->leafTriangleMaterials.size(), &scene->leafTriangleMaterials[0], GL_STATIC_DRAW);
+        glGenTextures(1, &triangleMaterialsTexture);
+        glBindTexture(GL_TEXTURE_BUFFER, triangleMaterialsTexture);
+        glTexBuffer(GL_TEXTURE_BUFFER, scene->triangleMaterialBytes == 2 ? GL_R16UI : GL_R32UI, triangleMaterialBuffer);
 
         //Create Buffer and Texture for Materials
         glGenBuffers(1, &materialArrayBuffer);
@@ -112,17 +252,56 @@ namespace GLSLPathTracer
         glBindTexture(GL_TEXTURE_BUFFER, materialsTexture);
         glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, materialArrayBuffer);
 
-        //Create Buffer and Texture for Lights
+        //Create Buffer and Texture for Lights. The light BVH, the light tree and the emissive triangles with
+        //their alias table follow in the same RGBA32F texels, which keeps the path trace pass within the 16
+        //texture units GL 3.3 guarantees. Lights and light BVH nodes take a texel per vec3, node links are float bits
         numOfLights = int(scene->lightData.size());
-
-        if (numOfLights > 0)
+        lightArrayBuffer = lightsTexture = 0;
+        if (numOfLights > 0 || !scene->emissiveTriangles.empty())
         {
+            std::vector<glm::vec4> lightTexels;
+            for (const LightData& light : scene->lightData)
+            {
+                lightTexels.push_back(glm::vec4(light.position, 0.0f));
+                lightTexels.push_back(glm::vec4(light.emission, 0.0f));
+                lightTexels.push_back(glm::vec4(light.u, 0.0f));
+                lightTexels.push_back(glm::vec4(light.v, 0.0f));
+                lightTexels.push_back(glm::vec4(light.radiusAreaType, 0.0f));
+            }
+
+            lightBVHOffset = int(lightTexels.size());
+            for (const GPUBVHNode& node : scene->lightBVHNodes)
+            {
+                lightTexels.push_back(glm::vec4(node.BBoxMin, 0.0f));
+                lightTexels.push_back(glm::vec4(node.BBoxMax, 0.0f));
+                lightTexels.push_back(glm::vec4(glm::intBitsToFloat(node.LRLeaf), 0.0f));
+            }
+
+            lightTreeOffset = int(lightTexels.size());
+            const glm::vec4 *treeTexels = reinterpret_cast<const glm::vec4 *>(scene->lightTreeData.data());
+            lightTexels.insert(lightTexels.end(), treeTexels, treeTexels + 2 * scene->lightTreeData.size());
+
+            emissiveTrianglesOffset = int(lightTexels.size());
+            const glm::vec4 *emissiveTexels = reinterpret_cast<const glm::vec4 *>(scene->emissiveTriangles.data());
+            lightTexels.insert(lightTexels.end(), emissiveTexels, emissiveTexels + 4 * scene->emissiveTriangles.size());
+
             glGenBuffers(1, &lightArrayBuffer);
             glBindBuffer(GL_TEXTURE_BUFFER, lightArrayBuffer);
-            glBufferData(GL_TEXTURE_BUFFER, sizeof(LightData) * scene->lightData.size(), &scene->lightData[0], GL_STATIC_DRAW);
+            glBufferData(GL_TEXTURE_BUFFER, sizeof(glm::vec4) * lightTexels.size(), &lightTexels[0], GL_STATIC_DRAW);
             glGenTextures(1, &lightsTexture);
             glBindTexture(GL_TEXTURE_BUFFER, lightsTexture);
-            glTexBuffer(GL_TEXTURE_BUFFER, GL_RGB32F, lightArrayBuffer);
+            glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, lightArrayBuffer);
+        }
+
+        //Create Buffer and Texture for Instances
+        if (!scene->gpuInstanceData.empty())
+        {
+            glGenBuffers(1, &instanceArrayBuffer);
+            glBindBuffer(GL_TEXTURE_BUFFER, instanceArrayBuffer);
+            glBufferData(GL_TEXTURE_BUFFER, sizeof(GPUInstanceData) * scene->gpuInstanceData.size(), &scene->gpuInstanceData[0], GL_STATIC_DRAW);
+            glGenTextures(1, &instancesTexture);
+            glBindTexture(GL_TEXTURE_BUFFER, instancesTexture);
+            glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, instanceArrayBuffer);
         }
 
         // Albedo Texture
@@ -162,23 +341,35 @@ namespace GLSLPathTracer
         // Environment Map
         if (scene->renderOptions.useEnvMap)
         {
+            const HDRLoaderResult& hdr = scene->hdrLoaderRes;
             glGenTextures(1, &hdrTexture);
             glBindTexture(GL_TEXTURE_2D, hdrTexture);
-            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB32F, scene->hdrLoaderRes.width, scene->hdrLoaderRes.height, 0, GL_RGB, GL_FLOAT, scene->hdrLoaderRes.cols);
+            if (hdr.format == HDR_RGB32F)
+                glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB32F, hdr.width, hdr.height, 0, GL_RGB, GL_FLOAT, hdr.cols);
+            else
+            {
+                // Packed by HDRLoader::convert, every mip level after the other. Rows of 6 byte
+                // texels are only 2 byte aligned
+                const unsigned char *texels = hdr.packedCols;
+                glPixelStorei(GL_UNPACK_ALIGNMENT, 2);
+                for (int level = 0; level < hdr.numLevels; level++)
+                {
+                    if (hdr.format == HDR_RGB16F)
+                        glTexImage2D(GL_TEXTURE_2D, level, GL_RGB16F, hdr.levelWidth(level), hdr.levelHeight(level), 0, GL_RGB, GL_HALF_FLOAT, texels);
+                    else
+                        glTexImage2D(GL_TEXTURE_2D, level, GL_RGB9_E5, hdr.levelWidth(level), hdr.levelHeight(level), 0, GL_RGB, GL_UNSIGNED_INT_5_9_9_9_REV, texels);
+                    texels += (size_t)hdr.levelWidth(level) * hdr.levelHeight(level) * hdr.texelBytes();
+                }
+                glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+            }
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, hdr.numLevels - 1);
             glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, hdr.numLevels > 1 ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR);
             glBindTexture(GL_TEXTURE_2D, 0);
 
-            glGenTextures(1, &hdrMarginalDistTexture);
-            glBindTexture(GL_TEXTURE_1D, hdrMarginalDistTexture);
-            glTexImage1D(GL_TEXTURE_1D, 0, GL_RG32F, scene->hdrLoaderRes.height, 0, GL_RG, GL_FLOAT, scene->hdrLoaderRes.marginalDistData);
-            glTexParameteri(GL_TEXTURE_1D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-            glTexParameteri(GL_TEXTURE_1D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-            glBindTexture(GL_TEXTURE_1D, 0);
-
-            glGenTextures(1, &hdrConditionalDistTexture);
-            glBindTexture(GL_TEXTURE_2D, hdrConditionalDistTexture);
-            glTexImage2D(GL_TEXTURE_2D, 0, GL_RG32F, scene->hdrLoaderRes.width, scene->hdrLoaderRes.height, 0, GL_RG, GL_FLOAT, scene->hdrLoaderRes.conditionalDistData);
+            glGenTextures(1, &hdrAliasTexture);
+            glBindTexture(GL_TEXTURE_2D, hdrAliasTexture);
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_RG32UI, scene->hdrLoaderRes.aliasWidth, scene->hdrLoaderRes.aliasHeight, 0, GL_RG_INTEGER, GL_UNSIGNED_INT, scene->hdrLoaderRes.aliasData);
             glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
             glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
             glBindTexture(GL_TEXTURE_2D, 0);
@@ -3,6 +3,7 @@
 #include "Quad.h"
 #include "Program.h"
 #include "GPUBVH.h"
+#include "hdrloader.h"
 #include "Loader.h"
 #include "SOIL.h"
 
@@ -16,6 +17,19 @@ namespace GLSLPathTracer
         Renderer_Tiled,
     };
 
+    enum ShadowRayMode
+    {
+        ShadowRays_Off,          // lights are never occluded, only a baseline for timing shadow rays
+        ShadowRays_NearestFirst, // children in order of entry distance, as closest hit rays visit them
+        ShadowRays_AnyHit,       // children unordered, the first occluder ends the ray
+    };
+
+    enum LightSamplingMode
+    {
+        LightSampling_Uniform, // every light equally likely
+        LightSampling_Tree,    // down the light tree by the importance of each subtree at the shading point
+    };
+
     struct RenderOptions
     {
         RenderOptions()
@@ -28,6 +42,23 @@ namespace GLSLPathTracer
             useEnvMap = false;
             resolution = glm::vec2(500, 500);
             hdrMultiplier = 1.0f;
+            bvhThreads = 0;
+            bvhBenchmark = false;
+            bvhObjectBins = 0;
+            bvhBuilder = BVH::Builder_SBVH;
+            bvhTreeletPasses = 0;
+            bvhWidth = 2;
+            bvhCompressed = false;
+            bvhNodeOrder = NodeOrder_DepthFirst;
+            bvhWoopTriangles = false;
+            bvhQuantizedVertices = false;
+            bvhCache = true;
+            bvhRebuildThreshold = 1.5f;
+            shadowRays = ShadowRays_AnyHit;
+            lightSampling = LightSampling_Tree;
+            sampleEmissiveTriangles = true;
+            envMapCellSize = 0;
+            envMapFormat = HDR_RGB32F;
         }
         //std::string rendererType;
         int rendererType; // see RendererType
@@ -38,15 +69,41 @@ namespace GLSLPathTracer
         int numTilesY;
         bool useEnvMap;
         float hdrMultiplier;
+        int bvhThreads; // 0 = all hardware threads
+        bool bvhBenchmark;
+        int bvhObjectBins; // 0 = sort and sweep every object split candidate
+        int bvhBuilder; // see BVH::BuilderType
+        int bvhTreeletPasses; // SAH optimization passes after the build, 0 = off
+        int bvhWidth; // 2 = binary nodes, 4 = collapsed 4-wide nodes
+        bool bvhCompressed; // quantized 4-wide nodes, implies bvhWidth 4
+        int bvhNodeOrder; // see NodeOrder
+        bool bvhWoopTriangles; // leaves intersect precomputed triangle records instead of fetching vertices, 48 bytes per triangle
+        bool bvhQuantizedVertices; // 16-bit vertex positions, 8 bytes per vertex instead of 12, not used with Woop triangles
+        bool bvhCache; // load and save the finished BVH next to the scene file
+        float bvhRebuildThreshold; // refits rebuild the BVH once its SAH cost grows past this factor
+        int shadowRays; // see ShadowRayMode
+        int lightSampling; // see LightSamplingMode
+        bool sampleEmissiveTriangles; // light samples on triangles with material emission, not only BSDF hits
+        int envMapCellSize; // pixels per side of the cells the envmap is importance sampled over, larger needs less memory. 0 picks 2 for maps over 4K wide, else 1
+        int envMapFormat; // see HDRFormat, applied when the envmap is loaded
     };
     class Scene;
     class Renderer
     {
     protected:
         const Scene *scene;
-        GLuint BVHTexture, triangleIndicesTexture, verticesTexture, materialsTexture, lightsTexture, normalsTexCoordsTexture;
-        GLuint albedoTextures, metallicRoughnessTextures, normalTextures, hdrTexture, hdrMarginalDistTexture, hdrConditionalDistTexture;
-        GLuint materialArrayBuffer, triangleBuffer, verticesBuffer, lightArrayBuffer, BVHBuffer, normalTexCoordBuffer;
+        GLuint BVHTexture, triangleIndicesTexture, verticesTexture, materialsTexture, lightsTexture, vertexAttribsTexture;
+        GLuint albedoTextures, metallicRoughnessTextures, normalTextures, hdrTexture, hdrAliasTexture;
+        GLuint materialArrayBuffer, triangleBuffer, verticesBuffer, lightArrayBuffer, BVHBuffer, vertexAttribBuffer;
+        GLuint instancesTexture, instanceArrayBuffer;
+        GLuint triangleMaterialsTexture, triangleMaterialBuffer;
+        GLuint woopTrianglesTexture, woopTriangleBuffer;
+        GLuint vertexFramesTexture, vertexFrameBuffer;
+        int lightBVHOffset, lightTreeOffset, emissiveTrianglesOffset; // in texels of lightsTexture
+        GLuint pathTraceQuery;
+        bool pathTraceQueryActive, pathTraceQueryPending;
+        int pathTracePixels;
+        float pathTraceTime;
         Quad *quad;
         int numOfLights;
         glm::ivec2 screenSize;
@@ -59,6 +116,10 @@ namespace GLSLPathTracer
 
         virtual void init();
         virtual void finish();
+        void updateGeometry(glm::ivec2 vertexRange, glm::ivec2 nodeRange); // after Scene::refitBVH
+        void beginPathTraceTimer(int numPixels);
+        void endPathTraceTimer();
+        float getPathTraceTime() const { return pathTraceTime; } // GPU ms per million pixels of the path trace pass, smoothed, 0 until measured
 
         virtual void render() = 0;
         virtual void present() const = 0;
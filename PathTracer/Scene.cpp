@@ -1,10 +1,132 @@
+#include <algorithm>
+#include <cmath>
 #include <iostream>
+#include <random>
 
 #include "Scene.h"
+#include "Benchmark.h"
+#include "BVHCache.h"
 #include "Camera.h"
+#include "Sort.h"
+#include "TaskPool.h"
+#include "Timer.h"
 
 namespace GLSLPathTracer
 {
+    static const int VertexFrameTriangles = 64; // triangle references per vertex frame, before the frame indices run out of 16 bits
+
+    int VertexClusterSize(long long numReferences, int numTrees)
+    {
+        // Every tree rounds its last frame up
+        int clusterSize = VertexFrameTriangles;
+        while (numReferences / clusterSize + numTrees > 65536)
+            clusterSize *= 2;
+        return clusterSize;
+    }
+
+    static LightTreeData GetLightTreeData(const LightData &light, int index)
+    {
+        // Quads emit on the side of cross(u, v), spheres everywhere. Power is luminance times area
+        LightTreeData data;
+        data.axis = light.radiusAreaType.z == 0.0f ? glm::normalize(glm::cross(light.u, light.v)) : glm::vec3(0.0f, 0.0f, 1.0f);
+        data.cosThetaO = light.radiusAreaType.z == 0.0f ? 1.0f : -1.0f;
+        data.power = Luminance(light.emission) * light.radiusAreaType.y;
+        data.cosThetaE = 0.0f;
+        data.firstLight = index;
+        data.padding = 0.0f;
+        return data;
+    }
+
+    static LightTreeData MergeLightTreeData(const LightTreeData &a, const LightTreeData &b)
+    {
+        // Smallest cone around both normal cones, as in Conty and Kulla's light tree
+        LightTreeData merged = a.cosThetaO <= b.cosThetaO ? a : b;
+        const LightTreeData &narrow = a.cosThetaO <= b.cosThetaO ? b : a;
+        merged.power = a.power + b.power;
+        merged.cosThetaE = std::min(a.cosThetaE, b.cosThetaE);
+        merged.firstLight = std::min(a.firstLight, b.firstLight);
+
+        float wideTheta = acosf(glm::clamp(merged.cosThetaO, -1.0f, 1.0f));
+        float narrowTheta = acosf(glm::clamp(narrow.cosThetaO, -1.0f, 1.0f));
+        float thetaD = acosf(glm::clamp(glm::dot(merged.axis, narrow.axis), -1.0f, 1.0f));
+        if (std::min(thetaD + narrowTheta, Pi) <= wideTheta)
+            return merged;
+
+        float thetaO = 0.5f * (wideTheta + thetaD + narrowTheta);
+        glm::vec3 rotationAxis = glm::cross(merged.axis, narrow.axis);
+        if (thetaO >= Pi || glm::dot(rotationAxis, rotationAxis) < 1e-12f)
+        {
+            merged.cosThetaO = -1.0f;
+            return merged;
+        }
+
+        // Turn the wider cone toward the other one by the growth of its half angle
+        float thetaR = thetaO - wideTheta;
+        merged.axis = glm::normalize(merged.axis * cosf(thetaR) + glm::cross(glm::normalize(rotationAxis), merged.axis) * sinf(thetaR));
+        merged.cosThetaO = cosf(thetaO);
+        return merged;
+    }
+
+    static void GetLightBounds(const LightData &light, glm::vec3 &lo, glm::vec3 &hi)
+    {
+        if (light.radiusAreaType.z == 0.0f) // Quad, flat boxes are fine for the slab tests
+        {
+            glm::vec3 far = light.position + light.u + light.v;
+            lo = glm::min(glm::min(light.position, far), glm::min(light.position + light.u, light.position + light.v));
+            hi = glm::max(glm::max(light.position, far), glm::max(light.position + light.u, light.position + light.v));
+        }
+        else
+        {
+            lo = light.position - glm::vec3(light.radiusAreaType.x);
+            hi = light.position + glm::vec3(light.radiusAreaType.x);
+        }
+    }
+
+    static int BuildLightNode(std::vector<LightData> &lights, int lo, int hi, std::vector<GPUBVHNode> &nodes, std::vector<LightTreeData> &tree)
+    {
+        // Median split along the widest axis of the light centers, nodes in depth first order
+        int index = int(nodes.size());
+        nodes.push_back(GPUBVHNode());
+        tree.push_back(LightTreeData());
+
+        glm::vec3 boundsLo(FW_F32_MAX), boundsHi(-FW_F32_MAX), centersLo(FW_F32_MAX), centersHi(-FW_F32_MAX);
+        for (int i = lo; i < hi; i++)
+        {
+            glm::vec3 lightLo, lightHi;
+            GetLightBounds(lights[i], lightLo, lightHi);
+            boundsLo = glm::min(boundsLo, lightLo);
+            boundsHi = glm::max(boundsHi, lightHi);
+            centersLo = glm::min(centersLo, lightLo + lightHi);
+            centersHi = glm::max(centersHi, lightLo + lightHi);
+        }
+        nodes[index].BBoxMin = boundsLo;
+        nodes[index].BBoxMax = boundsHi;
+
+        if (hi - lo == 1)
+        {
+            nodes[index].LRLeaf = glm::ivec3(lo, 1, 1);
+            tree[index] = GetLightTreeData(lights[lo], lo);
+            return index;
+        }
+
+        glm::vec3 extent = centersHi - centersLo;
+        int axis = (extent.x > extent.y) ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+        int mid = (lo + hi) / 2;
+        std::nth_element(lights.begin() + lo, lights.begin() + mid, lights.begin() + hi, [axis](const LightData &a, const LightData &b)
+        {
+            glm::vec3 aLo, aHi, bLo, bHi;
+            GetLightBounds(a, aLo, aHi);
+            GetLightBounds(b, bLo, bHi);
+            return aLo[axis] + aHi[axis] < bLo[axis] + bHi[axis];
+        });
+
+        int left = BuildLightNode(lights, lo, mid, nodes, tree);
+        int right = BuildLightNode(lights, mid, hi, nodes, tree);
+        nodes[index].LRLeaf = glm::ivec3(left, right, 0);
+        tree[index] = MergeLightTreeData(tree[left], tree[right]);
+        return index;
+    }
+
     void Scene::addCamera(glm::vec3 pos, glm::vec3 lookAt, float fov)
     {
         delete camera;
@@ -20,6 +142,15 @@ namespace GLSLPathTracer
     }
     void Scene::buildBVH()
     {
+        buildLightBVH();
+        buildEmissiveTriangles();
+
+        if (isInstanced())
+        {
+            buildInstancedBVH();
+            return;
+        }
+
         Array<GPUScene::Triangle> tris;
         Array<Vec3f> verts;
         tris.clear();
@@ -31,7 +162,7 @@ namespace GLSLPathTracer
         int triCount = int(triangleIndices.size());
         for (int i = 0; i < triCount; i++) {
             GPUScene::Triangle newtri;
-            newtri.vertices = Vec3i(int(triangleIndices[i].indices.x), int(triangleIndices[i].indices.y), int(triangleIndices[i].indices.z));
+            newtri.vertices = Vec3i(triangleIndices[i].indices.x, triangleIndices[i].indices.y, triangleIndices[i].indices.z);
             tris.add(newtri);
         }
 
@@ -44,15 +175,637 @@ namespace GLSLPathTracer
         std::cout << "Building a new GPU Scene\n";
         gpuScene = new GPUScene(triCount, verCount, tris, verts);
 
-        std::cout << "Building BVH with spatial splits\n";
         // create a default platform
         Platform defaultplatform;
-        BVH::BuildParams defaultparams;
+        BVH::BuildParams defaultparams = getBuildParams();
         BVH::Stats stats;
-        bvh = new BVH(gpuScene, defaultplatform, defaultparams);
+        defaultparams.stats = &stats;
+
+        if (renderOptions.bvhBenchmark)
+            benchmarkBVH(defaultplatform);
+
+        std::string cacheFilename = filename + ".bvhcache";
+        unsigned long long cacheKey = 0;
+        bvh = nullptr;
+        if (renderOptions.bvhCache)
+        {
+            cacheKey = BVHCacheKey(gpuScene, defaultplatform, defaultparams);
+            bvh = LoadBVHCache(cacheFilename, cacheKey, gpuScene, defaultplatform);
+        }
+
+        if (!bvh)
+        {
+            const char* builderNames[] = { "with spatial splits", "with object splits", "from Morton codes" };
+            std::cout << "Building BVH " << builderNames[renderOptions.bvhBuilder] << "\n";
+            bvh = new BVH(gpuScene, defaultplatform, defaultparams);
+            stats.print();
+
+            if (renderOptions.bvhCache)
+                SaveBVHCache(cacheFilename, cacheKey, bvh, defaultparams);
+        }
+
+        createGPUBVH();
+    }
+
+    void Scene::buildLightBVH()
+    {
+        // Emitter hits of every ray go through this instead of a loop over all lights, and light
+        // sampling descends it by importance. A light per leaf keeps the pick pdf a product of the
+        // child probabilities on the way down
+        lightBVHNodes.clear();
+        lightTreeData.clear();
+        if (!lightData.empty())
+            BuildLightNode(lightData, 0, int(lightData.size()), lightBVHNodes, lightTreeData);
+    }
+
+    void Scene::buildEmissiveTriangles()
+    {
+        // Every triangle with material emission, in world space so placed instances each get theirs
+        emissiveTriangles.clear();
+        emissivePower = 0.0f;
+        std::vector<float> powers;
+        auto addTriangles = [&](int firstTriangle, int numTriangles, const glm::mat4 &transform)
+        {
+            for (int i = firstTriangle; i < firstTriangle + numTriangles; i++)
+            {
+                const glm::vec4& emission = materialData[triangleMaterials[i]].emission;
+                if (Luminance(glm::vec3(emission)) <= 0.0f)
+                    continue;
+
+                const glm::ivec3& indices = triangleIndices[i].indices;
+                EmissiveTriangleData triangle = {};
+                triangle.v0 = glm::vec3(transform * glm::vec4(vertexData[indices.x].vertex, 1.0f));
+                triangle.edge1 = glm::vec3(transform * glm::vec4(vertexData[indices.y].vertex, 1.0f)) - triangle.v0;
+                triangle.edge2 = glm::vec3(transform * glm::vec4(vertexData[indices.z].vertex, 1.0f)) - triangle.v0;
+                triangle.emission = emission;
+                triangle.padding = 0.0f;
+                float power = Luminance(glm::vec3(emission)) * 0.5f * glm::length(glm::cross(triangle.edge1, triangle.edge2));
+                if (power <= 0.0f)
+                    continue;
+                emissiveTriangles.push_back(triangle);
+                powers.push_back(power);
+                emissivePower += power;
+            }
+        };
+        if (isInstanced())
+        {
+            for (const InstanceData& instance : instances)
+                addTriangles(meshes[instance.meshID].firstTriangle, meshes[instance.meshID].numTriangles, instance.transform);
+        }
+        else
+            addTriangles(0, int(triangleIndices.size()), glm::mat4(1.0f));
+
+        // Alias table after Vose: every slot keeps its own triangle below the threshold and hands the
+        // rest of its 1/n to a triangle with more than its share
+        int n = int(emissiveTriangles.size());
+        std::vector<int> underfull, overfull;
+        for (int i = 0; i < n; i++)
+        {
+            powers[i] *= n / emissivePower;
+            (powers[i] < 1.0f ? underfull : overfull).push_back(i);
+        }
+        while (!underfull.empty() && !overfull.empty())
+        {
+            int less = underfull.back(), more = overfull.back();
+            underfull.pop_back();
+            emissiveTriangles[less].aliasThreshold = powers[less];
+            emissiveTriangles[less].alias = more;
+            powers[more] -= 1.0f - powers[less];
+            if (powers[more] < 1.0f)
+            {
+                overfull.pop_back();
+                underfull.push_back(more);
+            }
+        }
+        // What is left is 1 up to rounding
+        underfull.insert(underfull.end(), overfull.begin(), overfull.end());
+        for (int i : underfull)
+        {
+            emissiveTriangles[i].aliasThreshold = 1.0f;
+            emissiveTriangles[i].alias = i;
+        }
+
+        if (n > 0)
+            std::cout << n << " emissive triangles\n";
+    }
+
+    void Scene::buildInstancedBVH()
+    {
+        delete gpuBVH;
+        delete bvh;
+        delete gpuScene;
+        gpuBVH = nullptr;
+
+        FW::Timer timer(true);
+        Platform platform;
+        BVH::BuildParams params = getBuildParams();
+        params.enablePrints = false;
+        if (renderOptions.bvhBenchmark)
+            std::cout << "BVH benchmark is not available for instanced scenes\n";
+
+        // One BVH per unique mesh, built once however many times it is placed
+        std::vector<MeshBVH> meshBVHs;
+        std::vector<BVH *> meshTrees;
+        long long numReferences = 0;
+        for (size_t m = 0; m < meshes.size(); m++)
+        {
+            const MeshData& mesh = meshes[m];
+            Array<GPUScene::Triangle> tris;
+            Array<Vec3f> verts;
+            for (int i = 0; i < mesh.numTriangles; i++)
+            {
+                GPUScene::Triangle tri;
+                const glm::ivec3& indices = triangleIndices[mesh.firstTriangle + i].indices;
+                tri.vertices = Vec3i(indices.x - mesh.firstVertex, indices.y - mesh.firstVertex, indices.z - mesh.firstVertex);
+                tris.add(tri);
+            }
+            for (int i = 0; i < mesh.numVertices; i++)
+            {
+                const glm::vec3& v = vertexData[mesh.firstVertex + i].vertex;
+                verts.add(Vec3f(v.x, v.y, v.z));
+            }
+
+            GPUScene *meshScene = new GPUScene(mesh.numTriangles, mesh.numVertices, tris, verts);
+            BVH *meshBVH = new BVH(meshScene, platform, params);
+            meshBVHs.push_back(MeshBVH{ meshBVH, mesh.firstTriangle, mesh.firstVertex });
+            meshTrees.push_back(meshBVH);
+            numReferences += meshBVH->getTriIndices().getSize();
+        }
+
+        // In object space like the mesh trees, which get padded before the top level takes their bounds
+        quantizedVertices.clear();
+        vertexFrames.clear();
+        if (renderOptions.bvhQuantizedVertices && !renderOptions.bvhWoopTriangles && meshes.size() < 65536)
+        {
+            quantizedVertices.resize(vertexData.size());
+            int clusterSize = VertexClusterSize(numReferences, int(meshes.size()));
+            for (size_t m = 0; m < meshTrees.size(); m++)
+                quantizeVertices(meshTrees[m], meshBVHs[m].firstVertex, clusterSize);
+        }
+
+        std::vector<AABB> meshBounds;
+        for (size_t m = 0; m < meshTrees.size(); m++)
+            meshBounds.push_back(meshTrees[m]->getBounds());
+
+        // Top level over the world space bounds of the instances. Every instance is a degenerate
+        // triangle spanning its box, one per leaf. Spatial splits would clip those triangles, so
+        // the top level uses object splits only.
+        Array<GPUScene::Triangle> tris;
+        Array<Vec3f> verts;
+        for (size_t i = 0; i < instances.size(); i++)
+        {
+            const AABB& local = meshBounds[instances[i].meshID];
+            AABB world;
+            for (int corner = 0; corner < 8; corner++)
+            {
+                glm::vec4 p((corner & 1) ? local.max().x : local.min().x, (corner & 2) ? local.max().y : local.min().y, (corner & 4) ? local.max().z : local.min().z, 1.0f);
+                p = instances[i].transform * p;
+                world.grow(Vec3f(p.x, p.y, p.z));
+            }
+
+            GPUScene::Triangle tri;
+            tri.vertices = Vec3i(int(2 * i), int(2 * i + 1), int(2 * i + 1));
+            tris.add(tri);
+            verts.add(world.min());
+            verts.add(world.max());
+        }
+
+        Platform topPlatform;
+        topPlatform.setLeafPreferences(1, 1);
+        BVH::BuildParams topParams = params;
+        topParams.builder = (params.builder == BVH::Builder_Fast) ? BVH::Builder_Fast : BVH::Builder_SAH;
+        topParams.objectSplitBins = 0;
+        gpuScene = new GPUScene(tris.getSize(), verts.getSize(), tris, verts);
+        bvh = new BVH(gpuScene, topPlatform, topParams);
+
+        printf("Built %d mesh BVHs and a top level over %d instances in %.3fs\n", int(meshes.size()), int(instances.size()), timer.getElapsed());
+
+        std::cout << "Building GPU-BVH\n";
+        if (renderOptions.bvhWidth != 2)
+            std::cout << "Instanced scenes use binary BVH nodes\n";
+        gpuBVH = new GPUBVH(bvh, meshBVHs, NodeOrder(renderOptions.bvhNodeOrder));
+        if (renderOptions.bvhWoopTriangles)
+            gpuBVH->createWoopTriangles(&vertexData[0].vertex);
+
+        gpuInstanceData.resize(instances.size());
+        for (size_t i = 0; i < instances.size(); i++)
+        {
+            glm::mat4 invTransform = glm::inverse(instances[i].transform);
+            for (int row = 0; row < 3; row++)
+                gpuInstanceData[i].invTransform[row] = glm::vec4(invTransform[0][row], invTransform[1][row], invTransform[2][row], invTransform[3][row]);
+            gpuInstanceData[i].meshRoot = glm::ivec4(gpuBVH->meshRoots[instances[i].meshID], 0, 0, 0);
+        }
+
+        // Everything the GPU needs is in the flattened nodes now, the mesh trees are rebuilt when the vertices move
+        for (size_t i = 0; i < meshBVHs.size(); i++)
+        {
+            delete meshBVHs[i].bvh->getScene();
+            delete meshBVHs[i].bvh;
+        }
+        reorderShadingData();
+        std::cout << "GPU-BVH successfully created\n";
+    }
+
+    BVH::BuildParams Scene::getBuildParams() const
+    {
+        BVH::BuildParams params;
+        params.numThreads = renderOptions.bvhThreads;
+        params.objectSplitBins = renderOptions.bvhObjectBins;
+        params.builder = renderOptions.bvhBuilder;
+        params.treeletPasses = renderOptions.bvhTreeletPasses;
+
+        // Binary GPU nodes are copied straight from the builder's flat output, only the
+        // 4-wide collapse walks a node tree
+        params.flatOutput = isInstanced() || renderOptions.bvhWidth == 2;
+        return params;
+    }
+
+    void Scene::updateVertices(int first, int count, const glm::vec3 *positions)
+    {
+        for (int i = 0; i < count; i++)
+            vertexData[first + i].vertex = positions[i];
+
+        // Instanced scenes rebuild their mesh BVHs from vertexData
+        if (isInstanced())
+            return;
+        Vec3f *verts = gpuScene->getMutableVertexPtr(first);
+        for (int i = 0; i < count; i++)
+            verts[i] = Vec3f(positions[i].x, positions[i].y, positions[i].z);
+    }
+
+    bool Scene::refitBVH(glm::ivec2 &changedNodes)
+    {
+        FW::Timer timer(true);
+
+        // World space copies of the moved triangles, with areas and so the alias table changing too
+        buildEmissiveTriangles();
+
+        if (isInstanced())
+        {
+            // Not refitted, the mesh trees are rebuilt
+            buildInstancedBVH();
+            changedNodes = glm::ivec2(0, gpuBVH->numNodes);
+            return true;
+        }
+
+        float sah = bvh->refit();
+        float growth = sah / bvh->getBuildSAHCost();
+
+        if (growth <= renderOptions.bvhRebuildThreshold)
+        {
+            if (!quantizedVertices.empty())
+            {
+                vertexFrames.clear();
+                quantizeVertices(bvh, 0, VertexClusterSize(bvh->getTriIndices().getSize(), 1));
+            }
+            changedNodes = gpuBVH->refit();
+            if (!gpuBVH->woopTriangles.empty())
+                gpuBVH->createWoopTriangles(&vertexData[0].vertex);
+            return false;
+        }
+
+        // Degraded too far, rebuild over the moved vertices. The cache is skipped, its key
+        // would change every frame.
+        printf("BVH refit SAH %.2f is %.2fx the built tree, rebuilding\n", sah, growth);
+        Platform platform = bvh->getPlatform();
+        BVH::BuildParams params = getBuildParams();
+        params.enablePrints = false;
+        delete bvh;
+        bvh = new BVH(gpuScene, platform, params);
+        createGPUBVH();
+        printf("BVH rebuilt in %.3fs\n", timer.getElapsed());
+        changedNodes = glm::ivec2(0, gpuBVH->getNodeBytes() / gpuBVH->getNodeStride());
+        return true;
+    }
 
+    void Scene::createGPUBVH()
+    {
+        if (isInstanced())
+        {
+            // Built together with the mesh BVHs, always binary
+            std::cout << "Instanced scenes use binary BVH nodes\n";
+            return;
+        }
+
+        delete gpuBVH;
         std::cout << "Building GPU-BVH\n";
-        gpuBVH = new GPUBVH(bvh);
+
+        // A flat BVH only makes binary nodes, switching to 4-wide needs the node tree
+        if (renderOptions.bvhWidth == 4 && bvh->isFlat())
+        {
+            std::cout << "Rebuilding the BVH as a node tree\n";
+            Platform platform = bvh->getPlatform();
+            BVH::BuildParams params = getBuildParams();
+            params.enablePrints = false;
+            delete bvh;
+            bvh = new BVH(gpuScene, platform, params);
+        }
+
+        // The padding stays in the BVH when quantization is switched off again, it is far below any leaf size
+        quantizedVertices.clear();
+        vertexFrames.clear();
+        if (renderOptions.bvhQuantizedVertices && !renderOptions.bvhWoopTriangles)
+        {
+            quantizedVertices.resize(vertexData.size());
+            quantizeVertices(bvh, 0, VertexClusterSize(bvh->getTriIndices().getSize(), 1));
+        }
+        gpuBVH = new GPUBVH(bvh, renderOptions.bvhWidth, renderOptions.bvhCompressed, NodeOrder(renderOptions.bvhNodeOrder));
+        if (renderOptions.bvhWoopTriangles)
+            gpuBVH->createWoopTriangles(&vertexData[0].vertex);
+        reorderShadingData();
         std::cout << "GPU-BVH successfully created\n";
     }
+
+    void Scene::reorderShadingData()
+    {
+        // Hits that are close in the BVH are close in the material IDs too. Spatial splits
+        // reference some triangles from several leaves, those get a copy per slot.
+        const std::vector<TriIndexData>& slots = gpuBVH->bvhTriangleIndices;
+        triangleMaterialBytes = materialData.size() <= 65536 ? 2 : 4;
+        leafTriangleMaterials.resize(slots.size() * triangleMaterialBytes);
+        for (size_t i = 0; i < slots.size(); i++)
+        {
+            int material = triangleMaterials[slots[i].indices.w];
+            if (triangleMaterialBytes == 2)
+                reinterpret_cast<unsigned short *>(&leafTriangleMaterials[0])[i] = (unsigned short)material;
+            else
+                reinterpret_cast<unsigned int *>(&leafTriangleMaterials[0])[i] = (unsigned int)material;
+        }
+    }
+
+    void Scene::quantizeVertices(BVH *leafBVH, int firstVertex, int clusterSize)
+    {
+        // Runs of clusterSize triangle references in leaf order make the frames, a vertex goes into
+        // the frame of the first run that uses it. Every vertex has one stored position however many
+        // leaves share it, so neighbouring triangles stay watertight; the leaf boxes grow by how far
+        // their vertices moved.
+        GPUScene* leafScene = leafBVH->getScene();
+        const Array<S32>& triIndices = leafBVH->getTriIndices();
+        int numVertices = leafScene->getNumVertices();
+        int firstFrame = int(vertexFrames.size());
+        int numFrames = std::max((triIndices.getSize() + clusterSize - 1) / clusterSize, 1);
+
+        std::vector<int> frames(numVertices, -1);
+        std::vector<AABB> frameBounds(numFrames);
+        for (int i = 0; i < triIndices.getSize(); i++)
+        {
+            const Vec3i& tri = leafScene->getTriangle(triIndices[i]).vertices;
+            for (int j = 0; j < 3; j++)
+            {
+                if (frames[tri._v[j]] >= 0)
+                    continue;
+                frames[tri._v[j]] = i / clusterSize;
+                frameBounds[i / clusterSize].grow(leafScene->getVertex(tri._v[j]));
+            }
+        }
+
+        vertexFrames.resize(firstFrame + numFrames);
+        for (int f = 0; f < numFrames; f++)
+        {
+            Vec3f lo = frameBounds[f].valid() ? frameBounds[f].min() : Vec3f(0.0f);
+            Vec3f hi = frameBounds[f].valid() ? frameBounds[f].max() : Vec3f(0.0f);
+            glm::uvec4& originExp = vertexFrames[firstFrame + f].originExp;
+            originExp = glm::uvec4(0u);
+            for (int axis = 0; axis < 3; axis++)
+            {
+                // Smallest power of two that covers the frame extent in 65535 steps
+                int exponent;
+                frexp((hi._v[axis] - lo._v[axis]) / 65535.0f, &exponent);
+                exponent = std::max(exponent, -126);
+                while (lo._v[axis] + 65535.0f * ldexpf(1.0f, exponent) < hi._v[axis])
+                    exponent++;
+                originExp[axis] = glm::floatBitsToUint(lo._v[axis]);
+                originExp.w |= unsigned(exponent + 127) << (8 * axis);
+            }
+        }
+
+        Array<Vec3f> padding;
+        padding.reset(numVertices);
+        for (int v = 0; v < numVertices; v++)
+        {
+            // Vertices no triangle uses are never fetched
+            QuantizedVertexData& vertex = quantizedVertices[firstVertex + v];
+            vertex.frame = (unsigned short)(firstFrame + std::max(frames[v], 0));
+            const glm::uvec4& originExp = vertexFrames[vertex.frame].originExp;
+            const Vec3f& p = leafScene->getVertex(v);
+            for (int axis = 0; axis < 3; axis++)
+            {
+                float step = ldexpf(1.0f, int((originExp.w >> (8 * axis)) & 0xFFu) - 127);
+                float q = roundf((p._v[axis] - glm::uintBitsToFloat(originExp[axis])) / step);
+                vertex.position[axis] = (unsigned short)std::min(std::max(q, 0.0f), 65535.0f);
+            }
+
+            glm::vec3 error = glm::abs(DecodeVertex(vertex, vertexFrames) - glm::vec3(p.x, p.y, p.z));
+            padding[v] = Vec3f(error.x, error.y, error.z);
+        }
+        leafBVH->padLeaves(padding);
+    }
+
+    void Scene::benchmarkBVH(const Platform& platform)
+    {
+        // Build time scaling from 1 thread up to every hardware thread
+        int maxThreads = TaskPool::getHardwareThreads();
+        float serialTime = 0.0f;
+
+        std::cout << "BVH build benchmark (" << gpuScene->getNumTriangles() << " triangles)\n";
+        for (int numThreads = 1; ; numThreads = std::min(numThreads * 2, maxThreads))
+        {
+            BVH::BuildParams params;
+            BVH::Stats stats;
+            params.enablePrints = false;
+            params.stats = &stats;
+            params.numThreads = numThreads;
+            params.objectSplitBins = renderOptions.bvhObjectBins;
+            BVH benchBVH(gpuScene, platform, params);
+
+            if (numThreads == 1)
+                serialTime = stats.buildTime;
+            printf("  %2d threads: %.3fs (%.2fx) SAH %.2f\n", numThreads, stats.buildTime, serialTime / stats.buildTime, stats.SAHCost);
+
+            if (numThreads == maxThreads)
+                break;
+        }
+
+        // Every builder, all threads
+        const char* builderNames[] = { "sbvh", "sah ", "fast" };
+        for (int builder = BVH::Builder_SBVH; builder <= BVH::Builder_Fast; builder++)
+        {
+            BVH::BuildParams params;
+            BVH::Stats stats;
+            params.enablePrints = false;
+            params.stats = &stats;
+            params.builder = builder;
+            params.objectSplitBins = renderOptions.bvhObjectBins;
+            BVH benchBVH(gpuScene, platform, params);
+            printf("  %s: %.3fs SAH %.2f, %d nodes\n", builderNames[builder], stats.buildTime, stats.SAHCost, stats.numInnerNodes + stats.numLeafNodes);
+
+            params.treeletPasses = 3;
+            BVH optimizedBVH(gpuScene, platform, params);
+            printf("  %s + treelets: %.3fs SAH %.2f (%+.2f%%)\n", builderNames[builder], stats.buildTime, stats.SAHCost, 100.0f * (stats.SAHCost - stats.initialSAHCost) / stats.initialSAHCost);
+        }
+
+        // Refit against rebuild on a copy of the scene twisted around the vertical axis
+        {
+            Array<GPUScene::Triangle> tris;
+            Array<Vec3f> verts;
+            tris.set(gpuScene->getTrianglePtr(), gpuScene->getNumTriangles());
+            verts.set(gpuScene->getVertexPtr(), gpuScene->getNumVertices());
+            GPUScene twisted(tris.getSize(), verts.getSize(), tris, verts);
+
+            BVH::BuildParams params;
+            BVH::Stats stats;
+            params.enablePrints = false;
+            params.stats = &stats;
+            params.objectSplitBins = renderOptions.bvhObjectBins;
+            BVH refitBVH(&twisted, platform, params);
+
+            const AABB& bounds = refitBVH.getRoot()->m_bounds;
+            Vec3f center = bounds.midPoint();
+            float height = std::max(bounds.max().y - bounds.min().y, 1e-6f);
+            for (int degrees = 15; degrees <= 90; degrees *= 2)
+            {
+                Vec3f *twistedVerts = twisted.getMutableVertexPtr();
+                for (int i = 0; i < verts.getSize(); i++)
+                {
+                    float angle = glm::radians(float(degrees)) * (verts[i].y - bounds.min().y) / height;
+                    float dx = verts[i].x - center.x, dz = verts[i].z - center.z;
+                    twistedVerts[i] = Vec3f(center.x + dx * cosf(angle) - dz * sinf(angle), verts[i].y, center.z + dx * sinf(angle) + dz * cosf(angle));
+                }
+
+                FW::Timer timer(true);
+                float sah = refitBVH.refit();
+                float refitTime = timer.getElapsed();
+                BVH rebuiltBVH(&twisted, platform, params);
+                printf("  twist %2d deg: refit %.4fs SAH %.2f, rebuild %.3fs SAH %.2f (%.2fx)\n", degrees, refitTime, sah, stats.buildTime, stats.SAHCost, sah / refitBVH.getBuildSAHCost());
+            }
+        }
+
+        // Sorting the triangle centroids: comparison sort against radix sort
+        int numTris = gpuScene->getNumTriangles();
+        std::vector<float> centroids(numTris);
+        for (int i = 0; i < numTris; i++)
+        {
+            const Vec3i& tri = gpuScene->getTriangle(i).vertices;
+            centroids[i] = gpuScene->getVertex(tri.x).x + gpuScene->getVertex(tri.y).x + gpuScene->getVertex(tri.z).x;
+        }
+
+        FW::Timer timer(true);
+        std::vector<float> sortedCentroids = centroids;
+        Sort(0, numTris, &sortedCentroids[0], CompareF32, SwapF32);
+        float compareSortTime = timer.end();
+
+        std::vector<unsigned int> keys(numTris), tmpKeys(numTris);
+        std::vector<int> indices(numTris), tmpIndices(numTris);
+        for (int i = 0; i < numTris; i++)
+        {
+            keys[i] = FloatToSortKey(centroids[i]);
+            indices[i] = i;
+        }
+        RadixSort(numTris, &keys[0], &indices[0], &tmpKeys[0], &tmpIndices[0]);
+        float radixSortTime = timer.end();
+        printf("  centroid sort: Sort() %.2fms, RadixSort() %.2fms (%.2fx)\n", compareSortTime * 1000.0f, radixSortTime * 1000.0f, compareSortTime / radixSortTime);
+
+        for (int useRadixSort = 0; useRadixSort < 2; useRadixSort++)
+        {
+            BVH::BuildParams params;
+            BVH::Stats stats;
+            params.enablePrints = false;
+            params.stats = &stats;
+            params.useRadixSort = useRadixSort != 0;
+            BVH benchBVH(gpuScene, platform, params);
+            printf("  %s: %.3fs SAH %.2f\n", useRadixSort ? "radix sort" : "quicksort ", stats.buildTime, stats.SAHCost);
+        }
+
+        // Full sorted sweep against binned object splits, all threads
+        BVH::Stats sweepStats;
+        for (int numBins = 0; numBins <= 64; numBins = numBins ? numBins * 2 : 8)
+        {
+            BVH::BuildParams params;
+            BVH::Stats stats;
+            params.enablePrints = false;
+            params.stats = &stats;
+            params.objectSplitBins = numBins;
+            BVH benchBVH(gpuScene, platform, params);
+
+            if (numBins == 0)
+            {
+                sweepStats = stats;
+                printf("  full sweep: %.3fs SAH %.2f\n", stats.buildTime, stats.SAHCost);
+            }
+            else
+                printf("  %2d bins:    %.3fs (%.2fx) SAH %.2f (%+.2f%%)\n", numBins, stats.buildTime, sweepStats.buildTime / stats.buildTime,
+                    stats.SAHCost, 100.0f * (stats.SAHCost - sweepStats.SAHCost) / sweepStats.SAHCost);
+        }
+
+        // Node orderings: the same incoherent rays through the binary nodes on the CPU, one thread.
+        // Closer to bounce rays than to camera rays, the access pattern is what changes.
+        {
+            BVH::BuildParams params;
+            params.enablePrints = false;
+            params.objectSplitBins = renderOptions.bvhObjectBins;
+            params.builder = renderOptions.bvhBuilder;
+            params.flatOutput = true;
+            BVH benchBVH(gpuScene, platform, params);
+
+            const int numRays = 1 << 18;
+            const AABB& bounds = benchBVH.getBounds();
+            std::mt19937 rng(1);
+            std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+            std::vector<glm::vec3> origins(numRays), directions(numRays);
+            for (int i = 0; i < numRays; i++)
+            {
+                Vec3f p = bounds.min() + (bounds.max() - bounds.min()) * Vec3f(uniform(rng), uniform(rng), uniform(rng));
+                float z = 1.0f - 2.0f * uniform(rng), phi = 2.0f * 3.14159265f * uniform(rng);
+                float r = sqrtf(std::max(0.0f, 1.0f - z * z));
+                origins[i] = glm::vec3(p.x, p.y, p.z);
+                directions[i] = glm::vec3(r * cosf(phi), r * sinf(phi), z);
+            }
+
+            const char* orderNames[] = { "depth first  ", "larger first ", "breadth first", "van Emde Boas" };
+            for (int order = NodeOrder_DepthFirst; order <= NodeOrder_VanEmdeBoas; order++)
+            {
+                GPUBVH orderedBVH(&benchBVH, 2, false, NodeOrder(order));
+                int numVisits = 0, numHits = 0, triID;
+                FW::Timer timer(true);
+                for (int i = 0; i < numRays; i++)
+                    numHits += orderedBVH.intersect(gpuScene->getVertexPtr(), origins[i], directions[i], triID, numVisits) < FW_F32_MAX;
+                float traceTime = timer.end();
+                printf("  %s: %.2f Mrays/s, %.1f nodes/ray, %d hits\n", orderNames[order], numRays / traceTime * 1e-6f, float(numVisits) / numRays, numHits);
+            }
+
+            // Leaf format: precomputed triangles against vertex fetches, on the builder's order
+            GPUBVH woopBVH(&benchBVH, 2);
+            woopBVH.createWoopTriangles(&vertexData[0].vertex);
+            int numVisits = 0, numHits = 0, triID;
+            FW::Timer timer(true);
+            for (int i = 0; i < numRays; i++)
+                numHits += woopBVH.intersect(gpuScene->getVertexPtr(), origins[i], directions[i], triID, numVisits) < FW_F32_MAX;
+            float traceTime = timer.end();
+            printf("  Woop triangles: %.2f Mrays/s, %d hits\n", numRays / traceTime * 1e-6f, numHits);
+
+            // Shadow rays, shading fetch locality and quantized vertices at the camera hits
+            if (camera)
+            {
+                BenchmarkShadowRays(*this, woopBVH);
+                BenchmarkShadingLocality(*this, woopBVH);
+                BenchmarkQuantizedVertices(*this, platform, params, benchBVH);
+            }
+
+            // Light sampling convergence at the camera hits
+            if (camera && lightData.size() > 1)
+                BenchmarkLightSampling(*this, woopBVH);
+
+            // Emissive triangle sampling at the camera hits
+            if (camera && !emissiveTriangles.empty())
+                BenchmarkEmissiveTriangles(*this, woopBVH);
+        }
+
+        // Emitter hits of camera rays, every light in turn against the light BVH
+        if (camera && lightData.size() > 1)
+            BenchmarkLightBVH(*this);
+
+        // Environment map sampling, CDF tables against the alias table
+        if (hdrLoaderRes.cols)
+            BenchmarkEnvMapSampling(*this);
+    }
 }
\ No newline at end of file
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cmath>
 #include <glm/glm.hpp>
 #include <string>
 #include <vector>
@@ -13,18 +14,48 @@ namespace GLSLPathTracer
 
     struct TriangleData
     {
-        glm::vec4 indices;
+        glm::ivec3 indices;
     };
 
-    struct NormalTexData
+    struct VertexData
     {
-        glm::vec3 normals[3];
-        glm::vec3 texCoords[3];
+        glm::vec3 vertex;
     };
 
-    struct VertexData
+    // Position as 16-bit offsets inside its frame, one RGBA16UI texel: x, y, z, then the frame index
+    struct QuantizedVertexData
     {
-        glm::vec3 vertex;
+        unsigned short position[3];
+        unsigned short frame;
+    };
+
+    // One RGBA32UI texel per frame, laid out like the origin of a compressed BVH node: xyz are the
+    // float bits of the origin, w the biased power of two exponent of the step per axis, x | y << 8 | z << 16
+    struct VertexFrameData
+    {
+        glm::uvec4 originExp;
+    };
+
+    inline glm::vec3 DecodeVertex(const QuantizedVertexData &vertex, const std::vector<VertexFrameData> &frames)
+    {
+        // As the shaders do it. The step is a power of two, only the sum rounds.
+        const glm::uvec4& originExp = frames[vertex.frame].originExp;
+        glm::vec3 p;
+        for (int axis = 0; axis < 3; axis++)
+            p[axis] = glm::uintBitsToFloat(originExp[axis]) + float(vertex.position[axis]) * ldexpf(1.0f, int((originExp.w >> (8 * axis)) & 0xFFu) - 127);
+        return p;
+    }
+
+    // Triangle references per vertex frame, enough for the frame indices of numReferences references
+    // in numTrees trees to fit in 16 bits
+    int VertexClusterSize(long long numReferences, int numTrees);
+
+    // Shading attributes of a welded vertex, one RG32UI texel: the octahedral normal as two
+    // snorm16 and the texcoord as two halves
+    struct VertexAttribData
+    {
+        glm::uint normal;
+        glm::uint texCoord;
     };
 
     struct MaterialData
@@ -57,6 +88,13 @@ namespace GLSLPathTracer
         glm::ivec2 normalTextureSize;
     };
 
+    const float Pi = 3.14159265f;
+
+    inline float Luminance(const glm::vec3 &color)
+    {
+        return glm::dot(color, glm::vec3(0.2126f, 0.7152f, 0.0722f));
+    }
+
     struct LightData
     {
         glm::vec3 position;
@@ -66,12 +104,67 @@ namespace GLSLPathTracer
         glm::vec3 radiusAreaType;
     };
 
+    // Light tree terms of a lightBVHNodes entry as two RGBA32F texels: the cone bounding the
+    // emitter normals, then the emitted power, the spread of the emission around that cone and
+    // the first light of the subtree, which the shader reads back with floatBitsToInt
+    struct LightTreeData
+    {
+        glm::vec3 axis;
+        float cosThetaO;
+        float power;
+        float cosThetaE;
+        int firstLight;
+        float padding;
+    };
+
+    // A triangle with material emission in world space as four RGBA32F texels: the first vertex and
+    // its alias table threshold, the two edges with the alias index as float bits after the first,
+    // then the emission. The alias table picks triangles in proportion to luminance times area
+    struct EmissiveTriangleData
+    {
+        glm::vec3 v0;
+        float aliasThreshold;
+        glm::vec3 edge1;
+        int alias;
+        glm::vec3 edge2;
+        float padding;
+        glm::vec4 emission;
+    };
+
+    // Triangles and vertices of one loaded model in the scene-wide arrays
+    struct MeshData
+    {
+        std::string name;
+        int firstTriangle;
+        int numTriangles;
+        int firstVertex;
+        int numVertices;
+    };
+
+    struct InstanceData
+    {
+        int meshID;
+        glm::mat4 transform; // object to world
+    };
+
+    // Per instance on the GPU: rows of the world to object 3x4 matrix, then the mesh BVH root.
+    // The buffer is RGBA32F, the shader reads the root back with floatBitsToInt
+    struct GPUInstanceData
+    {
+        glm::vec4 invTransform[3];
+        glm::ivec4 meshRoot;
+    };
+
     class Scene
     {
     public:
         Scene(const std::string filename) : filename(filename)
             , camera(nullptr) 
             , gpuBVH(nullptr)
+            , gpuScene(nullptr)
+            , bvh(nullptr)
+            , triangleMaterialBytes(2)
+            , emissivePower(0.0f)
         {}
         ~Scene();
         void addCamera(glm::vec3 pos, glm::vec3 lookAt, float fov);
@@ -80,14 +173,43 @@ namespace GLSLPathTracer
 		GPUScene *gpuScene;
 		BVH *bvh;
         std::vector<TriangleData> triangleIndices;
-        std::vector<NormalTexData> normalTexData;
+        std::vector<int> triangleMaterials; // material ID per triangle
+        // The material IDs permuted into BVH leaf order, one per slot of gpuBVH->bvhTriangleIndices,
+        // as 16-bit IDs unless the scene has more materials. This is what the GPU gets, the shaders'
+        // triID is a slot. The scene triangle behind a slot stays in bvhTriangleIndices[slot].indices.w
+        std::vector<unsigned char> leafTriangleMaterials;
+        int triangleMaterialBytes;
         std::vector<VertexData> vertexData;
+        std::vector<VertexAttribData> vertexAttribs; // welded vertices, parallel to vertexData
+        std::vector<QuantizedVertexData> quantizedVertices; // parallel to vertexData when renderOptions.bvhQuantizedVertices, otherwise empty
+        std::vector<VertexFrameData> vertexFrames;
         std::vector<MaterialData> materialData;
-        std::vector<LightData> lightData;
+        std::vector<LightData> lightData; // in the leaf order of lightBVHNodes once the BVHs are built
+        std::vector<GPUBVHNode> lightBVHNodes; // binary BVH over the lights, one light per leaf
+        std::vector<LightTreeData> lightTreeData; // per lightBVHNodes entry, for picking lights by importance
+        std::vector<EmissiveTriangleData> emissiveTriangles; // taken from the geometry when the BVH is built
+        float emissivePower; // luminance times area summed over emissiveTriangles
+        std::vector<MeshData> meshes;
+        std::vector<InstanceData> instances; // empty unless the scene file places instances
+        std::vector<GPUInstanceData> gpuInstanceData; // two-level: bvh and gpuScene are the top level
         TexData texData;
         RenderOptions renderOptions;
         HDRLoaderResult hdrLoaderRes;
         void buildBVH();
+        void buildInstancedBVH();
+        void buildLightBVH();
+        void buildEmissiveTriangles();
+        bool isInstanced() const { return !instances.empty(); }
+        void benchmarkBVH(const Platform& platform);
+        void createGPUBVH();
+        void reorderShadingData();
+        void quantizeVertices(BVH *leafBVH, int firstVertex, int clusterSize);
+        // Animation: move vertices, then refit. Returns true if the BVH had degraded too far and was
+        // rebuilt instead (always for instanced scenes), the renderer then needs a full init();
+        // otherwise pass the vertex range and changedNodes to Renderer::updateGeometry()
+        void updateVertices(int first, int count, const glm::vec3 *positions);
+        bool refitBVH(glm::ivec2 &changedNodes);
+        BVH::BuildParams getBuildParams() const;
         const std::string& getSceneName() const { return filename; }
     protected:
         std::string filename;
@@ -3,25 +3,44 @@
 
 #include <iostream>
 #include <fstream>
-#include <sstream>
 
 namespace GLSLPathTracer
 {
-    Shader::Shader(const std::string& filePath, GLenum shaderType)
+    static bool LoadSource(const std::string& filePath, std::string& source, int depth)
     {
         std::ifstream f;
         f.open(filePath.c_str(), std::ios::in | std::ios::binary);
         if (!f.is_open())
         {
             Log("Failed to open file: %s\n", filePath.c_str());
-            return;
+            return false;
         }
 
-        //read whole file into stringstream buffer
-        std::stringstream buffer;
-        buffer << f.rdbuf();
+        // Lines of the form #include "file" are replaced by that file, relative to the including one
+        std::string directory = filePath.substr(0, filePath.find_last_of("/\\") + 1);
+        std::string line;
+        while (std::getline(f, line))
+        {
+            size_t first = line.find('"');
+            size_t last = line.rfind('"');
+            if (line.compare(0, 9, "#include ") == 0 && first != std::string::npos && last > first)
+            {
+                if (depth >= 8 || !LoadSource(directory + line.substr(first + 1, last - first - 1), source, depth + 1))
+                    return false;
+                continue;
+            }
+            source += line;
+            source += '\n';
+        }
+        return true;
+    }
+
+    Shader::Shader(const std::string& filePath, GLenum shaderType)
+    {
+        std::string source;
+        if (!LoadSource(filePath, source, 0))
+            return;
 
-        std::string source = buffer.str();
         _object = glCreateShader(shaderType);
         const GLchar *src = (const GLchar *)source.c_str();
         glShaderSource(_object, 1, &src, 0);
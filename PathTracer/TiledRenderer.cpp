@@ -102,28 +102,40 @@ namespace GLSLPathTracer
         glUniform1f(glGetUniformLocation(shaderObject, "camera.focalDist"), scene->camera->focalDist);
         glUniform1f(glGetUniformLocation(shaderObject, "camera.aperture"), scene->camera->aperture);
         glUniform1i(glGetUniformLocation(shaderObject, "useEnvMap"), scene->renderOptions.useEnvMap);
-        glUniform1f(glGetUniformLocation(shaderObject, "hdrResolution"), (float)(scene->hdrLoaderRes.width * scene->hdrLoaderRes.height));
+        glUniform1i(glGetUniformLocation(shaderObject, "bvhWidth"), scene->gpuBVH->width);
+        glUniform1i(glGetUniformLocation(shaderObject, "bvhCompressed"), scene->gpuBVH->compressed);
+        glUniform1i(glGetUniformLocation(shaderObject, "woopTriangles"), !scene->gpuBVH->woopTriangles.empty());
+        glUniform1i(glGetUniformLocation(shaderObject, "quantizedVertices"), !scene->quantizedVertices.empty());
+        glUniform1i(glGetUniformLocation(shaderObject, "shadowRays"), scene->renderOptions.shadowRays);
+        glUniform1i(glGetUniformLocation(shaderObject, "lightSampling"), scene->renderOptions.lightSampling);
+        glUniform1i(glGetUniformLocation(shaderObject, "numEmissiveTriangles"), scene->renderOptions.sampleEmissiveTriangles ? int(scene->emissiveTriangles.size()) : 0);
         glUniform1f(glGetUniformLocation(shaderObject, "hdrMultiplier"), scene->renderOptions.hdrMultiplier);
 
         glUniform1i(glGetUniformLocation(shaderObject, "maxDepth"), maxDepth);
         glUniform2f(glGetUniformLocation(shaderObject, "screenResolution"), float(screenSize.x), float(screenSize.y));
         glUniform1i(glGetUniformLocation(shaderObject, "numOfLights"), numOfLights);
+        glUniform1i(glGetUniformLocation(shaderObject, "lightBVHOffset"), lightBVHOffset);
+        glUniform1i(glGetUniformLocation(shaderObject, "lightTreeOffset"), lightTreeOffset);
+        glUniform1i(glGetUniformLocation(shaderObject, "emissiveTrianglesOffset"), emissiveTrianglesOffset);
         glUniform1f(glGetUniformLocation(shaderObject, "invTileWidth"), 1.0f / numTilesX);
         glUniform1f(glGetUniformLocation(shaderObject, "invTileHeight"), 1.0f / numTilesY);
 
         glUniform1i(glGetUniformLocation(shaderObject, "accumTexture"), 0);
         glUniform1i(glGetUniformLocation(shaderObject, "BVH"), 1);
+        glUniform1i(glGetUniformLocation(shaderObject, "instancesTex"), 14);
         glUniform1i(glGetUniformLocation(shaderObject, "triangleIndicesTex"), 2);
         glUniform1i(glGetUniformLocation(shaderObject, "verticesTex"), 3);
-        glUniform1i(glGetUniformLocation(shaderObject, "normalsTexCoordsTex"), 4);
+        glUniform1i(glGetUniformLocation(shaderObject, "vertexAttribsTex"), 4);
+        glUniform1i(glGetUniformLocation(shaderObject, "triangleMaterialsTex"), 15);
+        glUniform1i(glGetUniformLocation(shaderObject, "woopTrianglesTex"), 12);
+        glUniform1i(glGetUniformLocation(shaderObject, "vertexFramesTex"), 13);
         glUniform1i(glGetUniformLocation(shaderObject, "materialsTex"), 5);
         glUniform1i(glGetUniformLocation(shaderObject, "lightsTex"), 6);
         glUniform1i(glGetUniformLocation(shaderObject, "albedoTextures"), 7);
         glUniform1i(glGetUniformLocation(shaderObject, "metallicRoughnessTextures"), 8);
         glUniform1i(glGetUniformLocation(shaderObject, "normalTextures"), 9);
         glUniform1i(glGetUniformLocation(shaderObject, "hdrTexture"), 10);
-        glUniform1i(glGetUniformLocation(shaderObject, "hdrMarginalDistTexture"), 11);
-        glUniform1i(glGetUniformLocation(shaderObject, "hdrCondDistTexture"), 12);
+        glUniform1i(glGetUniformLocation(shaderObject, "hdrAliasTexture"), 11);
 
         pathTraceShader->stopUsing();
 
@@ -179,7 +191,7 @@ namespace GLSLPathTracer
             glActiveTexture(GL_TEXTURE3);
             glBindTexture(GL_TEXTURE_BUFFER, verticesTexture);
             glActiveTexture(GL_TEXTURE4);
-            glBindTexture(GL_TEXTURE_BUFFER, normalsTexCoordsTexture);
+            glBindTexture(GL_TEXTURE_BUFFER, vertexAttribsTexture);
             glActiveTexture(GL_TEXTURE5);
             glBindTexture(GL_TEXTURE_BUFFER, materialsTexture);
             glActiveTexture(GL_TEXTURE6);
@@ -193,11 +205,19 @@ namespace GLSLPathTracer
             glActiveTexture(GL_TEXTURE10);
             glBindTexture(GL_TEXTURE_2D, hdrTexture);
             glActiveTexture(GL_TEXTURE11);
-            glBindTexture(GL_TEXTURE_1D, hdrMarginalDistTexture);
+            glBindTexture(GL_TEXTURE_2D, hdrAliasTexture);
+            glActiveTexture(GL_TEXTURE14);
+            glBindTexture(GL_TEXTURE_BUFFER, instancesTexture);
+            glActiveTexture(GL_TEXTURE15);
+            glBindTexture(GL_TEXTURE_BUFFER, triangleMaterialsTexture);
             glActiveTexture(GL_TEXTURE12);
-            glBindTexture(GL_TEXTURE_2D, hdrConditionalDistTexture);
+            glBindTexture(GL_TEXTURE_BUFFER, woopTrianglesTexture);
+            glActiveTexture(GL_TEXTURE13);
+            glBindTexture(GL_TEXTURE_BUFFER, vertexFramesTexture);
 
+            beginPathTraceTimer(tileWidth * tileHeight);
             quad->Draw(pathTraceShader);
+            endPathTraceTimer();
 
             glBindFramebuffer(GL_FRAMEBUFFER, accumFBO);
             glViewport(tileWidth * tileX, tileHeight * tileY, tileWidth, tileHeight);
@@ -262,6 +282,7 @@ namespace GLSLPathTracer
         glUniform3fv(glGetUniformLocation(shaderObject, "randomVector"), 1, glm::value_ptr(glm::vec3(r1, r2, r3)));
         glUniform1i(glGetUniformLocation(shaderObject, "tileX"), tileX);
         glUniform1i(glGetUniformLocation(shaderObject, "tileY"), tileY);
+        glUniform1f(glGetUniformLocation(shaderObject, "emissivePower"), scene->emissivePower); // changes with refits
         pathTraceShader->stopUsing();
 
         outputShader->use();
@@ -9,13 +9,17 @@
 
 /* 
 	This is modified version of the original code. Addeed code to build marginal & conditional densities for IBL importance sampling
+	and an alias table over the image that replaces them in the renderer. The image can go to the GPU in
+	16-bit half or shared exponent texels with a mip chain
 */
 
 #include "hdrloader.h"
+#include <glm/gtc/packing.hpp>
 
 #include <math.h>
 #include <memory.h>
 #include <stdio.h>
+#include <vector>
 
 typedef unsigned char RGBE[4];
 #define R			0
@@ -54,7 +58,84 @@ int LowerBound(const float* array, int lower, int upper, const float value)
 	return lower;
 }
 
-void HDRLoader::buildDistributions(HDRLoaderResult &res)
+void HDRLoader::buildAliasTable(HDRLoaderResult &res, int cellSize)
+{
+	if (cellSize < 1)
+		cellSize = res.width > 4096 ? 2 : 1;
+	while ((long long)((res.width + cellSize - 1) / cellSize) * ((res.height + cellSize - 1) / cellSize) > (1 << 25))
+		cellSize *= 2;
+
+	int width  = (res.width + cellSize - 1) / cellSize;
+	int height = (res.height + cellSize - 1) / cellSize;
+	int n = width * height;
+
+	/* Luminance times sin(theta) of the pixels whose centers fall in each cell, the cells split the unit square evenly */
+	std::vector<double> weights(n, 0.0);
+	double weightSum = 0.0;
+	for (int j = 0; j < res.height; j++)
+	{
+		float sinTheta = sinf(3.14159265f * (j + 0.5f) / res.height);
+		int row = int((j + 0.5) * height / res.height);
+		for (int i = 0; i < res.width; i++)
+		{
+			const float *col = &res.cols[(j * res.width + i) * 3];
+			double weight = Luminance(glm::vec3(col[0], col[1], col[2])) * sinTheta;
+			weights[row * width + int((i + 0.5) * width / res.width)] += weight;
+			weightSum += weight;
+		}
+	}
+
+	/* Alias table after Vose with every cell at 1 on average. A black image samples uniformly */
+	std::vector<float> thresholds(n);
+	std::vector<int> aliases(n);
+	std::vector<int> underfull, overfull;
+	for (int i = 0; i < n; i++)
+	{
+		thresholds[i] = weightSum > 0.0 ? float(weights[i] * n / weightSum) : 1.0f;
+		(thresholds[i] < 1.0f ? underfull : overfull).push_back(i);
+	}
+	while (!underfull.empty() && !overfull.empty())
+	{
+		int less = underfull.back(), more = overfull.back();
+		underfull.pop_back();
+		aliases[less] = more;
+		thresholds[more] -= 1.0f - thresholds[less];
+		if (thresholds[more] < 1.0f)
+		{
+			overfull.pop_back();
+			underfull.push_back(more);
+		}
+	}
+	/* What is left is 1 up to rounding */
+	underfull.insert(underfull.end(), overfull.begin(), overfull.end());
+	for (int i : underfull)
+	{
+		thresholds[i] = 1.0f;
+		aliases[i] = i;
+	}
+
+	/* Thresholds go to 7 bits. The pdfs are what the rounded table samples, so they stay exact */
+	std::vector<float> pdfs(n, 0.0f);
+	std::vector<unsigned int> packed(n);
+	for (int i = 0; i < n; i++)
+	{
+		int threshold = int(thresholds[i] * 127.0f + 0.5f);
+		threshold = threshold < 0 ? 0 : (threshold > 127 ? 127 : threshold);
+		packed[i] = (unsigned int)aliases[i] << 7 | threshold;
+		pdfs[i] += threshold / 127.0f;
+		pdfs[aliases[i]] += 1.0f - threshold / 127.0f;
+	}
+
+	delete[] res.aliasData;
+	res.aliasData = new glm::uvec2[n];
+	for (int i = 0; i < n; i++)
+		res.aliasData[i] = glm::uvec2(packed[i], glm::floatBitsToUint(pdfs[i]));
+	res.aliasWidth = width;
+	res.aliasHeight = height;
+	res.aliasCellSize = cellSize;
+}
+
+void HDRLoader::buildDistributions(const HDRLoaderResult &res, glm::vec2 *marginalDistData, glm::vec2 *conditionalDistData)
 {
 	int width  = res.width;
 	int height = res.height;
@@ -65,9 +146,6 @@ void HDRLoader::buildDistributions(HDRLoaderResult &res)
 	float *pdf1D = new float[height];
 	float *cdf1D = new float[height];
 
-	res.marginalDistData    = new glm::vec2[height];
-	res.conditionalDistData = new glm::vec2[width*height];
-
 	float colWeightSum = 0.0f;
 
 	for (int j = 0; j < height; j++)
@@ -109,8 +187,8 @@ void HDRLoader::buildDistributions(HDRLoaderResult &res)
 	{
 		float invHeight = (float)i / height;
 		int row = LowerBound(cdf1D, 0, height, invHeight);
-		res.marginalDistData[i].x = row / (float)height;
-		res.marginalDistData[i].y = pdf1D[i];
+		marginalDistData[i].x = row / (float)height;
+		marginalDistData[i].y = pdf1D[i];
 	}
 
 	for (int j = 0; j < height; j++)
@@ -119,8 +197,8 @@ void HDRLoader::buildDistributions(HDRLoaderResult &res)
 		{
 			float invWidth = (float)i / width;
 			int col = LowerBound(cdf2D, j*width, (j + 1)*width, invWidth) - j * width;
-			res.conditionalDistData[j*width + i].x = col / (float)width;
-			res.conditionalDistData[j*width + i].y = pdf2D[j*width + i];
+			conditionalDistData[j*width + i].x = col / (float)width;
+			conditionalDistData[j*width + i].y = pdf2D[j*width + i];
 		}
 	}
 
@@ -130,7 +208,113 @@ void HDRLoader::buildDistributions(HDRLoaderResult &res)
 	delete[] cdf1D;
 }
 
-bool HDRLoader::load(const char *fileName, HDRLoaderResult &res)
+long long HDRLoaderResult::textureBytes() const
+{
+	long long texels = 0;
+	for (int level = 0; level < numLevels; level++)
+		texels += (long long)levelWidth(level) * levelHeight(level);
+	return texels * texelBytes();
+}
+
+static unsigned int packRGB9E5(const float *col, float *rounded)
+{
+	/* EXT_texture_shared_exponent: 9-bit mantissas, exponent bias 15 */
+	const float maxValue = 65408.0f; // 511/512 * 2^16
+	float c[3];
+	for (int k = 0; k < 3; k++)
+		c[k] = col[k] > 0.0f ? (col[k] < maxValue ? col[k] : maxValue) : 0.0f;
+	float maxc = c[0] > c[1] ? (c[0] > c[2] ? c[0] : c[2]) : (c[1] > c[2] ? c[1] : c[2]);
+
+	int exponent = 0;
+	if (maxc > 0.0f)
+	{
+		frexpf(maxc, &exponent); // maxc = m * 2^exponent, m in [0.5, 1)
+		exponent = exponent < -15 ? -15 : exponent;
+		exponent += 15;
+		if (floorf(maxc / ldexpf(1.0f, exponent - 24) + 0.5f) == 512.0f)
+			exponent++;
+	}
+
+	float scale = ldexpf(1.0f, exponent - 24);
+	unsigned int packed = (unsigned int)exponent << 27;
+	for (int k = 0; k < 3; k++)
+	{
+		unsigned int mantissa = (unsigned int)floorf(c[k] / scale + 0.5f);
+		mantissa = mantissa > 511 ? 511 : mantissa;
+		packed |= mantissa << (9 * k);
+		rounded[k] = mantissa * scale;
+	}
+	return packed;
+}
+
+void HDRLoader::convert(HDRLoaderResult &res, int format)
+{
+	delete[] res.packedCols;
+	res.packedCols = NULL;
+	res.format = format;
+	res.numLevels = 1;
+	if (format == HDR_RGB32F)
+		return;
+
+	while (res.levelWidth(res.numLevels - 1) > 1 || res.levelHeight(res.numLevels - 1) > 1)
+		res.numLevels++;
+
+	int texelBytes = res.texelBytes();
+	res.packedCols = new unsigned char[res.textureBytes()];
+
+	/* Each level is a 2x2 box filter of the unrounded one above it, then rounded and packed */
+	std::vector<float> level(res.cols, res.cols + (size_t)res.width * res.height * 3), next;
+	unsigned char *texels = res.packedCols;
+	for (int l = 0; l < res.numLevels; l++)
+	{
+		int width = res.levelWidth(l), height = res.levelHeight(l);
+		for (int i = 0; i < width * height; i++)
+		{
+			const float *col = &level[(size_t)i * 3];
+			float rounded[3];
+			if (format == HDR_RGB16F)
+			{
+				unsigned short half[3];
+				for (int k = 0; k < 3; k++)
+				{
+					half[k] = glm::packHalf1x16(col[k] < 65504.0f ? col[k] : 65504.0f);
+					rounded[k] = glm::unpackHalf1x16(half[k]);
+				}
+				memcpy(&texels[(size_t)i * texelBytes], half, sizeof(half));
+			}
+			else
+			{
+				unsigned int packed = packRGB9E5(col, rounded);
+				memcpy(&texels[(size_t)i * texelBytes], &packed, sizeof(packed));
+			}
+
+			/* The top level is what gets sampled */
+			if (l == 0)
+				memcpy(&res.cols[(size_t)i * 3], rounded, sizeof(rounded));
+		}
+		texels += (size_t)width * height * texelBytes;
+
+		if (l + 1 == res.numLevels)
+			break;
+		int nextWidth = res.levelWidth(l + 1), nextHeight = res.levelHeight(l + 1);
+		next.assign((size_t)nextWidth * nextHeight * 3, 0.0f);
+		for (int y = 0; y < nextHeight; y++)
+		{
+			for (int x = 0; x < nextWidth; x++)
+			{
+				for (int k = 0; k < 3; k++)
+				{
+					int x1 = 2 * x + 1 < width ? 2 * x + 1 : 2 * x, y1 = 2 * y + 1 < height ? 2 * y + 1 : 2 * y;
+					next[((size_t)y * nextWidth + x) * 3 + k] = 0.25f * (level[((size_t)(2 * y) * width + 2 * x) * 3 + k] + level[((size_t)(2 * y) * width + x1) * 3 + k] +
+						level[((size_t)y1 * width + 2 * x) * 3 + k] + level[((size_t)y1 * width + x1) * 3 + k]);
+				}
+			}
+		}
+		level.swap(next);
+	}
+}
+
+bool HDRLoader::load(const char *fileName, HDRLoaderResult &res, int cellSize, int format)
 {
 	int i;
 	char str[200];
@@ -169,7 +353,7 @@ bool HDRLoader::load(const char *fileName, HDRLoaderResult &res)
 	}
 
 	int w, h;
-	if (!sscanf(reso, "-Y %ld +X %ld", &h, &w)) {
+	if (!sscanf(reso, "-Y %d +X %d", &h, &w)) {
 		fclose(file);
 		return false;
 	}
@@ -197,7 +381,8 @@ bool HDRLoader::load(const char *fileName, HDRLoaderResult &res)
 	delete [] scanline;
 	fclose(file);
 
-	buildDistributions(res);
+	convert(res, format);
+	buildAliasTable(res, cellSize);
 	return true;
 }
 
@@ -12,26 +12,63 @@
 
 /* 
 	This is modified version of the original code. Addeed code to build marginal & conditional densities for IBL importance sampling
+	and an alias table over the image that replaces them in the renderer. The image can go to the GPU in
+	16-bit half or shared exponent texels with a mip chain
 */
 
+// GPU texel formats of the environment map
+enum HDRFormat
+{
+	HDR_RGB32F, // the loaded floats as they are, no mips
+	HDR_RGB16F, // three half floats, 6 bytes per texel
+	HDR_RGB9E5  // three 9-bit mantissas sharing a 5-bit exponent, 4 bytes per texel
+};
+
 class HDRLoaderResult {
 public:
 	HDRLoaderResult()
 	{
 		width = height = 0;
 		cols = NULL;
+		format = HDR_RGB32F;
+		numLevels = 1;
+		packedCols = NULL;
+		aliasWidth = aliasHeight = aliasCellSize = 0;
+		aliasData = NULL;
 	}
+	int levelWidth(int level) const { return (width >> level) > 0 ? width >> level : 1; }
+	int levelHeight(int level) const { return (height >> level) > 0 ? height >> level : 1; }
+	int texelBytes() const { return format == HDR_RGB32F ? 12 : (format == HDR_RGB16F ? 6 : 4); }
+	// GPU memory of the texture with its mip chain
+	long long textureBytes() const;
+
 	int width, height;
 	// each pixel takes 3 float32, each component can be of any value...
+	// after HDRLoader::convert they are what the format stores, so sampling sees the same radiance as the GPU
 	float *cols;
-	glm::vec2 *marginalDistData;    // y component holds the pdf
-	glm::vec2 *conditionalDistData; // y component holds the pdf
+	int format; // see HDRFormat
+	// mip levels in packedCols one after the other, texels of 3 half floats or one shared exponent word.
+	// NULL for HDR_RGB32F, which uploads cols
+	int numLevels;
+	unsigned char *packedCols;
+	// alias table over aliasWidth x aliasHeight cells of about aliasCellSize pixels squared. Per cell:
+	// alias cell << 7 | threshold in 127ths, then the float bits of the cell's pdf over the unit square.
+	// Eight bytes; an alias's pdf is in its own entry. At 2x2 cells that is 2 bytes per pixel, a quarter
+	// of the 8 the CDF tables took
+	int aliasWidth, aliasHeight, aliasCellSize;
+	glm::uvec2 *aliasData;
 };
 
 class HDRLoader {
-private:
-	static void buildDistributions(HDRLoaderResult &res);
 public:
-	static bool load(const char *fileName, HDRLoaderResult &res);
+	static bool load(const char *fileName, HDRLoaderResult &res, int cellSize = 0, int format = HDR_RGB32F);
+	// Rounds cols to the format and packs them with their mips, call buildAliasTable after it
+	static void convert(HDRLoaderResult &res, int format);
+	// (Re)builds the alias table. cellSize 0 picks 2x2 cells for maps wider than 4K and single pixels
+	// below, cellSize grows until the cells can be indexed in 25 bits (8K at 1x1)
+	static void buildAliasTable(HDRLoaderResult &res, int cellSize);
+	// Per row and per pixel CDF tables, what the renderer sampled with before the alias table.
+	// The y components hold the pdfs, height and width * height entries
+	static void buildDistributions(const HDRLoaderResult &res, glm::vec2 *marginalDistData, glm::vec2 *conditionalDistData);
 };
 
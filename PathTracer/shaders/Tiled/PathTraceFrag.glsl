@@ -12,24 +12,26 @@ uniform float invTileWidth;
 uniform float invTileHeight;
 
 uniform sampler2D accumTexture;
-uniform samplerBuffer BVH;
-uniform samplerBuffer triangleIndicesTex;
-uniform samplerBuffer verticesTex;
-uniform samplerBuffer normalsTexCoordsTex;
+uniform usamplerBuffer vertexAttribsTex;
+uniform usamplerBuffer triangleMaterialsTex;
 
 uniform samplerBuffer materialsTex;
-uniform samplerBuffer lightsTex;
+uniform samplerBuffer lightsTex; // the lights, then the light BVH, the light tree and the emissive triangles from their offsets
+uniform int lightBVHOffset;
+uniform int lightTreeOffset;
+uniform int emissiveTrianglesOffset;
 uniform sampler2DArray albedoTextures;
 uniform sampler2DArray metallicRoughnessTextures;
 uniform sampler2DArray normalTextures;
 
 uniform sampler2D hdrTexture;
-uniform sampler1D hdrMarginalDistTexture;
-uniform sampler2D hdrCondDistTexture;
-uniform float hdrResolution;
+uniform usampler2D hdrAliasTexture; // see HDRLoaderResult::aliasData
 uniform float hdrMultiplier;
 
 uniform int numOfLights;
+uniform int lightSampling; // see LightSamplingMode in Renderer.h
+uniform int numEmissiveTriangles; // 0 leaves emissive geometry to BSDF samples
+uniform float emissivePower;
 uniform int maxDepth;
 
 #define PI        3.14159265358979323
@@ -43,7 +45,7 @@ struct Ray { vec3 origin; vec3 direction; };
 struct Material { vec4 albedo; vec4 emission; vec4 param; vec4 texIDs; };
 struct Camera { vec3 up; vec3 right; vec3 forward; vec3 position; float fov; float focalDist; float aperture; };
 struct Light { vec3 position; vec3 emission; vec3 u; vec3 v; vec3 radiusAreaType; };
-struct State { vec3 normal; vec3 ffnormal; vec3 fhp; bool isEmitter; int depth; float hitDist; vec2 texCoord; vec3 bary; int triID; int matID; Material mat; bool specularBounce; };
+struct State { vec3 normal; vec3 ffnormal; vec3 fhp; bool isEmitter; int depth; float hitDist; vec2 texCoord; vec3 bary; int triID; int instanceID; int lightID; int matID; Material mat; bool specularBounce; };
 struct BsdfSampleRec { vec3 bsdfDir; float pdf; };
 struct LightSampleRec { vec3 surfacePos; vec3 normal; vec3 emission; float pdf; };
 
@@ -103,283 +105,129 @@ float RectIntersect(in vec3 pos, in vec3 u, in vec3 v, in vec3 normal, in vec4 p
 	return INFINITY;
 }
 
-//----------------------------------------------------------------
-float IntersectRayAABB(vec3 minCorner, vec3 maxCorner, Ray r)
-//----------------------------------------------------------------
-{
-	vec3 invdir = 1.0 / r.direction;
-
-	vec3 f = (maxCorner - r.origin) * invdir;
-	vec3 n = (minCorner - r.origin) * invdir;
-
-	vec3 tmax = max(f, n);
-	vec3 tmin = min(f, n);
-
-	float t1 = min(tmax.x, min(tmax.y, tmax.z));
-	float t0 = max(tmin.x, max(tmin.y, tmin.z));
-
-	return (t1 >= t0) ? (t0 > 0.f ? t0 : t1) : -1.0;
-}
-
-//-------------------------------------------------------------------------------
-vec3 BarycentricCoord(vec3 point, vec3 v0, vec3 v1, vec3 v2)
-//-------------------------------------------------------------------------------
-{
-	vec3 ab = v1 - v0;
-	vec3 ac = v2 - v0;
-	vec3 ah = point - v0;
-
-	float ab_ab = dot(ab, ab);
-	float ab_ac = dot(ab, ac);
-	float ac_ac = dot(ac, ac);
-	float ab_ah = dot(ab, ah);
-	float ac_ah = dot(ac, ah);
-
-	float inv_denom = 1.0 / (ab_ab * ac_ac - ab_ac * ab_ac);
-
-	float v = (ac_ac * ab_ah - ab_ac * ac_ah) * inv_denom;
-	float w = (ab_ab * ac_ah - ab_ac * ab_ah) * inv_denom;
-	float u = 1.0 - v - w;
-
-	return vec3(u, v, w);
-}
+#include "../common/Traversal.glsl"
 
 //-----------------------------------------------------------------------
-float SceneIntersect(Ray r, inout State state, inout LightSampleRec lightSampleRec)
+void IntersectLight(int i, Ray r, inout float t, inout State state, inout LightSampleRec lightSampleRec)
 //-----------------------------------------------------------------------
 {
-	float t = INFINITY;
 	float d;
 
-	// Intersect Emitters
-	for (int i = 0; i < numOfLights; i++)
-	{
-		// Fetch light Data
-		vec3 position = texelFetch(lightsTex, i * 5 + 0).xyz;
-		vec3 emission = texelFetch(lightsTex, i * 5 + 1).xyz;
-		vec3 u = texelFetch(lightsTex, i * 5 + 2).xyz;
-		vec3 v = texelFetch(lightsTex, i * 5 + 3).xyz;
-		vec3 radiusAreaType = texelFetch(lightsTex, i * 5 + 4).xyz;
+	// Fetch light Data
+	vec3 position = texelFetch(lightsTex, i * 5 + 0).xyz;
+	vec3 emission = texelFetch(lightsTex, i * 5 + 1).xyz;
+	vec3 u = texelFetch(lightsTex, i * 5 + 2).xyz;
+	vec3 v = texelFetch(lightsTex, i * 5 + 3).xyz;
+	vec3 radiusAreaType = texelFetch(lightsTex, i * 5 + 4).xyz;
 
-		if (radiusAreaType.z == 0) // Rectangular Area Light
-		{
-			vec3 normal = normalize(cross(u, v));
-			if (dot(normal, r.direction) > 0) // Hide backfacing quad light
-				continue;
-			vec4 plane = vec4(normal, dot(normal, position));
-			u *= 1.0f / dot(u, u);
-			v *= 1.0f / dot(v, v);
-
-			d = RectIntersect(position, u, v, normal, plane, r);
-			if (d < 0)
-				d = INFINITY;
-			if (d < t)
-			{
-				t = d;
-				float cosTheta = dot(-r.direction, normal);
-				float pdf = (t * t) / (radiusAreaType.y * cosTheta);
-				lightSampleRec.emission = emission;
-				lightSampleRec.pdf = pdf; 
-				state.isEmitter = true;
-			}
-		}
-		if (radiusAreaType.z == 1) // Spherical Area Light
+	if (radiusAreaType.z == 0) // Rectangular Area Light
+	{
+		vec3 normal = normalize(cross(u, v));
+		if (dot(normal, r.direction) > 0) // Hide backfacing quad light
+			return;
+		vec4 plane = vec4(normal, dot(normal, position));
+		u *= 1.0f / dot(u, u);
+		v *= 1.0f / dot(v, v);
+
+		d = RectIntersect(position, u, v, normal, plane, r);
+		if (d < 0)
+			d = INFINITY;
+		if (d < t)
 		{
-			d = SphereIntersect(radiusAreaType.x, position, r);
-			if (d < 0)
-				d = INFINITY;
-			if (d < t)
-			{
-				t = d;
-				float pdf = (t * t) / radiusAreaType.y;
-				lightSampleRec.emission = emission;
-				lightSampleRec.pdf = pdf;
-				state.isEmitter = true;
-			}
+			t = d;
+			float cosTheta = dot(-r.direction, normal);
+			float pdf = (t * t) / (radiusAreaType.y * cosTheta);
+			lightSampleRec.emission = emission;
+			lightSampleRec.pdf = pdf; 
+			state.isEmitter = true;
+			state.lightID = i;
 		}
 	}
-
-	int stack[64];
-	int ptr = 0;
-	stack[ptr++] = -1;
-
-	int idx = 0;
-	float leftHit = 0.0;
-	float rightHit = 0.0;
-
-	while (idx > -1)
+	if (radiusAreaType.z == 1) // Spherical Area Light
 	{
-		int n = idx;
-		vec3 LRLeaf = texelFetch(BVH, n * 3 + 2).xyz;
-
-		int leftIndex = int(LRLeaf.x);
-		int rightIndex = int(LRLeaf.y);
-		int isLeaf = int(LRLeaf.z);
-
-		if (isLeaf == 1)
-		{
-			for (int i = 0; i <= rightIndex; i++) // Loop through indices
-			{
-				int index = leftIndex + i;
-				vec4 triIndex = texelFetch(triangleIndicesTex, index).xyzw;
-
-				vec3 v0 = texelFetch(verticesTex, int(triIndex.x)).xyz;
-				vec3 v1 = texelFetch(verticesTex, int(triIndex.y)).xyz;
-				vec3 v2 = texelFetch(verticesTex, int(triIndex.z)).xyz;
-
-				vec3 e0 = v1 - v0;
-				vec3 e1 = v2 - v0;
-				vec3 pv = cross(r.direction, e1);
-				float det = dot(e0, pv);
-
-				vec3 tv = r.origin - v0.xyz;
-				vec3 qv = cross(tv, e0);
-
-				vec4 uvt;
-				uvt.x = dot(tv, pv);
-				uvt.y = dot(r.direction, qv);
-				uvt.z = dot(e1, qv);
-				uvt.xyz = uvt.xyz / det;
-				uvt.w = 1.0 - uvt.x - uvt.y;
-
-				if (all(greaterThanEqual(uvt, vec4(0.0))) && uvt.z < t)
-				{
-					t = uvt.z;
-					state.isEmitter = false;
-					state.triID = int(triIndex.w);
-					state.fhp = r.origin + r.direction * t;
-					state.bary = BarycentricCoord(state.fhp, v0, v1, v2);
-				}
-			}
-		}
-		else
+		d = SphereIntersect(radiusAreaType.x, position, r);
+		if (d < 0)
+			d = INFINITY;
+		if (d < t)
 		{
-			leftHit = IntersectRayAABB(texelFetch(BVH, leftIndex * 3 + 0).xyz, texelFetch(BVH, leftIndex * 3 + 1).xyz, r);
-			rightHit = IntersectRayAABB(texelFetch(BVH, rightIndex * 3 + 0).xyz, texelFetch(BVH, rightIndex * 3 + 1).xyz, r);
-
-			if (leftHit > 0.0 && rightHit > 0.0)
-			{
-				int deferred = -1;
-				if (leftHit > rightHit)
-				{
-					idx = rightIndex;
-					deferred = leftIndex;
-				}
-				else
-				{
-					idx = leftIndex;
-					deferred = rightIndex;
-				}
-
-				stack[ptr++] = deferred;
-				continue;
-			}
-			else if (leftHit > 0)
-			{
-				idx = leftIndex;
-				continue;
-			}
-			else if (rightHit > 0)
-			{
-				idx = rightIndex;
-				continue;
-			}
+			t = d;
+			float pdf = (t * t) / radiusAreaType.y;
+			lightSampleRec.emission = emission;
+			lightSampleRec.pdf = pdf;
+			state.isEmitter = true;
+			state.lightID = i;
 		}
-		idx = stack[--ptr];
 	}
-
-	state.hitDist = t;
-	return t;
 }
 
 //-----------------------------------------------------------------------
-bool SceneIntersectShadow(Ray r, float maxDist)
+float SceneIntersect(Ray r, inout State state, inout LightSampleRec lightSampleRec)
 //-----------------------------------------------------------------------
 {
-	int stack[64];
-	int ptr = 0;
-	stack[ptr++] = -1;
-
-	int idx = 0;
-	float leftHit = 0.0;
-	float rightHit = 0.0;
+	float t = INFINITY;
+	state.instanceID = -1;
 
-	while (idx > -1)
+	// Intersect Emitters through their BVH, nearest child first and clipped to the closest light so far
+	if (numOfLights > 0)
 	{
-		int n = idx;
-		vec3 LRLeaf = texelFetch(BVH, n * 3 + 2).xyz;
+		vec3 invDir = SafeInverse(r.direction);
+		vec3 oInvDir = r.origin * invDir;
 
-		int leftIndex = int(LRLeaf.x);
-		int rightIndex = int(LRLeaf.y);
-		int isLeaf = int(LRLeaf.z);
+		int stack[32];
+		int ptr = 0;
+		stack[ptr++] = -1;
 
-		if (isLeaf == 1)
+		int idx = 0;
+		while (idx > -1)
 		{
-			for (int i = 0; i <= rightIndex; i++) // Loop through indices
+			ivec3 LRLeaf = floatBitsToInt(texelFetch(lightsTex, lightBVHOffset + idx * 3 + 2).xyz);
+
+			if (LRLeaf.z == 1)
 			{
-				int index = leftIndex + i;
-				vec4 triIndex = texelFetch(triangleIndicesTex, index).xyzw;
-
-				vec3 v0 = texelFetch(verticesTex, int(triIndex.x)).xyz;
-				vec3 v1 = texelFetch(verticesTex, int(triIndex.y)).xyz;
-				vec3 v2 = texelFetch(verticesTex, int(triIndex.z)).xyz;
-
-				vec3 e0 = v1 - v0;
-				vec3 e1 = v2 - v0;
-				vec3 pv = cross(r.direction, e1);
-				float det = dot(e0, pv);
-
-				vec3 tv = r.origin - v0.xyz;
-				vec3 qv = cross(tv, e0);
-
-				vec4 uvt;
-				uvt.x = dot(tv, pv);
-				uvt.y = dot(r.direction, qv);
-				uvt.z = dot(e1, qv);
-				uvt.xyz = uvt.xyz / det;
-				uvt.w = 1.0 - uvt.x - uvt.y;
-
-				if (all(greaterThanEqual(uvt, vec4(0.0))) && uvt.z < maxDist)
-					return true;
+				for (int i = LRLeaf.x; i < LRLeaf.x + LRLeaf.y; i++)
+					IntersectLight(i, r, t, state, lightSampleRec);
 			}
-		}
-		else
-		{
-			leftHit = IntersectRayAABB(texelFetch(BVH, leftIndex * 3 + 0).xyz, texelFetch(BVH, leftIndex * 3 + 1).xyz, r);
-			rightHit = IntersectRayAABB(texelFetch(BVH, rightIndex * 3 + 0).xyz, texelFetch(BVH, rightIndex * 3 + 1).xyz, r);
-
-			if (leftHit > 0.0 && rightHit > 0.0)
+			else
 			{
-				int deferred = -1;
-				if (leftHit > rightHit)
+				float leftHit = IntersectRayAABB(texelFetch(lightsTex, lightBVHOffset + LRLeaf.x * 3 + 0).xyz, texelFetch(lightsTex, lightBVHOffset + LRLeaf.x * 3 + 1).xyz, invDir, oInvDir, t);
+				float rightHit = IntersectRayAABB(texelFetch(lightsTex, lightBVHOffset + LRLeaf.y * 3 + 0).xyz, texelFetch(lightsTex, lightBVHOffset + LRLeaf.y * 3 + 1).xyz, invDir, oInvDir, t);
+
+				if (leftHit < INFINITY && rightHit < INFINITY)
 				{
-					idx = rightIndex;
-					deferred = leftIndex;
+					bool rightFirst = rightHit < leftHit;
+					idx = rightFirst ? LRLeaf.y : LRLeaf.x;
+					stack[ptr++] = rightFirst ? LRLeaf.x : LRLeaf.y;
+					continue;
 				}
-				else
+				else if (leftHit < INFINITY)
 				{
-					idx = leftIndex;
-					deferred = rightIndex;
+					idx = LRLeaf.x;
+					continue;
+				}
+				else if (rightHit < INFINITY)
+				{
+					idx = LRLeaf.y;
+					continue;
 				}
-
-				stack[ptr++] = deferred;
-				continue;
-			}
-			else if (leftHit > 0)
-			{
-				idx = leftIndex;
-				continue;
-			}
-			else if (rightHit > 0)
-			{
-				idx = rightIndex;
-				continue;
 			}
+			idx = stack[--ptr];
 		}
-		idx = stack[--ptr];
 	}
 
-	return false;
+	Hit hit = Hit(t, vec2(0.0), -1, -1);
+	if (SceneTraverse(r, false, true, hit))
+	{
+		// Hit attributes are only derived for the closest triangle
+		t = hit.t;
+		state.isEmitter = false;
+		state.triID = hit.triID;
+		state.instanceID = hit.instanceID;
+		state.fhp = r.origin + r.direction * t;
+		state.bary = vec3(1.0 - hit.uv.x - hit.uv.y, hit.uv.x, hit.uv.y);
+	}
+
+	state.hitDist = t;
+	return t;
 }
 
 //-----------------------------------------------------------------------
@@ -409,28 +257,79 @@ vec3 UniformSampleSphere(float u1, float u2)
 	return vec3(x, y, z);
 }
 
+//-----------------------------------------------------------------------
+vec3 DecodeNormal(uint bits)
+//-----------------------------------------------------------------------
+{
+	// Octahedral normal, x and y are snorm16 in the low and high half
+	vec2 p = max(vec2(int(bits << 16u) >> 16, int(bits) >> 16) / 32767.0, vec2(-1.0));
+	vec3 n = vec3(p, 1.0 - abs(p.x) - abs(p.y));
+	if (n.z < 0.0)
+		n.xy = (1.0 - abs(n.yx)) * vec2(n.x >= 0.0 ? 1.0 : -1.0, n.y >= 0.0 ? 1.0 : -1.0);
+	return normalize(n);
+}
+
+//-----------------------------------------------------------------------
+vec2 DecodeTexCoord(uint bits)
+//-----------------------------------------------------------------------
+{
+	// Two halves, GLSL 3.30 has no unpackHalf2x16. Texcoords are finite, no inf or NaN
+	uvec2 h = uvec2(bits & 0xFFFFu, bits >> 16u);
+	uvec2 exponent = (h >> 10u) & 0x1Fu;
+	uvec2 mantissa = h & 0x3FFu;
+	vec2 magnitude = mix(uintBitsToFloat(((exponent + 112u) << 23u) | (mantissa << 13u)), vec2(mantissa) * exp2(-24.0), equal(exponent, uvec2(0u)));
+	return mix(magnitude, -magnitude, notEqual(h & 0x8000u, uvec2(0u)));
+}
+
 //-----------------------------------------------------------------------
 void GetNormalAndTexCoord(inout State state, inout Ray r)
 //-----------------------------------------------------------------------
 {
+	// triID is the BVH leaf slot of the hit, the material IDs are stored in leaf order.
+	// Normals and texcoords belong to the welded vertices
 	int index = state.triID;
+	ivec3 vertices = texelFetch(triangleIndicesTex, index).xyz;
 
-	vec3 n1 = texelFetch(normalsTexCoordsTex, index * 6 + 0).xyz;
-	vec3 n2 = texelFetch(normalsTexCoordsTex, index * 6 + 1).xyz;
-	vec3 n3 = texelFetch(normalsTexCoordsTex, index * 6 + 2).xyz;
+	uvec2 a1 = texelFetch(vertexAttribsTex, vertices.x).xy;
+	uvec2 a2 = texelFetch(vertexAttribsTex, vertices.y).xy;
+	uvec2 a3 = texelFetch(vertexAttribsTex, vertices.z).xy;
 
-	vec3 t1 = texelFetch(normalsTexCoordsTex, index * 6 + 3).xyz;
-	vec3 t2 = texelFetch(normalsTexCoordsTex, index * 6 + 4).xyz;
-	vec3 t3 = texelFetch(normalsTexCoordsTex, index * 6 + 5).xyz;
+	state.matID = int(texelFetch(triangleMaterialsTex, index).x);
+	state.texCoord = DecodeTexCoord(a1.y) * state.bary.x + DecodeTexCoord(a2.y) * state.bary.y + DecodeTexCoord(a3.y) * state.bary.z;
 
-	state.matID = int(t1.z);
-	state.texCoord = t1.xy * state.bary.x + t2.xy * state.bary.y + t3.xy * state.bary.z;
+	vec3 normal = normalize(DecodeNormal(a1.x) * state.bary.x + DecodeNormal(a2.x) * state.bary.y + DecodeNormal(a3.x) * state.bary.z);
 
-	vec3 normal = normalize(n1 * state.bary.x + n2 * state.bary.y + n3 * state.bary.z);
+	// Object to world with the inverse transpose, the instance holds the inverse rows
+	if (state.instanceID >= 0)
+	{
+		vec3 r0 = texelFetch(instancesTex, state.instanceID * 4 + 0).xyz;
+		vec3 r1 = texelFetch(instancesTex, state.instanceID * 4 + 1).xyz;
+		vec3 r2 = texelFetch(instancesTex, state.instanceID * 4 + 2).xyz;
+		normal = normalize(r0 * normal.x + r1 * normal.y + r2 * normal.z);
+	}
 	state.normal = normal;
 	state.ffnormal = dot(normal, r.direction) <= 0.0 ? normal : normal * -1.0;
 }
 
+//-----------------------------------------------------------------------
+vec3 GeometricNormal(in State state)
+//-----------------------------------------------------------------------
+{
+	// Face normal of the hit triangle in world space, either orientation
+	ivec3 vertices = texelFetch(triangleIndicesTex, state.triID).xyz;
+	vec3 v0 = FetchVertex(vertices.x);
+	vec3 normal = cross(FetchVertex(vertices.y) - v0, FetchVertex(vertices.z) - v0);
+
+	if (state.instanceID >= 0)
+	{
+		vec3 r0 = texelFetch(instancesTex, state.instanceID * 4 + 0).xyz;
+		vec3 r1 = texelFetch(instancesTex, state.instanceID * 4 + 1).xyz;
+		vec3 r2 = texelFetch(instancesTex, state.instanceID * 4 + 2).xyz;
+		normal = r0 * normal.x + r1 * normal.y + r2 * normal.z;
+	}
+	return normalize(normal);
+}
+
 //-----------------------------------------------------------------------
 void GetMaterialsAndTextures(inout State state, in Ray r)
 //-----------------------------------------------------------------------
@@ -726,7 +625,7 @@ void sampleSphereLight(in Light light, inout LightSampleRec lightSampleRec)
 
 	lightSampleRec.surfacePos = light.position + UniformSampleSphere(r1, r2) * light.radiusAreaType.x;
 	lightSampleRec.normal = normalize(lightSampleRec.surfacePos - light.position);
-	lightSampleRec.emission = light.emission * numOfLights;
+	lightSampleRec.emission = light.emission;
 }
 
 //-----------------------------------------------------------------------
@@ -738,7 +637,7 @@ void sampleQuadLight(in Light light, inout LightSampleRec lightSampleRec)
 
 	lightSampleRec.surfacePos = light.position + light.u * r1 + light.v * r2;
 	lightSampleRec.normal = normalize(cross(light.u, light.v));
-	lightSampleRec.emission = light.emission * numOfLights;
+	lightSampleRec.emission = light.emission;
 }
 
 //-----------------------------------------------------------------------
@@ -751,36 +650,169 @@ void sampleLight(in Light light, inout LightSampleRec lightSampleRec)
 		sampleSphereLight(light, lightSampleRec);
 }
 
+//-----------------------------------------------------------------------
+float LightImportance(int node, vec3 p, vec3 n)
+//-----------------------------------------------------------------------
+{
+	// Power over squared distance, bounded by the best cosines any point of the node's box reaches at
+	// the shading point and in the emission cone. Same as LightTreeImportance in Benchmark.cpp
+	vec3 bboxMin = texelFetch(lightsTex, lightBVHOffset + node * 3 + 0).xyz;
+	vec3 bboxMax = texelFetch(lightsTex, lightBVHOffset + node * 3 + 1).xyz;
+	vec4 cone = texelFetch(lightsTex, lightTreeOffset + node * 2 + 0);
+	vec2 powerCosThetaE = texelFetch(lightsTex, lightTreeOffset + node * 2 + 1).xy;
+
+	vec3 toCenter = 0.5 * (bboxMin + bboxMax) - p;
+	float radius2 = 0.25 * dot(bboxMax - bboxMin, bboxMax - bboxMin);
+	float dist2 = dot(toCenter, toCenter);
+	if (dist2 <= radius2)
+		return powerCosThetaE.x / radius2;
+	vec3 dir = toCenter * inversesqrt(dist2);
+
+	// Angles less the half angle of the box, clamped at zero: cos(max(theta - thetaU, 0))
+	float sinThetaU2 = radius2 / dist2;
+	float cosThetaU = sqrt(1.0 - sinThetaU2);
+	float sinThetaU = sqrt(sinThetaU2);
+
+	float cosThetaI = dot(n, dir);
+	float cosI = cosThetaI > cosThetaU ? 1.0 : cosThetaI * cosThetaU + sqrt(max(0.0, 1.0 - cosThetaI * cosThetaI)) * sinThetaU;
+	if (cosI <= 0.0)
+		return 0.0;
+
+	float cosThetaW = -dot(cone.xyz, dir);
+	float sinThetaW = sqrt(max(0.0, 1.0 - cosThetaW * cosThetaW));
+	float sinThetaO = sqrt(max(0.0, 1.0 - cone.w * cone.w));
+	float cosThetaX = cosThetaW > cone.w ? 1.0 : cosThetaW * cone.w + sinThetaW * sinThetaO;
+	float sinThetaX = cosThetaW > cone.w ? 0.0 : sqrt(max(0.0, 1.0 - cosThetaX * cosThetaX));
+	float cosThetaP = cosThetaX > cosThetaU ? 1.0 : cosThetaX * cosThetaU + sinThetaX * sinThetaU;
+	if (cosThetaP <= powerCosThetaE.y)
+		return 0.0;
+
+	return powerCosThetaE.x * cosI * cosThetaP / dist2;
+}
+
+//-----------------------------------------------------------------------
+float LeftChildProbability(ivec3 LRLeaf, vec3 p, vec3 n)
+//-----------------------------------------------------------------------
+{
+	// Negative when neither child can light p
+	float leftImportance = LightImportance(LRLeaf.x, p, n);
+	float rightImportance = LightImportance(LRLeaf.y, p, n);
+	return leftImportance + rightImportance > 0.0 ? leftImportance / (leftImportance + rightImportance) : -1.0;
+}
+
+//-----------------------------------------------------------------------
+int SampleLightIndex(vec3 p, vec3 n, out float pdf)
+//-----------------------------------------------------------------------
+{
+	// Uniformly, or down the light tree choosing children by importance. -1 if no light can be picked
+	if (lightSampling == 0)
+	{
+		pdf = 1.0 / float(numOfLights);
+		return int(rand() * numOfLights);
+	}
+
+	pdf = 1.0;
+	ivec3 LRLeaf = floatBitsToInt(texelFetch(lightsTex, lightBVHOffset + 2).xyz);
+	while (LRLeaf.z == 0)
+	{
+		float leftProbability = LeftChildProbability(LRLeaf, p, n);
+		if (leftProbability < 0.0)
+			return -1;
+		bool goLeft = rand() < leftProbability;
+		pdf *= goLeft ? leftProbability : 1.0 - leftProbability;
+		LRLeaf = floatBitsToInt(texelFetch(lightsTex, lightBVHOffset + (goLeft ? LRLeaf.x : LRLeaf.y) * 3 + 2).xyz);
+	}
+	return LRLeaf.x;
+}
+
+//-----------------------------------------------------------------------
+float LightPickPdf(int light, vec3 p, vec3 n)
+//-----------------------------------------------------------------------
+{
+	// Probability of SampleLightIndex picking this light, the tree walk follows the subtree holding it
+	if (lightSampling == 0)
+		return 1.0 / float(numOfLights);
+
+	float pdf = 1.0;
+	ivec3 LRLeaf = floatBitsToInt(texelFetch(lightsTex, lightBVHOffset + 2).xyz);
+	while (LRLeaf.z == 0)
+	{
+		float leftProbability = LeftChildProbability(LRLeaf, p, n);
+		if (leftProbability < 0.0)
+			return 0.0;
+		bool goLeft = light < floatBitsToInt(texelFetch(lightsTex, lightTreeOffset + LRLeaf.y * 2 + 1).z);
+		pdf *= goLeft ? leftProbability : 1.0 - leftProbability;
+		LRLeaf = floatBitsToInt(texelFetch(lightsTex, lightBVHOffset + (goLeft ? LRLeaf.x : LRLeaf.y) * 3 + 2).xyz);
+	}
+	return pdf;
+}
+
+//-----------------------------------------------------------------------
+float Luminance(vec3 c)
+//-----------------------------------------------------------------------
+{
+	return dot(c, vec3(0.2126, 0.7152, 0.0722));
+}
+
+//-----------------------------------------------------------------------
+float EmissiveTrianglePdf(vec3 emission, float lightDistSq, float cosTheta)
+//-----------------------------------------------------------------------
+{
+	// Solid angle pdf of a point on an emissive triangle. The alias table picks triangles by
+	// luminance times area and the point is uniform on the triangle, so the area pdf is luminance over
+	// the total power whichever triangle it is
+	return Luminance(emission) / emissivePower * lightDistSq / cosTheta;
+}
+
 //-----------------------------------------------------------------------
 float EnvPdf(in Ray r)
 //-----------------------------------------------------------------------
 {
 	float theta = acos(r.direction.y);
 	vec2 uv = vec2((PI + atan(r.direction.z, r.direction.x)) * (1.0 / TWO_PI), theta * (1.0 / PI));
-	float pdf = texture(hdrCondDistTexture, uv).y * texture(hdrMarginalDistTexture, uv.y).y;
-	return (pdf * hdrResolution) / (2.0 * PI * PI * sin(theta));
+	ivec2 cells = textureSize(hdrAliasTexture, 0);
+	float pdf = uintBitsToFloat(texelFetch(hdrAliasTexture, min(ivec2(uv * vec2(cells)), cells - 1), 0).y);
+	return pdf / (2.0 * PI * PI * sin(theta));
 }
 
 //-----------------------------------------------------------------------
-vec4 EnvSample(inout vec3 color)
+float EnvBackgroundLod()
 //-----------------------------------------------------------------------
 {
-	float r1 = rand();
-	float r2 = rand();
+	// Mip level with about one texel per pixel for the envmap seen straight from the camera.
+	// Lighting reads level 0, where the importance sampling tables come from
+	float pixelAngle = 2.0 * tan(camera.fov * 0.5) / screenResolution.y;
+	return max(log2(pixelAngle * float(textureSize(hdrTexture, 0).y) / PI), 0.0);
+}
 
-	float v = texture(hdrMarginalDistTexture, r1).x;
-	float u = texture(hdrCondDistTexture, vec2(r2, v)).x;
+//-----------------------------------------------------------------------
+vec4 EnvSample(inout vec3 color)
+//-----------------------------------------------------------------------
+{
+	// A uniform cell of the alias table keeps itself below its threshold or hands over to its alias,
+	// then a uniform point in that cell. The cell is picked per axis, one float could not reach every
+	// index of a large table. An alias needs a second fetch for its pdf
+	ivec2 cells = textureSize(hdrAliasTexture, 0);
+	ivec2 cell = min(ivec2(vec2(rand(), rand()) * vec2(cells)), cells - 1);
+	uvec2 entry = texelFetch(hdrAliasTexture, cell, 0).xy;
+	if (rand() * 127.0 >= float(entry.x & 0x7Fu))
+	{
+		int alias = int(entry.x >> 7u);
+		cell = ivec2(alias % cells.x, alias / cells.x);
+		entry = texelFetch(hdrAliasTexture, cell, 0).xy;
+	}
+	float pdf = uintBitsToFloat(entry.y);
+	vec2 uv = (vec2(cell) + vec2(rand(), rand())) / vec2(cells);
 
-	color = texture(hdrTexture, vec2(u, v)).xyz * hdrMultiplier;
-	float pdf = texture(hdrCondDistTexture, vec2(u, v)).y * texture(hdrMarginalDistTexture, v).y;
+	color = textureLod(hdrTexture, uv, 0.0).xyz * hdrMultiplier;
 
-	float phi = u * TWO_PI;
-	float theta = v * PI;
+	float phi = uv.x * TWO_PI;
+	float theta = uv.y * PI;
 
 	if (sin(theta) == 0.0)
 		pdf = 0.0;
 
-	return vec4(-sin(theta) * cos(phi), cos(theta), -sin(theta)*sin(phi), (pdf * hdrResolution) / (2.0 * PI * PI * sin(theta)));
+	return vec4(-sin(theta) * cos(phi), cos(theta), -sin(theta)*sin(phi), pdf / (2.0 * PI * PI * sin(theta)));
 }
 //-----------------------------------------------------------------------
 vec3 DirectLight(in Ray r, in State state)
@@ -813,15 +845,53 @@ vec3 DirectLight(in Ray r, in State state)
 		}
 	}
 
+	/* Emissive Triangles */
+	if (numEmissiveTriangles > 0)
+	{
+		// Alias table pick, then a uniform point on the triangle. Emission is two-sided like BSDF hits see it
+		int index = min(int(rand() * numEmissiveTriangles), numEmissiveTriangles - 1);
+		vec4 v0Threshold = texelFetch(lightsTex, emissiveTrianglesOffset + index * 4 + 0);
+		if (rand() >= v0Threshold.w)
+		{
+			index = floatBitsToInt(texelFetch(lightsTex, emissiveTrianglesOffset + index * 4 + 1).w);
+			v0Threshold = texelFetch(lightsTex, emissiveTrianglesOffset + index * 4 + 0);
+		}
+		vec3 edge1 = texelFetch(lightsTex, emissiveTrianglesOffset + index * 4 + 1).xyz;
+		vec3 edge2 = texelFetch(lightsTex, emissiveTrianglesOffset + index * 4 + 2).xyz;
+		vec3 emission = texelFetch(lightsTex, emissiveTrianglesOffset + index * 4 + 3).xyz;
+
+		float su = sqrt(rand());
+		float r2 = rand();
+		vec3 lightDir = v0Threshold.xyz + edge1 * (su * (1.0 - r2)) + edge2 * (su * r2) - surfacePos;
+		float lightDistSq = dot(lightDir, lightDir);
+		float lightDist = sqrt(lightDistSq);
+		lightDir /= lightDist;
+		float cosTheta = abs(dot(normalize(cross(edge1, edge2)), lightDir));
+
+		if (dot(lightDir, state.normal) > 0.0 && cosTheta > 0.0)
+		{
+			Ray shadowRay = Ray(surfacePos, lightDir);
+			bool inShadow = SceneIntersectShadow(shadowRay, lightDist - EPS);
+
+			if (!inShadow)
+			{
+				float bsdfPdf = UE4Pdf(r, state, lightDir);
+				vec3 f = UE4Eval(r, state, lightDir);
+				float lightPdf = EmissiveTrianglePdf(emission, lightDistSq, cosTheta);
+
+				L += powerHeuristic(lightPdf, bsdfPdf) * f * abs(dot(state.normal, lightDir)) * emission / lightPdf;
+			}
+		}
+	}
+
 	/* Sample Analytic Lights */
-	if (numOfLights > 0)
+	float pickPdf;
+	int index = numOfLights > 0 ? SampleLightIndex(surfacePos, state.normal, pickPdf) : -1;
+	if (index >= 0)
 	{
 		LightSampleRec lightSampleRec;
 		Light light;
 
-		//Pick a light to sample
-		int index = int(rand() * numOfLights);
-
 		// Fetch light Data
 		vec3 p = texelFetch(lightsTex, index * 5 + 0).xyz;
 		vec3 e = texelFetch(lightsTex, index * 5 + 1).xyz;
@@ -847,7 +917,7 @@ vec3 DirectLight(in Ray r, in State state)
 		{
 			float bsdfPdf = UE4Pdf(r, state, lightDir);
 			vec3 f = UE4Eval(r, state, lightDir);
-			float lightPdf = lightDistSq / (light.radiusAreaType.y * abs(dot(lightSampleRec.normal, lightDir)));
+			float lightPdf = pickPdf * lightDistSq / (light.radiusAreaType.y * abs(dot(lightSampleRec.normal, lightDir)));
 
 			L += powerHeuristic(lightPdf, bsdfPdf) * f * abs(dot(state.normal, lightDir)) * lightSampleRec.emission / lightPdf;
 		}
@@ -881,6 +951,7 @@ vec3 PathTrace(Ray r)
 	State state;
 	LightSampleRec lightSampleRec;
 	BsdfSampleRec bsdfSampleRec;
+	vec3 lightSamplePos = vec3(0.0), lightSampleNormal = vec3(0.0); // where DirectLight last picked a light
 
 	for (int depth = 0; depth < maxDepth; depth++)
 	{
@@ -900,7 +971,7 @@ vec3 PathTrace(Ray r)
 					misWeight = powerHeuristic(bsdfSampleRec.pdf, lightPdf);
 				}
 
-				radiance += misWeight * texture(hdrTexture, uv).xyz * throughput * hdrMultiplier;
+				radiance += misWeight * textureLod(hdrTexture, uv, depth == 0 ? EnvBackgroundLod() : 0.0).xyz * throughput * hdrMultiplier;
 			}
 			break;
 		}
@@ -908,10 +979,22 @@ vec3 PathTrace(Ray r)
 		GetNormalAndTexCoord(state, r);
 		GetMaterialsAndTextures(state, r);
 
-		radiance += state.mat.emission.xyz * throughput;
+		// Emissive triangles are light samples of the last bounce as well, weight against those
+		float emissionWeight = 1.0;
+		if (depth > 0 && !state.specularBounce && numEmissiveTriangles > 0 && Luminance(state.mat.emission.xyz) > 0.0)
+		{
+			vec3 toHit = state.fhp - lightSamplePos;
+			float lightDistSq = dot(toHit, toHit);
+			float cosTheta = abs(dot(GeometricNormal(state), toHit * inversesqrt(lightDistSq)));
+			emissionWeight = powerHeuristic(bsdfSampleRec.pdf, EmissiveTrianglePdf(state.mat.emission.xyz, lightDistSq, cosTheta));
+		}
+		radiance += emissionWeight * state.mat.emission.xyz * throughput;
 
 		if (state.isEmitter)
 		{
+			// The light strategy of the last bounce would have picked this light with LightPickPdf
+			if (depth > 0 && !state.specularBounce)
+				lightSampleRec.pdf *= LightPickPdf(state.lightID, lightSamplePos, lightSampleNormal);
 			radiance += EmitterSample(r, state, lightSampleRec, bsdfSampleRec) * throughput;
 			break;
 		}
@@ -919,6 +1002,8 @@ vec3 PathTrace(Ray r)
 		if (state.mat.albedo.w == 0.0) // UE4 Brdf
 		{
 			state.specularBounce = false;
+			lightSamplePos = state.fhp + state.normal * EPS;
+			lightSampleNormal = state.normal;
 			radiance += DirectLight(r, state) * throughput;
 
 			bsdfSampleRec.bsdfDir = UE4Sample(r, state);
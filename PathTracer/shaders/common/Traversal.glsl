@@ -0,0 +1,394 @@
+// BVH traversal shared by the path tracing shaders, expects Ray and INFINITY to be defined.
+// Every ray goes through the same walk: leaves only report distance and barycentrics,
+// the caller fetches the shading attributes once for the closest hit.
+
+uniform isamplerBuffer BVH; // compressed nodes are read back with uvec4()
+uniform samplerBuffer instancesTex;
+uniform isamplerBuffer triangleIndicesTex;
+uniform usamplerBuffer verticesTex; // float bits of the positions, or quantized positions
+uniform samplerBuffer woopTrianglesTex;
+uniform usamplerBuffer vertexFramesTex;
+
+uniform int bvhWidth;
+uniform bool bvhCompressed;
+uniform bool woopTriangles;
+uniform bool quantizedVertices;
+uniform int shadowRays; // see ShadowRayMode in Renderer.h
+
+struct Hit { float t; vec2 uv; int triID; int instanceID; };
+
+//-----------------------------------------------------------------------
+vec3 FetchVertex(int index)
+//-----------------------------------------------------------------------
+{
+	// Quantized vertices are 16-bit offsets from the origin of their frame in units of a power
+	// of two per axis, the frame index is in w
+	if (!quantizedVertices)
+		return uintBitsToFloat(texelFetch(verticesTex, index).xyz);
+
+	uvec4 q = texelFetch(verticesTex, index);
+	uvec4 originExp = texelFetch(vertexFramesTex, int(q.w));
+	vec3 scale = uintBitsToFloat(((uvec3(originExp.w) >> uvec3(0u, 8u, 16u)) & 0xFFu) << 23u);
+	return uintBitsToFloat(originExp.xyz) + vec3(q.xyz) * scale;
+}
+
+//-----------------------------------------------------------------------
+vec3 IntersectWoopTriangle(Ray r, int index, float maxDist)
+//-----------------------------------------------------------------------
+{
+	// Precomputed triangle of leaf slot index: the rows map a point to the plane distance and
+	// the barycentrics. Returns t, u, v of a hit closer than maxDist, t = INFINITY otherwise
+	vec4 rowT = texelFetch(woopTrianglesTex, index * 3 + 0);
+	float t = (rowT.w - dot(r.origin, rowT.xyz)) / dot(r.direction, rowT.xyz);
+	if (!(t >= 0.0 && t < maxDist))
+		return vec3(INFINITY, 0.0, 0.0);
+
+	vec3 p = r.origin + r.direction * t;
+	vec4 rowU = texelFetch(woopTrianglesTex, index * 3 + 1);
+	float u = rowU.w + dot(p, rowU.xyz);
+	if (u < 0.0)
+		return vec3(INFINITY, 0.0, 0.0);
+
+	vec4 rowV = texelFetch(woopTrianglesTex, index * 3 + 2);
+	float v = rowV.w + dot(p, rowV.xyz);
+	return (v >= 0.0 && u + v <= 1.0) ? vec3(t, u, v) : vec3(INFINITY, 0.0, 0.0);
+}
+
+//-----------------------------------------------------------------------
+vec3 IntersectLeafTriangle(Ray r, int index, float maxDist)
+//-----------------------------------------------------------------------
+{
+	// Same contract as IntersectWoopTriangle for either leaf format
+	if (woopTriangles)
+		return IntersectWoopTriangle(r, index, maxDist);
+
+	ivec4 triIndex = texelFetch(triangleIndicesTex, index);
+
+	vec3 v0 = FetchVertex(triIndex.x);
+	vec3 v1 = FetchVertex(triIndex.y);
+	vec3 v2 = FetchVertex(triIndex.z);
+
+	vec3 e0 = v1 - v0;
+	vec3 e1 = v2 - v0;
+	vec3 pv = cross(r.direction, e1);
+	float det = dot(e0, pv);
+
+	vec3 tv = r.origin - v0;
+	vec3 qv = cross(tv, e0);
+
+	vec3 tuv = vec3(dot(e1, qv), dot(tv, pv), dot(r.direction, qv)) / det;
+	if (tuv.y >= 0.0 && tuv.z >= 0.0 && tuv.y + tuv.z <= 1.0 && tuv.x >= 0.0 && tuv.x < maxDist)
+		return tuv;
+	return vec3(INFINITY, 0.0, 0.0);
+}
+
+//-----------------------------------------------------------------------
+vec3 SafeInverse(vec3 d)
+//-----------------------------------------------------------------------
+{
+	// Zero components would make origin * invDir an inf - inf in the slab tests
+	vec3 s = vec3(greaterThanEqual(d, vec3(0.0))) * 2.0 - 1.0;
+	return 1.0 / mix(d, s * 1e-20, lessThan(abs(d), vec3(1e-20)));
+}
+
+//-----------------------------------------------------------------------
+float IntersectRayAABB(vec3 minCorner, vec3 maxCorner, vec3 invDir, vec3 oInvDir, float maxDist)
+//-----------------------------------------------------------------------
+{
+	// Slab test on [0, maxDist] with the ray given as invDir and origin * invDir, one fma per
+	// plane. Returns the entry distance, INFINITY for boxes missed, behind the ray or past maxDist
+	vec3 f = maxCorner * invDir - oInvDir;
+	vec3 n = minCorner * invDir - oInvDir;
+
+	vec3 tmax = max(f, n);
+	vec3 tmin = min(f, n);
+
+	float t1 = min(min(tmax.x, min(tmax.y, tmax.z)), maxDist);
+	float t0 = max(max(tmin.x, max(tmin.y, tmin.z)), 0.0);
+
+	return (t0 <= t1) ? t0 : INFINITY;
+}
+
+//-----------------------------------------------------------------------
+vec4 IntersectWideNode(int node, vec3 invDir, vec3 oInvDir, float maxDist, out ivec4 entry)
+//-----------------------------------------------------------------------
+{
+	// Slab test against all 4 children of a wide node at once. Returns the entry
+	// distance per child, INFINITY for misses and empty slots, and the stack entry
+	// per child: inner children are node indices, leaves are ~(node * 4 + slot)
+	int base = node * 8;
+	vec4 tx0 = intBitsToFloat(texelFetch(BVH, base + 0)) * invDir.x - oInvDir.x;
+	vec4 tx1 = intBitsToFloat(texelFetch(BVH, base + 1)) * invDir.x - oInvDir.x;
+	vec4 ty0 = intBitsToFloat(texelFetch(BVH, base + 2)) * invDir.y - oInvDir.y;
+	vec4 ty1 = intBitsToFloat(texelFetch(BVH, base + 3)) * invDir.y - oInvDir.y;
+	vec4 tz0 = intBitsToFloat(texelFetch(BVH, base + 4)) * invDir.z - oInvDir.z;
+	vec4 tz1 = intBitsToFloat(texelFetch(BVH, base + 5)) * invDir.z - oInvDir.z;
+	ivec4 child = texelFetch(BVH, base + 6);
+	ivec4 numTris = texelFetch(BVH, base + 7);
+
+	vec4 tNear = max(max(max(min(tx0, tx1), min(ty0, ty1)), min(tz0, tz1)), vec4(0.0));
+	vec4 tFar = min(min(min(max(tx0, tx1), max(ty0, ty1)), max(tz0, tz1)), vec4(maxDist));
+
+	for (int i = 0; i < 4; i++)
+	{
+		entry[i] = numTris[i] > 0 ? ~(node * 4 + i) : child[i];
+		if (!(child[i] >= 0 && tNear[i] <= tFar[i]))
+			tNear[i] = INFINITY;
+	}
+	return tNear;
+}
+
+//-----------------------------------------------------------------------
+vec4 IntersectCompressedNode(int node, vec3 invDir, vec3 oInvDir, float maxDist, out ivec4 entry)
+//-----------------------------------------------------------------------
+{
+	// Same as IntersectWideNode for the quantized layout: child bounds are 8-bit
+	// offsets from the node origin in units of a power of two per axis, so each
+	// plane is the node origin plane plus a multiple of scale * invDir
+	int base = node * 4;
+	uvec4 originExp = uvec4(texelFetch(BVH, base + 0));
+	uvec4 boundsXY = uvec4(texelFetch(BVH, base + 1));
+	uvec4 boundsZ = uvec4(texelFetch(BVH, base + 2));
+	uvec4 child = uvec4(texelFetch(BVH, base + 3));
+
+	vec3 scale = uintBitsToFloat(((uvec3(originExp.w) >> uvec3(0u, 8u, 16u)) & 0xFFu) << 23u);
+	vec3 tOrigin = uintBitsToFloat(originExp.xyz) * invDir - oInvDir;
+	vec3 tScale = scale * invDir;
+	uvec4 shifts = uvec4(0u, 8u, 16u, 24u);
+
+	vec4 tx0 = tOrigin.x + vec4((uvec4(boundsXY.x) >> shifts) & 0xFFu) * tScale.x;
+	vec4 tx1 = tOrigin.x + vec4((uvec4(boundsXY.y) >> shifts) & 0xFFu) * tScale.x;
+	vec4 ty0 = tOrigin.y + vec4((uvec4(boundsXY.z) >> shifts) & 0xFFu) * tScale.y;
+	vec4 ty1 = tOrigin.y + vec4((uvec4(boundsXY.w) >> shifts) & 0xFFu) * tScale.y;
+	vec4 tz0 = tOrigin.z + vec4((uvec4(boundsZ.x) >> shifts) & 0xFFu) * tScale.z;
+	vec4 tz1 = tOrigin.z + vec4((uvec4(boundsZ.y) >> shifts) & 0xFFu) * tScale.z;
+	uvec4 numTris = (boundsZ.zzww >> uvec4(0u, 16u, 0u, 16u)) & 0xFFFFu;
+
+	vec4 tNear = max(max(max(min(tx0, tx1), min(ty0, ty1)), min(tz0, tz1)), vec4(0.0));
+	vec4 tFar = min(min(min(max(tx0, tx1), max(ty0, ty1)), max(tz0, tz1)), vec4(maxDist));
+
+	for (int i = 0; i < 4; i++)
+	{
+		entry[i] = numTris[i] > 0u ? ~(node * 4 + i) : int(child[i]);
+		if (!(child[i] != 0xFFFFFFFFu && tNear[i] <= tFar[i]))
+			tNear[i] = INFINITY;
+	}
+	return tNear;
+}
+
+//-----------------------------------------------------------------------
+vec4 IntersectChildren(int node, vec3 invDir, vec3 oInvDir, float maxDist, out ivec4 entry)
+//-----------------------------------------------------------------------
+{
+	if (bvhCompressed)
+		return IntersectCompressedNode(node, invDir, oInvDir, maxDist, entry);
+	return IntersectWideNode(node, invDir, oInvDir, maxDist, entry);
+}
+
+//-----------------------------------------------------------------------
+ivec2 WideLeafRange(int leafEntry)
+//-----------------------------------------------------------------------
+{
+	// First triangle and triangle count of a leaf stack entry
+	int node = ~leafEntry >> 2;
+	int slot = ~leafEntry & 3;
+	if (bvhCompressed)
+	{
+		uint counts = uvec4(texelFetch(BVH, node * 4 + 2))[2 + (slot >> 1)];
+		return ivec2(uvec4(texelFetch(BVH, node * 4 + 3))[slot], (counts >> (16u * uint(slot & 1))) & 0xFFFFu);
+	}
+	return ivec2(texelFetch(BVH, node * 8 + 6)[slot], texelFetch(BVH, node * 8 + 7)[slot]);
+}
+
+//-----------------------------------------------------------------------
+void CompareSwap(inout float da, inout float db, inout int ea, inout int eb)
+//-----------------------------------------------------------------------
+{
+	if (da < db)
+	{
+		float d = da; da = db; db = d;
+		int e = ea; ea = eb; eb = e;
+	}
+}
+
+//-----------------------------------------------------------------------
+void SortFarToNear(inout vec4 dist, inout ivec4 entry)
+//-----------------------------------------------------------------------
+{
+	// 4 element sorting network, pushing in this order pops the nearest child first
+	CompareSwap(dist.x, dist.y, entry.x, entry.y);
+	CompareSwap(dist.z, dist.w, entry.z, entry.w);
+	CompareSwap(dist.x, dist.z, entry.x, entry.z);
+	CompareSwap(dist.y, dist.w, entry.y, entry.w);
+	CompareSwap(dist.y, dist.z, entry.y, entry.z);
+}
+
+//-----------------------------------------------------------------------
+bool TraverseWide(Ray r, bool anyHit, bool nearestFirst, inout Hit hit)
+//-----------------------------------------------------------------------
+{
+	vec3 invDir = SafeInverse(r.direction);
+	vec3 oInvDir = r.origin * invDir;
+	bool found = false;
+
+	int stack[64];
+	int ptr = 0;
+	stack[ptr++] = 0;
+
+	while (ptr > 0)
+	{
+		int entry = stack[--ptr];
+		if (entry >= 0)
+		{
+			ivec4 children;
+			vec4 dist = IntersectChildren(entry, invDir, oInvDir, hit.t, children);
+			if (nearestFirst)
+				SortFarToNear(dist, children);
+			for (int i = 0; i < 4; i++)
+			{
+				if (dist[i] < INFINITY)
+					stack[ptr++] = children[i];
+			}
+			continue;
+		}
+
+		ivec2 leaf = WideLeafRange(entry);
+		for (int i = 0; i < leaf.y; i++)
+		{
+			vec3 tuv = IntersectLeafTriangle(r, leaf.x + i, hit.t);
+			if (tuv.x < hit.t)
+			{
+				hit.t = tuv.x;
+				hit.uv = tuv.yz;
+				hit.triID = leaf.x + i;
+				found = true;
+				if (anyHit)
+					return true;
+			}
+		}
+	}
+
+	return found;
+}
+
+//-----------------------------------------------------------------------
+bool TraverseBinary(Ray r, bool anyHit, bool nearestFirst, inout Hit hit)
+//-----------------------------------------------------------------------
+{
+	// Two-level hierarchies switch r to object space inside instances
+	Ray worldRay = r;
+	vec3 worldInvDir = SafeInverse(r.direction);
+	vec3 invDir = worldInvDir;
+	vec3 oInvDir = r.origin * invDir;
+	int instanceID = -1;
+	bool found = false;
+
+	int stack[64];
+	int ptr = 0;
+	stack[ptr++] = -1;
+
+	int idx = 0;
+	while (idx > -1)
+	{
+		ivec3 LRLeaf = texelFetch(BVH, idx * 3 + 2).xyz;
+
+		int leftIndex = LRLeaf.x;
+		int rightIndex = LRLeaf.y;
+		int isLeaf = LRLeaf.z;
+
+		if (isLeaf == 2)
+		{
+			// Instance: continue in its mesh BVH with the ray in object space, -2 on the stack marks the way back
+			instanceID = leftIndex;
+			vec4 r0 = texelFetch(instancesTex, instanceID * 4 + 0);
+			vec4 r1 = texelFetch(instancesTex, instanceID * 4 + 1);
+			vec4 r2 = texelFetch(instancesTex, instanceID * 4 + 2);
+			r.origin = vec3(dot(r0.xyz, worldRay.origin) + r0.w, dot(r1.xyz, worldRay.origin) + r1.w, dot(r2.xyz, worldRay.origin) + r2.w);
+			r.direction = vec3(dot(r0.xyz, worldRay.direction), dot(r1.xyz, worldRay.direction), dot(r2.xyz, worldRay.direction));
+			invDir = SafeInverse(r.direction);
+			oInvDir = r.origin * invDir;
+			stack[ptr++] = -2;
+			idx = floatBitsToInt(texelFetch(instancesTex, instanceID * 4 + 3).x);
+			continue;
+		}
+
+		if (isLeaf == 1)
+		{
+			for (int i = 0; i < rightIndex; i++)
+			{
+				vec3 tuv = IntersectLeafTriangle(r, leftIndex + i, hit.t);
+				if (tuv.x < hit.t)
+				{
+					hit.t = tuv.x;
+					hit.uv = tuv.yz;
+					hit.triID = leftIndex + i;
+					hit.instanceID = instanceID;
+					found = true;
+					if (anyHit)
+						return true;
+				}
+			}
+		}
+		else
+		{
+			// Clipping to the closest hit so far culls boxes behind it, the entry distances order the children.
+			// Any hit ends a shadow ray, so those are better off skipping the ordering
+			float leftHit = IntersectRayAABB(intBitsToFloat(texelFetch(BVH, leftIndex * 3 + 0).xyz), intBitsToFloat(texelFetch(BVH, leftIndex * 3 + 1).xyz), invDir, oInvDir, hit.t);
+			float rightHit = IntersectRayAABB(intBitsToFloat(texelFetch(BVH, rightIndex * 3 + 0).xyz), intBitsToFloat(texelFetch(BVH, rightIndex * 3 + 1).xyz), invDir, oInvDir, hit.t);
+
+			if (leftHit < INFINITY && rightHit < INFINITY)
+			{
+				bool rightFirst = nearestFirst && rightHit < leftHit;
+				idx = rightFirst ? rightIndex : leftIndex;
+				stack[ptr++] = rightFirst ? leftIndex : rightIndex;
+				continue;
+			}
+			else if (leftHit < INFINITY)
+			{
+				idx = leftIndex;
+				continue;
+			}
+			else if (rightHit < INFINITY)
+			{
+				idx = rightIndex;
+				continue;
+			}
+		}
+		idx = stack[--ptr];
+		if (idx == -2)
+		{
+			// Leaving an instance, back to the world space ray
+			r = worldRay;
+			invDir = worldInvDir;
+			oInvDir = r.origin * invDir;
+			instanceID = -1;
+			idx = stack[--ptr];
+		}
+	}
+
+	return found;
+}
+
+//-----------------------------------------------------------------------
+bool SceneTraverse(Ray r, bool anyHit, bool nearestFirst, inout Hit hit)
+//-----------------------------------------------------------------------
+{
+	// Finds the closest triangle hit before hit.t, or with anyHit the first one found.
+	// nearestFirst orders the children by entry distance. Returns whether hit was updated
+	if (bvhWidth == 4)
+		return TraverseWide(r, anyHit, nearestFirst, hit);
+	return TraverseBinary(r, anyHit, nearestFirst, hit);
+}
+
+//-----------------------------------------------------------------------
+bool SceneIntersectShadow(Ray r, float maxDist)
+//-----------------------------------------------------------------------
+{
+	// Shadow rays skip the child ordering and stop at the first occluder.
+	// Mode 0 treats every light as visible, a baseline for timing the shadow rays
+	if (shadowRays == 0)
+		return false;
+
+	Hit hit = Hit(maxDist, vec2(0.0), -1, -1);
+	return SceneTraverse(r, true, shadowRays == 1, hit);
+}
@@ -66,6 +66,7 @@ public:
 	void            resize(int size);
 	void            setCapacity(int capacity)                  { int c = max1i(capacity, m_size); if (m_alloc != c) realloc(c); }
 	void            compact(void)                          { setCapacity(0); }
+	void            swap(Array<T>& other);     // exchanges the contents without copying
 
 	void            set(const T* ptr, int size)        { reset(size); if (ptr) copy(getPtr(), ptr, size); }
 	void            set(const Array<T>& other)         { if (&other != this) set(other.getPtr(), other.getSize()); }
@@ -140,6 +141,21 @@ template <class T> void Array<T>::resize(int size)
 
 //------------------------------------------------------------------------
 
+template <class T> void Array<T>::swap(Array<T>& other)
+{
+	T* ptr = m_ptr;
+	S32 size = m_size;
+	S32 alloc = m_alloc;
+	m_ptr = other.m_ptr;
+	m_size = other.m_size;
+	m_alloc = other.m_alloc;
+	other.m_ptr = ptr;
+	other.m_size = size;
+	other.m_alloc = alloc;
+}
+
+//------------------------------------------------------------------------
+
 template <class T> T Array<T>::removeSwap(int idx)
 {
 	FW_ASSERT(idx >= 0 && idx < m_size);
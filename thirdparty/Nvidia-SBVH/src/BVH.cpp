@@ -28,7 +28,10 @@
 #include <cstdio>
 
 #include "BVH.h"
+#include "LBVHBuilder.h"
 #include "SplitBVHBuilder.h"
+#include "TreeletOptimizer.h"
+#include "Timer.h"
 
 
 BVH::BVH(GPUScene* scene, const Platform& platform, const BuildParams& params)
@@ -40,25 +43,316 @@ BVH::BVH(GPUScene* scene, const Platform& platform, const BuildParams& params)
 	if (params.enablePrints)
 		printf("BVH builder: %d tris, %d vertices\n", scene->getNumTriangles(), scene->getNumVertices());
 
-	// SplitBVHBuilder() builds the actual BVH
-	m_root = SplitBVHBuilder(*this, params).run(m_numNodes);
+	// Treelet optimization restructures the node tree, flat builds that use it are flattened afterwards
+	BuildParams builderParams = params;
+	builderParams.flatOutput = params.flatOutput && params.treeletPasses <= 0;
+
+	// SplitBVHBuilder() builds the actual BVH, LBVHBuilder() a quick one
+	FW::Timer timer(true);
+	if (params.builder == Builder_Fast)
+		m_root = LBVHBuilder(*this, builderParams).run(m_numNodes);
+	else
+		m_root = SplitBVHBuilder(*this, builderParams).run(m_numNodes);
+	if (builderParams.flatOutput)
+		reverseFlatNodes();
+	F32 buildTime = timer.getElapsed();
 
 	if (params.enablePrints)
-		printf("BVH: Scene bounds: (%.1f,%.1f,%.1f) - (%.1f,%.1f,%.1f)\n", m_root->m_bounds.min().x, m_root->m_bounds.min().y, m_root->m_bounds.min().z,
-		m_root->m_bounds.max().x, m_root->m_bounds.max().y, m_root->m_bounds.max().z);
+		printf("BVH: build time %.3fs\n", buildTime);
+
+	float initialSah = computeSAHCost();
+
+	if (params.treeletPasses > 0)
+	{
+		timer.start();
+		TreeletOptimizer(*this, params).run(m_root, params.treeletPasses);
+		if (params.flatOutput)
+			flatten();
+		F32 optimizeTime = timer.getElapsed();
+		buildTime += optimizeTime;
+
+		if (params.enablePrints)
+			printf("BVH: treelet optimization %.3fs, sah %.2f before\n", optimizeTime, initialSah);
+	}
 
-	float sah = 0.f;
-	m_root->computeSubtreeProbabilities(m_platform, 1.f, sah);
+	const AABB& bounds = getBounds();
+	if (params.enablePrints)
+		printf("BVH: Scene bounds: (%.1f,%.1f,%.1f) - (%.1f,%.1f,%.1f)\n", bounds.min().x, bounds.min().y, bounds.min().z,
+		bounds.max().x, bounds.max().y, bounds.max().z);
+
+	float sah = computeSAHCost();
 	if (params.enablePrints)
 		printf("top-down sah: %.2f\n", sah);
+	m_buildSAHCost = sah;
 
 	if (params.stats)
 	{
+		params.stats->buildTime = buildTime;
 		params.stats->SAHCost = sah;
+		params.stats->initialSAHCost = initialSah;
 		params.stats->branchingFactor = 2;
-		params.stats->numLeafNodes = m_root->getSubtreeSize(BVH_STAT_LEAF_COUNT);
-		params.stats->numInnerNodes = m_root->getSubtreeSize(BVH_STAT_INNER_COUNT);
-		params.stats->numTris = m_root->getSubtreeSize(BVH_STAT_TRIANGLE_COUNT);
-		params.stats->numChildNodes = m_root->getSubtreeSize(BVH_STAT_CHILDNODE_COUNT);
+		if (isFlat())
+		{
+			params.stats->numLeafNodes = params.stats->numInnerNodes = params.stats->numTris = 0;
+			for (int i = 0; i < m_flatNodes.getSize(); i++)
+			{
+				const FlatNode& node = m_flatNodes[i];
+				if (node.isLeaf)
+				{
+					params.stats->numLeafNodes++;
+					params.stats->numTris += node.right - node.left;
+				}
+				else
+					params.stats->numInnerNodes++;
+			}
+			params.stats->numChildNodes = 2 * params.stats->numInnerNodes;
+			params.stats->nodeBytes = (F32)m_flatNodes.getNumBytes();
+			params.stats->numNodeChunks = 1;
+		}
+		else
+		{
+			params.stats->numLeafNodes = m_root->getSubtreeSize(BVH_STAT_LEAF_COUNT);
+			params.stats->numInnerNodes = m_root->getSubtreeSize(BVH_STAT_INNER_COUNT);
+			params.stats->numTris = m_root->getSubtreeSize(BVH_STAT_TRIANGLE_COUNT);
+			params.stats->numChildNodes = m_root->getSubtreeSize(BVH_STAT_CHILDNODE_COUNT);
+			params.stats->nodeBytes = (F32)m_nodes.getNumBytes();
+			params.stats->numNodeChunks = m_nodes.getNumChunks();
+		}
+	}
+}
+
+BVH::BVH(GPUScene* scene, const Platform& platform, NodeArena& nodes, BVHNode* root, int numNodes, const Array<S32>& triIndices)
+{
+	FW_ASSERT(scene && root);
+	m_scene = scene;
+	m_platform = platform;
+	m_nodes.take(nodes);
+	m_root = root;
+	m_numNodes = numNodes;
+	m_triIndices = triIndices;
+
+	m_buildSAHCost = m_root->computeSubtreeSAHCost(m_platform);
+}
+
+F32 BVH::refit(void)
+{
+	// Same topology and triangle order, only the boxes move. Spatial split leaves lose their
+	// clipping, so a refitted SBVH is always a little looser than a rebuilt one.
+
+	if (isFlat())
+		refitFlat();
+	else
+		refitNode(m_root);
+
+	float sah = computeSAHCost();
+	return sah;
+}
+
+void BVH::refitNode(BVHNode* node)
+{
+	AABB bounds;
+	if (node->isLeaf())
+	{
+		const LeafNode* leaf = (const LeafNode*)node;
+		for (int i = leaf->m_lo; i < leaf->m_hi; i++)
+		{
+			const Vec3i& tri = m_scene->getTriangle(m_triIndices[i]).vertices;
+			for (int j = 0; j < 3; j++)
+				bounds.grow(m_scene->getVertex(tri._v[j]));
+		}
+	}
+	else
+	{
+		for (int i = 0; i < node->getNumChildNodes(); i++)
+		{
+			BVHNode* child = node->getChildNode(i);
+			refitNode(child);
+			if (child->m_bounds.valid())
+				bounds.grow(child->m_bounds);
+		}
+	}
+	node->m_bounds = bounds;
+}
+
+void BVH::refitFlat(void)
+{
+	// Children always come after their parent, walking the array backwards is bottom-up
+
+	for (int i = m_flatNodes.getSize() - 1; i >= 0; i--)
+	{
+		FlatNode& node = m_flatNodes[i];
+		AABB bounds;
+		if (node.isLeaf)
+		{
+			for (int j = node.left; j < node.right; j++)
+			{
+				const Vec3i& tri = m_scene->getTriangle(m_triIndices[j]).vertices;
+				for (int k = 0; k < 3; k++)
+					bounds.grow(m_scene->getVertex(tri._v[k]));
+			}
+		}
+		else
+		{
+			const AABB& left = m_flatNodes[node.left].bounds;
+			const AABB& right = m_flatNodes[node.right].bounds;
+			if (left.valid())
+				bounds.grow(left);
+			if (right.valid())
+				bounds.grow(right);
+		}
+		node.bounds = bounds;
+	}
+}
+
+void BVH::padLeaves(const Array<Vec3f>& vertexPadding)
+{
+	// For vertices stored with less precision than the build saw. Unlike refit() the leaves
+	// keep their spatial split clipping, the inner boxes are regrown from their children.
+
+	if (!isFlat())
+	{
+		padNode(m_root, vertexPadding);
+		return;
+	}
+
+	for (int i = m_flatNodes.getSize() - 1; i >= 0; i--)
+	{
+		FlatNode& node = m_flatNodes[i];
+		if (node.isLeaf)
+		{
+			Vec3f pad = getLeafPadding(node.left, node.right, vertexPadding);
+			if (node.bounds.valid())
+				node.bounds = AABB(node.bounds.min() - pad, node.bounds.max() + pad);
+			continue;
+		}
+
+		AABB bounds;
+		const AABB& left = m_flatNodes[node.left].bounds;
+		const AABB& right = m_flatNodes[node.right].bounds;
+		if (left.valid())
+			bounds.grow(left);
+		if (right.valid())
+			bounds.grow(right);
+		node.bounds = bounds;
+	}
+}
+
+void BVH::padNode(BVHNode* node, const Array<Vec3f>& vertexPadding)
+{
+	if (node->isLeaf())
+	{
+		const LeafNode* leaf = (const LeafNode*)node;
+		Vec3f pad = getLeafPadding(leaf->m_lo, leaf->m_hi, vertexPadding);
+		if (node->m_bounds.valid())
+			node->m_bounds = AABB(node->m_bounds.min() - pad, node->m_bounds.max() + pad);
+		return;
+	}
+
+	AABB bounds;
+	for (int i = 0; i < node->getNumChildNodes(); i++)
+	{
+		BVHNode* child = node->getChildNode(i);
+		padNode(child, vertexPadding);
+		if (child->m_bounds.valid())
+			bounds.grow(child->m_bounds);
+	}
+	node->m_bounds = bounds;
+}
+
+Vec3f BVH::getLeafPadding(int lo, int hi, const Array<Vec3f>& vertexPadding) const
+{
+	Vec3f pad(0.0f);
+	for (int i = lo; i < hi; i++)
+	{
+		const Vec3i& tri = m_scene->getTriangle(m_triIndices[i]).vertices;
+		for (int j = 0; j < 3; j++)
+			pad = max3f(pad, vertexPadding[tri._v[j]]);
+	}
+	return pad;
+}
+
+F32 BVH::computeSAHCost(void) const
+{
+	if (!isFlat())
+		return m_root->computeSubtreeSAHCost(m_platform);
+
+	F32 sah = 0.0f;
+	accumulateFlatSAHCost(0, 1.0f, sah);
+	return sah;
+}
+
+void BVH::accumulateFlatSAHCost(int index, F32 probability, F32& sah) const
+{
+	// Same order of summation as BVHNode::computeSubtreeSAHCost(), so both give the same cost
+
+	const FlatNode& node = m_flatNodes[index];
+	if (node.isLeaf)
+	{
+		sah += probability * m_platform.getCost(0, node.right - node.left);
+		return;
 	}
+
+	sah += probability * m_platform.getCost(2, 0);
+	const AABB& left = m_flatNodes[node.left].bounds;
+	const AABB& right = m_flatNodes[node.right].bounds;
+	accumulateFlatSAHCost(node.left, probability * left.area() / node.bounds.area(), sah);
+	accumulateFlatSAHCost(node.right, probability * right.area() / node.bounds.area(), sah);
+}
+
+void BVH::reverseFlatNodes(void)
+{
+	// The builders append a node after its subtrees, the root ends up last. Reversed, every
+	// parent comes before its children and the root is node 0.
+
+	int last = m_flatNodes.getSize() - 1;
+	for (int i = 0; i < last - i; i++)
+	{
+		FlatNode node = m_flatNodes[i];
+		m_flatNodes[i] = m_flatNodes[last - i];
+		m_flatNodes[last - i] = node;
+	}
+
+	for (int i = 0; i <= last; i++)
+	{
+		FlatNode& node = m_flatNodes[i];
+		if (!node.isLeaf)
+		{
+			node.left = last - node.left;
+			node.right = last - node.right;
+		}
+	}
+}
+
+void BVH::flatten(void)
+{
+	m_flatNodes.reset();
+	m_flatNodes.setCapacity(m_numNodes);
+	flattenNode(m_root);
+
+	// Releases the tree
+	NodeArena tree;
+	tree.take(m_nodes);
+	m_root = NULL;
+}
+
+int BVH::flattenNode(const BVHNode* node)
+{
+	int index = m_flatNodes.getSize();
+	FlatNode& flat = m_flatNodes.add();
+	flat.bounds = node->m_bounds;
+	flat.isLeaf = node->isLeaf();
+
+	if (node->isLeaf())
+	{
+		const LeafNode* leaf = (const LeafNode*)node;
+		flat.left = leaf->m_lo;
+		flat.right = leaf->m_hi;
+		return index;
+	}
+
+	int left = flattenNode(node->getChildNode(0));
+	int right = flattenNode(node->getChildNode(1));
+	m_flatNodes[index].left = left;
+	m_flatNodes[index].right = right;
+	return index;
 }
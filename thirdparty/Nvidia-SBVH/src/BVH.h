@@ -54,51 +54,106 @@ public:
 	{
 		Stats()             { clear(); }
 		void clear()        { memset(this, 0, sizeof(Stats)); }
-		void print() const  {} //printf("Tree stats: [bfactor=%d] %d nodes (%d+%d), %.2f SAHCost, %.1f children/inner, %.1f tris/leaf\n", branchingFactor, numLeafNodes + numInnerNodes, numLeafNodes, numInnerNodes, SAHCost, 1.f*numChildNodes / max1i(numInnerNodes, 1), 1.f*numTris / max1i(numLeafNodes, 1)); }
+		void print() const  { printf("Tree stats: [bfactor=%d] %d nodes (%d+%d), %.2f SAHCost (%.2f before optimization), %.1f children/inner, %.1f tris/leaf, %.0f KB in %d chunks, %.3fs build\n", branchingFactor, numLeafNodes + numInnerNodes, numLeafNodes, numInnerNodes, SAHCost, initialSAHCost, 1.f*numChildNodes / max1i(numInnerNodes, 1), 1.f*numTris / max1i(numLeafNodes, 1), nodeBytes / 1024.f, numNodeChunks, buildTime); }
 
+		F32     buildTime;         // seconds spent in the builder, including optimization
 		F32     SAHCost;           // Surface Area Heuristic cost
+		F32     initialSAHCost;    // SAH cost straight out of the builder, before treelet optimization
 		S32     branchingFactor;
 		S32     numInnerNodes;
 		S32     numLeafNodes;
 		S32     numChildNodes;
 		S32     numTris;
+		F32     nodeBytes;         // node storage reserved by the arena, or the size of the flat node array
+		S32     numNodeChunks;
+	};
+
+	struct FlatNode   /// flat output: the whole tree in one array, every parent before its children, root first
+	{
+		AABB        bounds;
+		S32         left;       // inner: index of the left child, leaf: first entry in the triangle index list
+		S32         right;      // inner: index of the right child, leaf: one past the last entry
+		S32         isLeaf;
+	};
+
+	enum BuilderType
+	{
+		Builder_SBVH,               // SAH with spatial splits, slowest to build, best quality
+		Builder_SAH,                // SAH with object splits only
+		Builder_Fast,               // linear BVH over Morton codes
 	};
 
 	struct BuildParams
 	{
 		Stats*      stats;
 		bool        enablePrints;
+		S32         builder;        // see BuilderType
 		F32         splitAlpha;     // spatial split area threshold, see Nvidia paper on SBVH by Martin Stich, usually 0.05
+		S32         numThreads;     // builder threads, 0 = one per hardware thread, 1 = serial build
+		S32         objectSplitBins; // centroid bins for object splits, 0 = sort and sweep every candidate
+		S32         minBinnedRefs;  // smaller nodes always use the full sweep
+		bool        useRadixSort;   // sort references by radix sort on centroid keys instead of quicksort
+		S32         treeletPasses;  // treelet restructuring passes after the build, 0 = off
+		bool        flatOutput;     // builders write getFlatNodes() directly, no BVHNode tree is kept and getRoot() is NULL
 
 		BuildParams(void)
 		{
 			stats = NULL;
 			enablePrints = true;
+			builder = Builder_SBVH;
 			splitAlpha = 1.0e-5f;
+			numThreads = 0;
+			objectSplitBins = 0;
+			minBinnedRefs = 256;
+			useRadixSort = true;
+			treeletPasses = 0;
+			flatOutput = false;
 		}
 
 	};
 
 public:
 	BVH(GPUScene* scene, const Platform& platform, const BuildParams& params);
-	~BVH(void)                  { if (m_root) m_root->deleteSubtree(); } 
+	BVH(GPUScene* scene, const Platform& platform, NodeArena& nodes, BVHNode* root, int numNodes, const Array<S32>& triIndices); // takes over a finished tree and the arena holding it
 
 	GPUScene*           getScene(void) const           { return m_scene; }
 	const Platform&     getPlatform(void) const        { return m_platform; }
 	BVHNode*            getRoot(void) const            { return m_root; } 
+	NodeArena&          getNodeArena(void)             { return m_nodes; }
+	bool                isFlat(void) const             { return m_root == NULL; }
+	Array<FlatNode>&    getFlatNodes(void)             { return m_flatNodes; }
+	const Array<FlatNode>& getFlatNodes(void) const    { return m_flatNodes; }
+	const AABB&         getBounds(void) const          { return isFlat() ? m_flatNodes[0].bounds : m_root->m_bounds; }
 
 	Array<S32>&         getTriIndices(void)                  { return m_triIndices; }
 	const Array<S32>&   getTriIndices(void) const            { return m_triIndices; }
 	const int			getNumNodes(void) const { return m_numNodes; }
 
+	F32                 refit(void);                    // recomputes all bounds bottom-up from the current vertex positions, returns the new SAH cost
+	F32                 getBuildSAHCost(void) const     { return m_buildSAHCost; }
+	void                padLeaves(const Array<Vec3f>& vertexPadding); // grows every leaf by the largest padding of its vertices, then the inner boxes around them
+
 private:
+	void                refitNode(BVHNode* node);
+	void                refitFlat(void);
+	void                padNode(BVHNode* node, const Array<Vec3f>& vertexPadding);
+	Vec3f               getLeafPadding(int lo, int hi, const Array<Vec3f>& vertexPadding) const;
+	F32                 computeSAHCost(void) const;
+	void                accumulateFlatSAHCost(int index, F32 probability, F32& sah) const;
+	void                reverseFlatNodes(void);
+	void                flatten(void);
+	int                 flattenNode(const BVHNode* node);
+
 
 	GPUScene*              m_scene;
 	Platform            m_platform;
 
 	BVHNode*            m_root;
+	NodeArena           m_nodes;            // owns every node of the tree
+	Array<FlatNode>     m_flatNodes;        // flat output instead of the tree
 	Array<S32>        m_triIndices;
 	int					m_numNodes;
+	F32                 m_buildSAHCost;     // SAH cost of the tree as built, refits are measured against it
 };
 
 
@@ -27,6 +27,8 @@
 
 #include "BVHNode.h"
 #include "Array.h"
+#include <algorithm>
+#include <type_traits>
 
 
 int BVHNode::getSubtreeSize(BVH_STAT stat) const  // recursively counts some type of nodes (either leafnodes, innernodes, childnodes) or unmber of triangles
@@ -53,42 +55,27 @@ int BVHNode::getSubtreeSize(BVH_STAT stat) const  // recursively counts some typ
 	}
 
 
-	void BVHNode::deleteSubtree()
+	static void accumulateSAHCost(const BVHNode* node, const Platform& p, float probability, float& sah)
 	{
-		for (int i = 0; i<getNumChildNodes(); i++)
-			getChildNode(i)->deleteSubtree(); 
+		sah += probability * p.getCost(node->getNumChildNodes(), node->getNumTriangles());
 
-		delete this;
-	}
-
-
-	void BVHNode::computeSubtreeProbabilities(const Platform& p, float probability, float& sah)
-	{
-		sah += probability * p.getCost(this->getNumChildNodes(), this->getNumTriangles());
-
-		m_probability = probability;
-
-		// recursively compute probabilities and add to SAH
-		for (int i = 0; i<getNumChildNodes(); i++)
+		// probability of a child = childnode area / parentnode area times the parent's
+		for (int i = 0; i<node->getNumChildNodes(); i++)
 		{
-			BVHNode* child = getChildNode(i);
-			child->m_parentProbability = probability;           /// childnode area / parentnode area
-			child->computeSubtreeProbabilities(p, probability * child->m_bounds.area() / this->m_bounds.area(), sah);
+			const BVHNode* child = node->getChildNode(i);
+			accumulateSAHCost(child, p, probability * child->m_bounds.area() / node->m_bounds.area(), sah);
 		}
 	}
 
 
-	// TODO: requires valid probabilities...
 	float BVHNode::computeSubtreeSAHCost(const Platform& p) const
 	{
-		float SAH = m_probability * p.getCost(getNumChildNodes(), getNumTriangles());
-
-		for (int i = 0; i<getNumChildNodes(); i++)
-			SAH += getChildNode(i)->computeSubtreeSAHCost(p);
-
-		return SAH;
+		float sah = 0.f;
+		accumulateSAHCost(this, p, 1.f, sah);
+		return sah;
 	}
 
+
 	//-------------------------------------------------------------
 
 	void assignIndicesDepthFirstRecursive(BVHNode* node, S32& index, bool includeLeafNodes)
@@ -132,3 +119,61 @@ int BVHNode::getSubtreeSize(BVH_STAT stat) const  // recursively counts some typ
 		}
 	}
 
+//-------------------------------------------------------------
+
+static_assert(std::is_trivially_destructible<InnerNode>::value && std::is_trivially_destructible<LeafNode>::value, "NodeArena never runs node destructors");
+
+NodeArena::NodeArena(void)
+	: m_chunkPtr(NULL),
+	m_chunkEnd(NULL),
+	m_numBytes(0),
+	m_reserveBytes(0)
+{
+}
+
+NodeArena::~NodeArena(void)
+{
+	for (int i = 0; i < m_chunks.getSize(); i++)
+		delete[] m_chunks[i];
+}
+
+void NodeArena::reserve(size_t numNodes)
+{
+	m_reserveBytes = numNodes * sizeof(InnerNode);
+}
+
+void NodeArena::take(NodeArena& other)
+{
+	// Chunks stay where they are, so node pointers into other remain valid
+	m_chunks.add(other.m_chunks);
+	m_numBytes += other.m_numBytes;
+	other.m_chunks.reset();
+	other.m_chunkPtr = other.m_chunkEnd = NULL;
+	other.m_numBytes = 0;
+	other.m_cursor = Cursor();
+}
+
+void NodeArena::refill(Cursor& cursor, size_t size)
+{
+	std::lock_guard<std::mutex> guard(m_lock);
+
+	size_t blockBytes = std::max((size_t)BlockBytes, size);
+	if (m_chunkPtr + blockBytes > m_chunkEnd)
+		addChunk(blockBytes);
+
+	// Single threaded arenas hand out the whole chunk, the block size only bounds what other cursors can waste
+	cursor.ptr = m_chunkPtr;
+	cursor.end = (&cursor == &m_cursor) ? m_chunkEnd : m_chunkPtr + blockBytes;
+	m_chunkPtr = cursor.end;
+}
+
+void NodeArena::addChunk(size_t bytes)
+{
+	// The first chunk is the reservation, underestimates grow by half of what is there so far
+	size_t chunkBytes = std::max(bytes, m_chunks.getSize() ? m_numBytes / 2 : m_reserveBytes);
+	U8* chunk = new U8[chunkBytes];
+	m_chunks.add(chunk);
+	m_chunkPtr = chunk;
+	m_chunkEnd = chunk + chunkBytes;
+	m_numBytes += chunkBytes;
+}
@@ -28,6 +28,8 @@
 #pragma once
 #include "Array.h"
 #include "Util.h"
+#include <mutex>
+#include <new>
 
 enum BVH_STAT
 {
@@ -66,42 +68,35 @@ private:
 class BVHNode
 {
 public:
-	BVHNode() : m_probability(1.f), m_parentProbability(1.f), m_treelet(-1), m_index(-1) {} 
-	virtual bool        isLeaf() const = 0;               
-	virtual S32         getNumChildNodes() const = 0;
-	virtual BVHNode*    getChildNode(S32 i) const = 0;
-	virtual S32         getNumTriangles() const { return 0; }
+	bool        isLeaf() const                  { return m_isLeaf; }
+	S32         getNumChildNodes() const        { return m_isLeaf ? 0 : 2; }
+	BVHNode*    getChildNode(S32 i) const;
+	S32         getNumTriangles() const;
 
 	float       getArea() const     { return m_bounds.area(); }
 
 	AABB        m_bounds;
-
-	// These are somewhat experimental, for some specific test and may be invalid...
-	float       m_probability;          // probability of coming here (widebvh uses this)
-	float       m_parentProbability;    // probability of coming to parent (widebvh uses this)
-
-	int         m_treelet;              // for queuing tests (qmachine uses this)
-	int         m_index;                // in linearized tree (qmachine uses this)
+	int         m_index;                // in linearized tree (treelet optimizer uses this)
 
 	// Subtree functions
 	int     getSubtreeSize(BVH_STAT stat = BVH_STAT_NODE_COUNT) const;
-	void    computeSubtreeProbabilities(const Platform& p, float parentProbability, float& sah);
-	float   computeSubtreeSAHCost(const Platform& p) const;     // NOTE: assumes valid probabilities
-	void    deleteSubtree();
+	float   computeSubtreeSAHCost(const Platform& p) const;
 
 	void    assignIndicesDepthFirst(S32 index = 0, bool includeLeafNodes = true);
 	void    assignIndicesBreadthFirst(S32 index = 0, bool includeLeafNodes = true);
+
+protected:
+	// Not polymorphic: the flag replaces a vtable, and nodes live in a NodeArena instead of being deleted one by one
+	BVHNode(const AABB& bounds, bool isLeaf) : m_bounds(bounds), m_index(-1), m_isLeaf(isLeaf) {}
+
+	bool        m_isLeaf;
 };
 
 
 class InnerNode : public BVHNode
 {
 public:
-	InnerNode(const AABB& bounds, BVHNode* child0, BVHNode* child1)   { m_bounds = bounds; m_children[0] = child0; m_children[1] = child1; }
-
-	bool        isLeaf() const                  { return false; }
-	S32         getNumChildNodes() const        { return 2; }
-	BVHNode*    getChildNode(S32 i) const       { FW_ASSERT(i >= 0 && i<2); return m_children[i]; }
+	InnerNode(const AABB& bounds, BVHNode* child0, BVHNode* child1) : BVHNode(bounds, false) { m_children[0] = child0; m_children[1] = child1; }
 
 	BVHNode*    m_children[2];  
 };
@@ -110,15 +105,73 @@ public:
 class LeafNode : public BVHNode
 {
 public:
-	LeafNode(const AABB& bounds, int lo, int hi)  { m_bounds = bounds; m_lo = lo; m_hi = hi; } 
-	LeafNode(const LeafNode& s)                 { *this = s; }
-
-	bool        isLeaf() const                  { return true; }
-	S32         getNumChildNodes() const        { return 0; }  // leafnode has 0 children
-	BVHNode*    getChildNode(S32) const         { return NULL; }
+	LeafNode(const AABB& bounds, int lo, int hi) : BVHNode(bounds, true) { m_lo = lo; m_hi = hi; }
 
 	S32         getNumTriangles() const         { return m_hi - m_lo; }
 	S32         m_lo;  // lower index in triangle list
 	S32         m_hi;  // higher index in triangle list
 };
 
+inline BVHNode* BVHNode::getChildNode(S32 i) const  { FW_ASSERT(!m_isLeaf && i >= 0 && i < 2); return static_cast<const InnerNode*>(this)->m_children[i]; }
+inline S32 BVHNode::getNumTriangles() const         { return m_isLeaf ? static_cast<const LeafNode*>(this)->getNumTriangles() : 0; }
+
+
+// Storage for the nodes of one tree. Memory comes in large chunks, reserved up front from an estimate
+// of the node count, and is only released when the arena is destroyed, which frees a whole tree at once.
+// Concurrent builders give each task its own Cursor; cursors carve small blocks out of the shared chunks
+// under a lock, so node allocation itself never synchronizes.
+class NodeArena
+{
+public:
+	struct Cursor
+	{
+		U8*     ptr;
+		U8*     end;
+
+		Cursor(void) : ptr(NULL), end(NULL) {}
+	};
+
+	NodeArena(void);
+	~NodeArena(void);
+
+	void        reserve(size_t numNodes);       // next chunk holds at least this many inner nodes
+	void        take(NodeArena& other);         // moves the nodes of other into this arena, other ends up empty
+
+	InnerNode*  newInner(Cursor& cursor, const AABB& bounds, BVHNode* child0, BVHNode* child1)  { return new (alloc(cursor, sizeof(InnerNode))) InnerNode(bounds, child0, child1); }
+	LeafNode*   newLeaf(Cursor& cursor, const AABB& bounds, int lo, int hi)                    { return new (alloc(cursor, sizeof(LeafNode))) LeafNode(bounds, lo, hi); }
+	InnerNode*  newInner(const AABB& bounds, BVHNode* child0, BVHNode* child1)                 { return newInner(m_cursor, bounds, child0, child1); }
+	LeafNode*   newLeaf(const AABB& bounds, int lo, int hi)                                   { return newLeaf(m_cursor, bounds, lo, hi); }
+
+	S32         getNumChunks(void) const        { return m_chunks.getSize(); }
+	size_t      getNumBytes(void) const         { return m_numBytes; }
+
+private:
+	enum
+	{
+		BlockBytes = 16384,         // handed to a cursor at a time
+		Alignment = 8,
+	};
+
+	void*       alloc(Cursor& cursor, size_t size)
+	{
+		size = (size + Alignment - 1) & ~(size_t)(Alignment - 1);
+		if (cursor.ptr + size > cursor.end)
+			refill(cursor, size);
+		void* ptr = cursor.ptr;
+		cursor.ptr += size;
+		return ptr;
+	}
+	void        refill(Cursor& cursor, size_t size);
+	void        addChunk(size_t bytes);
+
+	NodeArena(const NodeArena&); // forbidden
+	NodeArena&  operator=(const NodeArena&); // forbidden
+
+	Array<U8*>  m_chunks;
+	U8*         m_chunkPtr;     // unclaimed part of the newest chunk
+	U8*         m_chunkEnd;
+	size_t      m_numBytes;
+	size_t      m_reserveBytes;
+	Cursor      m_cursor;       // for single threaded use
+	std::mutex  m_lock;
+};
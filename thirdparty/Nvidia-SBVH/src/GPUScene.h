@@ -53,6 +53,7 @@ public:
 	int             getNumVertices(void) const    { return m_numVerts; }
 	const Vec3f*    getVertexPtr(int idx = 0)     { FW_ASSERT(idx >= 0 && idx <= m_numVerts); return (const Vec3f*)m_verts.getPtr() + idx; }
 	const Vec3f&    getVertex(int idx)            { FW_ASSERT(idx < m_numVerts); return *getVertexPtr(idx); }
+	Vec3f*          getMutableVertexPtr(int idx = 0) { FW_ASSERT(idx >= 0 && idx <= m_numVerts); return m_verts.getPtr() + idx; } // for animation, BVH::refit() afterwards
 
 private:
 	GPUScene(const GPUScene&); // forbidden
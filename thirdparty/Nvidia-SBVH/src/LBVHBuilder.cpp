@@ -0,0 +1,365 @@
+#include "LBVHBuilder.h"
+#include "Sort.h"
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+//------------------------------------------------------------------------
+
+static inline int countLeadingZeros(U32 v)
+{
+	if (!v)
+		return 32;
+#ifdef _MSC_VER
+	unsigned long idx;
+	_BitScanReverse(&idx, v);
+	return 31 - (int)idx;
+#else
+	return __builtin_clz(v);
+#endif
+}
+
+//------------------------------------------------------------------------
+
+static inline U32 expandBits(U32 v) // inserts two zero bits after each of the lower 10 bits
+{
+	v = (v * 0x00010001u) & 0xFF0000FFu;
+	v = (v * 0x00000101u) & 0x0F00F00Fu;
+	v = (v * 0x00000011u) & 0xC30C30C3u;
+	v = (v * 0x00000005u) & 0x49249249u;
+	return v;
+}
+
+//------------------------------------------------------------------------
+
+LBVHBuilder::LBVHBuilder(BVH& bvh, const BVH::BuildParams& params)
+	: m_bvh(bvh),
+	m_platform(bvh.getPlatform()),
+	m_params(params),
+	m_pool(NULL),
+	m_maxLeafSize(min1i(bvh.getPlatform().getMaxLeafSize(), (int)MaxLeafSize)),
+	m_numTris(0)
+{
+	int numThreads = (params.numThreads > 0) ? params.numThreads : TaskPool::getHardwareThreads();
+	if (numThreads > 1)
+		m_pool = new TaskPool(numThreads);
+}
+
+//------------------------------------------------------------------------
+
+LBVHBuilder::~LBVHBuilder(void)
+{
+	delete m_pool;
+}
+
+//------------------------------------------------------------------------
+
+BVHNode* LBVHBuilder::run(int& numNodes)
+{
+	Output out;
+	m_numTris = m_bvh.getScene()->getNumTriangles();
+	if (m_numTris == 0)
+	{
+		Subtree empty;
+		empty.node = NULL;
+		empty.index = -1;
+		empty.first = 0;
+		empty.last = -1;
+		numNodes = 1;
+		BVHNode* root = createNode(out, empty);
+		m_bvh.getFlatNodes().swap(out.flatNodes);
+		return root;
+	}
+
+	// Sort the triangles along the Morton curve.
+
+	computeMortonCodes();
+
+	// Every inner node of the radix tree only depends on the sorted codes.
+
+	m_children.reset(2 * (m_numTris - 1));
+	m_ranges.reset(2 * (m_numTris - 1));
+	parallelFor(m_numTris - 1, [this](int begin, int end)
+	{
+		for (int i = begin; i < end; i++)
+			buildHierarchy(i);
+	});
+
+	// Create the nodes bottom-up, collapsing cheap subtrees into leaves.
+
+	if (m_params.flatOutput)
+		out.flatNodes.setCapacity(m_numTris * NodesPerTenTris / 10 + 1);
+	else
+		m_bvh.getNodeArena().reserve((size_t)m_numTris * NodesPerTenTris / 10 + 1);
+	Subtree root = emitSubtree(out, (m_numTris > 1) ? 0u : (U32)LeafFlag, 0, m_numTris - 1);
+	BVHNode* rootNode = createNode(out, root);
+	numNodes = root.numNodes;
+	m_bvh.getTriIndices().swap(m_order);
+	m_bvh.getFlatNodes().swap(out.flatNodes);
+
+	if (m_params.enablePrints)
+		printf("LBVHBuilder: %d triangles, %d nodes, threads %d\n", m_numTris, numNodes, m_pool ? m_pool->getNumThreads() : 1);
+
+	return rootNode;
+}
+
+//------------------------------------------------------------------------
+
+void LBVHBuilder::parallelFor(int num, const std::function<void(int, int)>& body)
+{
+	if (!m_pool || num < (int)MinParallelPrims)
+	{
+		body(0, num);
+		return;
+	}
+
+	int numChunks = m_pool->getNumThreads() * 4;
+	int chunkSize = (num + numChunks - 1) / numChunks;
+	TaskPool::Group group;
+	for (int begin = 0; begin < num; begin += chunkSize)
+	{
+		int end = min1i(begin + chunkSize, num);
+		m_pool->run(group, [&body, begin, end]() { body(begin, end); });
+	}
+	m_pool->wait(group);
+}
+
+//------------------------------------------------------------------------
+
+void LBVHBuilder::computeMortonCodes(void)
+{
+	const GPUScene::Triangle* tris = m_bvh.getScene()->getTrianglePtr();
+	const Vec3f* verts = m_bvh.getScene()->getVertexPtr();
+
+	m_triBounds.reset(m_numTris);
+	parallelFor(m_numTris, [&](int begin, int end)
+	{
+		for (int i = begin; i < end; i++)
+		{
+			AABB bounds;
+			for (int j = 0; j < 3; j++)
+				bounds.grow(verts[tris[i].vertices._v[j]]);
+			m_triBounds[i] = bounds;
+		}
+	});
+
+	AABB centroidBounds;
+	for (int i = 0; i < m_numTris; i++)
+		centroidBounds.grow(m_triBounds[i].min() + m_triBounds[i].max());
+
+	// Quantize the (doubled) centroids to 10 bits per axis and interleave.
+
+	const F32 gridSize = (F32)(1 << MortonBits);
+	Vec3f origin = centroidBounds.min();
+	Vec3f extent = centroidBounds.max() - origin;
+	Vec3f scale;
+	for (int dim = 0; dim < 3; dim++)
+		scale._v[dim] = (extent._v[dim] > 0.0f) ? gridSize / extent._v[dim] : 0.0f;
+
+	m_codes.reset(m_numTris);
+	m_order.reset(m_numTris);
+	parallelFor(m_numTris, [&](int begin, int end)
+	{
+		for (int i = begin; i < end; i++)
+		{
+			Vec3f centroid = m_triBounds[i].min() + m_triBounds[i].max();
+			U32 code = 0;
+			for (int dim = 0; dim < 3; dim++)
+			{
+				int cell = (int)((centroid._v[dim] - origin._v[dim]) * scale._v[dim]);
+				cell = (cell < 0) ? 0 : (cell >= (1 << MortonBits)) ? (1 << MortonBits) - 1 : cell;
+				code |= expandBits((U32)cell) << (2 - dim);
+			}
+			m_codes[i] = code;
+			m_order[i] = i;
+		}
+	});
+
+	Array<U32> tmpCodes;
+	Array<S32> tmpOrder;
+	tmpCodes.reset(m_numTris);
+	tmpOrder.reset(m_numTris);
+	RadixSort(m_numTris, m_codes.getPtr(), m_order.getPtr(), tmpCodes.getPtr(), tmpOrder.getPtr(), m_pool);
+}
+
+//------------------------------------------------------------------------
+
+int LBVHBuilder::commonPrefix(int i, int j) const
+{
+	// Length of the common prefix of two sorted keys; duplicates are made unique
+	// by appending their position.
+
+	if (j < 0 || j >= m_numTris)
+		return -1;
+	if (m_codes[i] == m_codes[j])
+		return 32 + countLeadingZeros((U32)(i ^ j));
+	return countLeadingZeros(m_codes[i] ^ m_codes[j]);
+}
+
+//------------------------------------------------------------------------
+
+void LBVHBuilder::buildHierarchy(int idx)
+{
+	// Direction of the range covered by this node.
+
+	int dir = (commonPrefix(idx, idx + 1) - commonPrefix(idx, idx - 1)) > 0 ? 1 : -1;
+	int minPrefix = commonPrefix(idx, idx - dir);
+
+	// Upper bound for the range length, then binary search for the other end.
+
+	int maxLen = 2;
+	while (commonPrefix(idx, idx + maxLen * dir) > minPrefix)
+		maxLen *= 2;
+
+	int len = 0;
+	for (int step = maxLen / 2; step >= 1; step /= 2)
+		if (commonPrefix(idx, idx + (len + step) * dir) > minPrefix)
+			len += step;
+
+	int other = idx + len * dir;
+	int first = min1i(idx, other);
+	int last = max1i(idx, other);
+	int split = findSplit(first, last);
+
+	m_children[2 * idx + 0] = (split == first) ? (LeafFlag | split) : split;
+	m_children[2 * idx + 1] = (split + 1 == last) ? (LeafFlag | (split + 1)) : (split + 1);
+	m_ranges[2 * idx + 0] = first;
+	m_ranges[2 * idx + 1] = last;
+}
+
+//------------------------------------------------------------------------
+
+int LBVHBuilder::findSplit(int first, int last) const
+{
+	// Highest position whose key still shares the range prefix with the first key.
+
+	int nodePrefix = commonPrefix(first, last);
+	int split = first;
+	int step = last - first;
+	do
+	{
+		step = (step + 1) >> 1;
+		int newSplit = split + step;
+		if (newSplit < last && commonPrefix(first, newSplit) > nodePrefix)
+			split = newSplit;
+	} while (step > 1);
+	return split;
+}
+
+//------------------------------------------------------------------------
+
+LBVHBuilder::Subtree LBVHBuilder::emitSubtree(Output& out, U32 child, int first, int last)
+{
+	// Leaves are only created once the parent has decided not to collapse them, and a
+	// collapse rolls the cursor back over the inner nodes its children already created,
+	// so no dead nodes are left behind in the arena.
+
+	Subtree result;
+	result.node = NULL;
+	result.index = -1;
+	result.first = first;
+	result.last = last;
+	if (child & LeafFlag)
+	{
+		result.bounds = m_triBounds[m_order[first]];
+		result.cost = result.bounds.area() * m_platform.getTriangleCost(1);
+		result.numNodes = 1;
+		return result;
+	}
+
+	// Large subtrees: left child on another thread, right child here. They are
+	// never collapsed, which keeps every collapsed subtree inside one cursor.
+
+	U32 leftChild = m_children[2 * child + 0];
+	U32 rightChild = m_children[2 * child + 1];
+	int leftLast = (leftChild & LeafFlag) ? (int)(leftChild & ~LeafFlag) : m_ranges[2 * leftChild + 1];
+
+	int start = out.flatNodes.getSize();
+	NodeArena::Cursor mark = out.nodes;
+	Subtree left, right;
+	if (m_pool && last - first + 1 >= (int)MinParallelNodes && last - first + 1 > m_platform.getMinLeafSize())
+	{
+		TaskPool::Group group;
+		Output leftOut;
+		m_pool->run(group, [&]() { left = emitSubtree(leftOut, leftChild, first, leftLast); });
+		right = emitSubtree(out, rightChild, leftLast + 1, last);
+		m_pool->wait(group);
+
+		// Flat output: move the left subtree behind the right one. Leaves hold sorted
+		// triangle positions, which are the same in every task.
+
+		int offset = out.flatNodes.getSize();
+		BVH::FlatNode* nodes = out.flatNodes.add(leftOut.flatNodes.getPtr(), leftOut.flatNodes.getSize());
+		for (int i = 0; i < leftOut.flatNodes.getSize(); i++)
+		{
+			if (!nodes[i].isLeaf)
+			{
+				nodes[i].left += offset;
+				nodes[i].right += offset;
+			}
+		}
+		if (left.index >= 0)
+			left.index += offset;
+	}
+	else
+	{
+		left = emitSubtree(out, leftChild, first, leftLast);
+		right = emitSubtree(out, rightChild, leftLast + 1, last);
+	}
+
+	result.bounds = left.bounds + right.bounds;
+	F32 area = result.bounds.area();
+	int numTris = last - first + 1;
+
+	result.cost = area * m_platform.getNodeCost(2) + left.cost + right.cost;
+	result.numNodes = left.numNodes + right.numNodes + 1;
+
+	// SAH collapse: a small subtree that is cheaper as one leaf becomes one.
+
+	if (numTris <= m_platform.getMinLeafSize() ||
+		(numTris <= m_maxLeafSize && area * m_platform.getTriangleCost(numTris) <= result.cost))
+	{
+		result.cost = area * m_platform.getTriangleCost(numTris);
+		result.numNodes = 1;
+		out.flatNodes.resize(start);    // flat output: the subtree's nodes are the last ones written
+		out.nodes = mark;               // tree output: same for the arena cursor
+		return result;
+	}
+
+	BVHNode* leftNode = createNode(out, left);
+	BVHNode* rightNode = createNode(out, right);
+	if (!m_params.flatOutput)
+	{
+		result.node = m_bvh.getNodeArena().newInner(out.nodes, result.bounds, leftNode, rightNode);
+		return result;
+	}
+
+	BVH::FlatNode& node = out.flatNodes.add();
+	node.bounds = result.bounds;
+	node.left = left.index;
+	node.right = right.index;
+	node.isLeaf = 0;
+	result.index = out.flatNodes.getSize() - 1;
+	return result;
+}
+
+//------------------------------------------------------------------------
+
+BVHNode* LBVHBuilder::createNode(Output& out, Subtree& subtree)
+{
+	if (subtree.node || subtree.index >= 0)
+		return subtree.node;
+	if (!m_params.flatOutput)
+		return m_bvh.getNodeArena().newLeaf(out.nodes, subtree.bounds, subtree.first, subtree.last + 1);
+
+	BVH::FlatNode& node = out.flatNodes.add();
+	node.bounds = subtree.bounds;
+	node.left = subtree.first;
+	node.right = subtree.last + 1;
+	node.isLeaf = 1;
+	subtree.index = out.flatNodes.getSize() - 1;
+	return NULL;
+}
+
+//------------------------------------------------------------------------
@@ -0,0 +1,73 @@
+#pragma once
+#include "BVH.h"
+#include "TaskPool.h"
+
+// Fast linear BVH builder (Karras 2012, "Maximizing Parallelism in the Construction of BVHs, Octrees, and k-d Trees").
+// Triangles are sorted by the 30-bit Morton code of their centroid, the binary radix tree over the sorted
+// codes is emitted with every inner node computed independently, and subtrees that are cheaper as a single
+// leaf (by SAH) are collapsed on the way back up. Produces the same BVHNode/LeafNode tree or flat node array
+// as SplitBVHBuilder.
+
+class LBVHBuilder
+{
+private:
+	enum
+	{
+		MortonBits = 10,                // per axis
+		MaxLeafSize = 8,                // largest leaf the SAH collapse may create
+		MinParallelNodes = 2048,        // smallest subtree that is handed to another thread
+		MinParallelPrims = 16384,       // smallest triangle count worth splitting the linear passes
+		LeafFlag = 0x80000000,          // child index refers to a sorted triangle, not an inner node
+		NodesPerTenTris = 7,            // node count estimate for the arena, collapsing leaves about three triangles per leaf
+	};
+
+	struct Subtree
+	{
+		BVHNode*            node;       // NULL for a leaf over [first, last] that is not created yet
+		S32                 index;      // flat output: position in Output::flatNodes, -1 while not created
+		AABB                bounds;
+		F32                 cost;       // SAH cost, not normalized by the root area
+		S32                 numNodes;
+		S32                 first;
+		S32                 last;
+	};
+
+	struct Output   /// where one task puts the nodes it creates
+	{
+		NodeArena::Cursor       nodes;
+		Array<BVH::FlatNode>    flatNodes;  // flat output: every node after its subtrees
+	};
+
+public:
+	LBVHBuilder(BVH& bvh, const BVH::BuildParams& params);
+	~LBVHBuilder(void);
+
+	BVHNode*                run(int& numNodes);
+
+private:
+	void                    parallelFor(int num, const std::function<void(int, int)>& body);
+	void                    computeMortonCodes(void);
+	void                    buildHierarchy(int idx);
+	int                     findSplit(int first, int last) const;
+	int                     commonPrefix(int i, int j) const;
+	Subtree                 emitSubtree(Output& out, U32 child, int first, int last);
+	BVHNode*                createNode(Output& out, Subtree& subtree);
+
+private:
+	LBVHBuilder(const LBVHBuilder&); // forbidden
+	LBVHBuilder&            operator=(const LBVHBuilder&); // forbidden
+
+private:
+	BVH&                    m_bvh;
+	const Platform&         m_platform;
+	const BVH::BuildParams& m_params;
+	TaskPool*               m_pool;
+	S32                     m_maxLeafSize;
+
+	S32                     m_numTris;
+	Array<AABB>             m_triBounds;
+	Array<U32>              m_codes;        // sorted Morton codes
+	Array<S32>              m_order;        // triangle index per sorted position
+	Array<U32>              m_children;     // two entries per inner node
+	Array<S32>              m_ranges;       // first and last sorted triangle per inner node
+};
@@ -26,9 +26,15 @@
 */
 
 #include "Sort.h"
+#include "TaskPool.h"
+#include <string.h>
+#include <vector>
 
 #define FW_ASSERT(X) ((void)0)
 #define QSORT_STACK_SIZE    32
+#define RADIX_BITS          8
+#define RADIX_SIZE          (1 << RADIX_BITS)
+#define RADIX_MIN_PARALLEL  65536
 
 static inline void  InsertionSort(int start, int size, void* data, SortCompareFunc compareFunc, SortSwapFunc swapFunc);
 static inline int   Median3(int low, int high, void* data, SortCompareFunc compareFunc);
@@ -179,3 +185,125 @@ void SwapF32(void* data, int idxA, int idxB)
 }
 
 //------------------------------------------------------------------------
+
+unsigned int FloatToSortKey(float f)
+{
+	f += 0.0f; // -0 -> +0
+	unsigned int bits;
+	memcpy(&bits, &f, sizeof(bits));
+	return bits ^ ((bits & 0x80000000u) ? 0xFFFFFFFFu : 0x80000000u);
+}
+
+//------------------------------------------------------------------------
+
+void RadixSort(int num, unsigned int* keys, int* values, unsigned int* tmpKeys, int* tmpValues, TaskPool* pool)
+{
+	FW_ASSERT(num >= 0);
+	FW_ASSERT(keys && values && tmpKeys && tmpValues);
+
+	// Every chunk gets its own histogram; chunks are scattered in order, which keeps the sort stable.
+
+	int numChunks = 1;
+	if (pool && num >= RADIX_MIN_PARALLEL)
+		numChunks = pool->getNumThreads() * 4;
+	int chunkSize = (num + numChunks - 1) / numChunks;
+
+	// Serial sorts run once per node in the builders, keep their histogram off the heap.
+	int localOffsets[RADIX_SIZE];
+	std::vector<int> chunkOffsets;
+	int* offsets = localOffsets;
+	if (numChunks > 1)
+	{
+		chunkOffsets.resize(numChunks * RADIX_SIZE);
+		offsets = chunkOffsets.data();
+	}
+	unsigned int* srcKeys = keys;
+	int* srcValues = values;
+	unsigned int* dstKeys = tmpKeys;
+	int* dstValues = tmpValues;
+
+	for (int shift = 0; shift < 32; shift += RADIX_BITS)
+	{
+		// Histogram.
+
+		auto histogram = [&](int chunk)
+		{
+			int* hist = &offsets[chunk * RADIX_SIZE];
+			memset(hist, 0, RADIX_SIZE * sizeof(int));
+			int end = (chunk + 1) * chunkSize < num ? (chunk + 1) * chunkSize : num;
+			for (int i = chunk * chunkSize; i < end; i++)
+				hist[(srcKeys[i] >> shift) & (RADIX_SIZE - 1)]++;
+		};
+
+		if (numChunks > 1)
+		{
+			TaskPool::Group group;
+			for (int c = 0; c < numChunks; c++)
+				pool->run(group, [&, c]() { histogram(c); });
+			pool->wait(group);
+		}
+		else
+			histogram(0);
+
+		// Skip the pass if every key has the same digit.
+
+		bool trivial = false;
+		for (int d = 0; d < RADIX_SIZE && !trivial; d++)
+		{
+			int total = 0;
+			for (int c = 0; c < numChunks; c++)
+				total += offsets[c * RADIX_SIZE + d];
+			trivial = (total == num);
+		}
+		if (trivial)
+			continue;
+
+		// Exclusive prefix sum, digit-major so that lower chunks come first.
+
+		int sum = 0;
+		for (int d = 0; d < RADIX_SIZE; d++)
+		{
+			for (int c = 0; c < numChunks; c++)
+			{
+				int count = offsets[c * RADIX_SIZE + d];
+				offsets[c * RADIX_SIZE + d] = sum;
+				sum += count;
+			}
+		}
+
+		// Scatter.
+
+		auto scatter = [&](int chunk)
+		{
+			int* offs = &offsets[chunk * RADIX_SIZE];
+			int end = (chunk + 1) * chunkSize < num ? (chunk + 1) * chunkSize : num;
+			for (int i = chunk * chunkSize; i < end; i++)
+			{
+				int dst = offs[(srcKeys[i] >> shift) & (RADIX_SIZE - 1)]++;
+				dstKeys[dst] = srcKeys[i];
+				dstValues[dst] = srcValues[i];
+			}
+		};
+
+		if (numChunks > 1)
+		{
+			TaskPool::Group group;
+			for (int c = 0; c < numChunks; c++)
+				pool->run(group, [&, c]() { scatter(c); });
+			pool->wait(group);
+		}
+		else
+			scatter(0);
+
+		swap(srcKeys, dstKeys);
+		swap(srcValues, dstValues);
+	}
+
+	if (srcKeys != keys)
+	{
+		memcpy(keys, srcKeys, num * sizeof(unsigned int));
+		memcpy(values, srcValues, num * sizeof(int));
+	}
+}
+
+//------------------------------------------------------------------------
@@ -27,6 +27,8 @@
 
 #pragma once
 
+class TaskPool;
+
 //------------------------------------------------------------------------
 
 typedef int(*SortCompareFunc)  (void* data, int idxA, int idxB);
@@ -44,6 +46,18 @@ void SwapF32(void* data, int idxA, int idxB);
 
 //------------------------------------------------------------------------
 
+// Stable LSD radix sort of 32-bit keys carrying an int payload, one byte per pass.
+// The tmp arrays must hold num elements; the result ends up in keys/values.
+// Large arrays are histogrammed and scattered in chunks on the pool, if given.
+
+void RadixSort(int num, unsigned int* keys, int* values, unsigned int* tmpKeys, int* tmpValues, TaskPool* pool = 0);
+
+// Maps a float to an unsigned int with the same ordering (-0 and +0 map to the same key).
+
+unsigned int FloatToSortKey(float f);
+
+//------------------------------------------------------------------------
+
 /// swap() from Defs.hpp
 template <class T> inline void swap(T& a, T& b) { T t = a; a = b; b = t; }
 template <class A, class B> inline A lerp(const A& a, const A& b, const B& t) { return (A)(a * ((B)1 - t) + b * t); }
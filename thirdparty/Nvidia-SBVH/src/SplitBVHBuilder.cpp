@@ -37,20 +37,26 @@ SplitBVHBuilder::SplitBVHBuilder(BVH& bvh, const BVH::BuildParams& params)
 	m_platform(bvh.getPlatform()),
 	m_params(params),
 	m_minOverlap(0.0f),   /// overlap of AABBs
-	m_sortDim(-1),
-	m_numNodes(0)
+	m_numRootRefs(0),
+	m_numObjectBins(min1i(max1i(params.objectSplitBins, 0), (int)MaxObjectBins)),
+	m_minBinnedRefs(max1i(params.minBinnedRefs, m_numObjectBins)),
+	m_pool(NULL)
 {
+	int numThreads = (params.numThreads > 0) ? params.numThreads : TaskPool::getHardwareThreads();
+	if (numThreads > 1)
+		m_pool = new TaskPool(numThreads);
 }
 
 //------------------------------------------------------------------------
 
 SplitBVHBuilder::~SplitBVHBuilder(void)
 {
+	delete m_pool;
 }
 
 //------------------------------------------------------------------------
 
-BVHNode* SplitBVHBuilder::run(int &numNodes)  /// returns the rootnode
+BVHNode* SplitBVHBuilder::run(int &numNodes)  /// returns the rootnode, NULL for flat output
 {
 
 	// See SBVH paper by Martin Stich for details
@@ -60,40 +66,45 @@ BVHNode* SplitBVHBuilder::run(int &numNodes)  /// returns the rootnode
 	const GPUScene::Triangle* tris = m_bvh.getScene()->getTrianglePtr(); // list of all triangles in scene
 	const Vec3f* verts = m_bvh.getScene()->getVertexPtr();  // list of all vertices in scene
 
+	Context ctx;
 	NodeSpec rootSpec;
 	rootSpec.numRef = m_bvh.getScene()->getNumTriangles();  // number of triangles/references in entire scene (root)
-	m_refStack.resize(rootSpec.numRef);
+	reserveContext(ctx, rootSpec.numRef);
+	ctx.refStack.resize(rootSpec.numRef);
+	if (!m_params.flatOutput)
+		m_bvh.getNodeArena().reserve((size_t)rootSpec.numRef * NodesPerTenRefs / 10 + 1);
 	
 	// calculate the bounds of the rootnode by merging the AABBs of all the references
 	for (int i = 0; i < rootSpec.numRef; i++)
 	{
 		// assign triangle to the array of references
-		m_refStack[i].triIdx = i;  
+		ctx.refStack[i].triIdx = i;  
 		
 		// grow the bounds of each reference AABB in all 3 dimensions by including the vertex
 		for (int j = 0; j < 3; j++) 
-			m_refStack[i].bounds.grow(verts[tris[i].vertices._v[j]]);  
+			ctx.refStack[i].bounds.grow(verts[tris[i].vertices._v[j]]);  
 		
-		rootSpec.bounds.grow(m_refStack[i].bounds);
+		rootSpec.bounds.grow(ctx.refStack[i].bounds);
 	}
 
 	// Initialize rest of the members.
 
 	m_minOverlap = rootSpec.bounds.area() * m_params.splitAlpha;  /// split alpha (maximum allowable overlap) relative to size of rootnode
-	m_rightBounds.reset(max1i(rootSpec.numRef, (int)NumSpatialBins) - 1);
-	m_numDuplicates = 0;
+	m_numRootRefs = rootSpec.numRef;
+	ctx.rightBounds.reset(max1i(rootSpec.numRef, (int)NumSpatialBins) - 1);
 	m_progressTimer.start();
 
 	// Build recursively.
-	BVHNode* root = buildNode(rootSpec, 0, 0.0f, 1.0f);  /// actual building of splitBVH
-	numNodes = m_numNodes;
-	m_bvh.getTriIndices().compact();   // removes unused memoryspace from triIndices array
+	BVHNode* root = buildNode(ctx, rootSpec, 0, 0.0f, 1.0f);  /// actual building of splitBVH
+	numNodes = ctx.numNodes;
+	m_bvh.getTriIndices().swap(ctx.triIndices);   // leaves of the root context already index the final list
+	m_bvh.getFlatNodes().swap(ctx.flatNodes);
 
 	// Done.
 
 	if (m_params.enablePrints)
-		printf("SplitBVHBuilder: progress %.0f%%, duplicates %.0f%%\n",
-		100.0f, (F32)m_numDuplicates / (F32)m_bvh.getScene()->getNumTriangles() * 100.0f);
+		printf("SplitBVHBuilder: progress %.0f%%, duplicates %.0f%%, threads %d\n",
+		100.0f, (F32)ctx.numDuplicates / (F32)m_numRootRefs * 100.0f, m_pool ? m_pool->getNumThreads() : 1);
 
 	return root;
 }
@@ -102,44 +113,136 @@ BVHNode* SplitBVHBuilder::run(int &numNodes)  /// returns the rootnode
 
 int SplitBVHBuilder::sortCompare(void* data, int idxA, int idxB)
 {
-	const SplitBVHBuilder* ptr = (const SplitBVHBuilder*)data;
-	int dim = ptr->m_sortDim;
-	const Reference& ra = ptr->m_refStack[idxA];  // ra is a reference (struct containing a triIdx and bounds)
-	const Reference& rb = ptr->m_refStack[idxB];  // 
+	const SortData* ptr = (const SortData*)data;
+	int dim = ptr->dim;
+	const Reference& ra = ptr->refs[idxA];  // ra is a reference (struct containing a triIdx and bounds)
+	const Reference& rb = ptr->refs[idxB];  // 
 	F32 ca = ra.bounds.min()._v[dim] + ra.bounds.max()._v[dim];  
 	F32 cb = rb.bounds.min()._v[dim] + rb.bounds.max()._v[dim];
-	return (ca < cb) ? -1 : (ca > cb) ? 1 : (ra.triIdx < rb.triIdx) ? -1 : (ra.triIdx > rb.triIdx) ? 1 : 0;
+	if (ca != cb) return (ca < cb) ? -1 : 1;
+	if (ra.triIdx != rb.triIdx) return (ra.triIdx < rb.triIdx) ? -1 : 1;
+
+	// Split duplicates of the same triangle can share a centroid. Order them by their
+	// bounds so that the sort is a total order and every thread count gives the same tree.
+	for (int i = 0; i < 3; i++)
+	{
+		if (ra.bounds.min()._v[i] != rb.bounds.min()._v[i]) return (ra.bounds.min()._v[i] < rb.bounds.min()._v[i]) ? -1 : 1;
+		if (ra.bounds.max()._v[i] != rb.bounds.max()._v[i]) return (ra.bounds.max()._v[i] < rb.bounds.max()._v[i]) ? -1 : 1;
+	}
+	return 0;
 }
 
 //------------------------------------------------------------------------
 
 void SplitBVHBuilder::sortSwap(void* data, int idxA, int idxB)
 {
-	SplitBVHBuilder* ptr = (SplitBVHBuilder*)data;
-	swap(ptr->m_refStack[idxA], ptr->m_refStack[idxB]);
+	SortData* ptr = (SortData*)data;
+	swap(ptr->refs[idxA], ptr->refs[idxB]);
 }
 
 //------------------------------------------------------------------------
 
-inline float min1f3(const float& a, const float& b, const float& c){ return min1f(min1f(a, b), c); }
+void SplitBVHBuilder::reserveContext(Context& ctx, int numRef) const
+{
+	// Spatial splits push duplicates onto the stack, leave room for the usual amount so
+	// that the stack and the leaf list are not reallocated and copied while building.
+
+	int capacity = numRef;
+	if (m_params.builder == BVH::Builder_SBVH)
+		capacity += (int)((S64)numRef * DuplicatePercent / 100);
+	ctx.refStack.setCapacity(capacity);
+	ctx.triIndices.setCapacity(capacity);
+	if (m_params.flatOutput)
+		ctx.flatNodes.setCapacity((int)((S64)numRef * NodesPerTenRefs / 10 + 1));
+}
+
+//------------------------------------------------------------------------
 
-BVHNode* SplitBVHBuilder::buildNode(const NodeSpec& spec, int level, F32 progressStart, F32 progressEnd)
+void SplitBVHBuilder::sortReferences(SortScratch& scratch, Reference* refs, int start, int end, int dim)
 {
-	// Display progress.
+	SortData data;
+	data.refs = refs;
+	data.dim = dim;
+
+	int num = end - start;
+	if (!m_params.useRadixSort || num < MinRadixSortRefs)
+	{
+		Sort(start, end, &data, sortCompare, sortSwap);
+		return;
+	}
+
+	// Radix sort the centroid keys together with indices, so that every reference
+	// is moved exactly once instead of being swapped around by the comparison sort.
+
+	if (scratch.keys.getSize() < num)
+	{
+		scratch.keys.reset(num);
+		scratch.tmpKeys.reset(num);
+		scratch.order.reset(num);
+		scratch.tmpOrder.reset(num);
+		scratch.sorted.reset(num);
+	}
+	U32* keys = scratch.keys.getPtr();
+	S32* order = scratch.order.getPtr();
+
+	for (int i = 0; i < num; i++)
+	{
+		const AABB& bounds = refs[start + i].bounds;
+		keys[i] = FloatToSortKey(bounds.min()._v[dim] + bounds.max()._v[dim]);
+		order[i] = start + i;
+	}
+	RadixSort(num, keys, order, scratch.tmpKeys.getPtr(), scratch.tmpOrder.getPtr(), (num >= MinParallelSweepRefs) ? m_pool : NULL);
+
+	// Equal centroids come out in input order. Resolve them with sortCompare so
+	// the result is identical to the comparison sort; such runs are short.
 
-	if (m_params.enablePrints && m_progressTimer.getElapsed() >= 1.0f)
+	for (int runStart = 0, runEnd; runStart < num; runStart = runEnd)
 	{
-		printf("SplitBVHBuilder: progress %.0f%%, duplicates %.0f%%\r",
-			progressStart * 100.0f, (F32)m_numDuplicates / (F32)m_bvh.getScene()->getNumTriangles() * 100.0f);
-		m_progressTimer.start();
+		for (runEnd = runStart + 1; runEnd < num && keys[runEnd] == keys[runStart]; runEnd++);
+		for (int i = runStart + 1; i < runEnd; i++)
+			for (int j = i; j > runStart && sortCompare(&data, order[j - 1], order[j]) > 0; j--)
+				swap(order[j - 1], order[j]);
 	}
-	 m_numNodes++;
+
+	Reference* sorted = scratch.sorted.getPtr();
+	for (int i = 0; i < num; i++)
+		sorted[i] = refs[order[i]];
+	for (int i = 0; i < num; i++)
+		refs[start + i] = sorted[i];
+}
+
+//------------------------------------------------------------------------
+
+inline float min1f3(const float& a, const float& b, const float& c){ return min1f(min1f(a, b), c); }
+
+void SplitBVHBuilder::printProgress(const Context& ctx, F32 progress)
+{
+	// Any thread may report, but only one at a time and at most once per second.
+
+	std::unique_lock<std::mutex> guard(m_progressLock, std::try_to_lock);
+	if (!guard.owns_lock() || m_progressTimer.getElapsed() < 1.0f)
+		return;
+
+	printf("SplitBVHBuilder: progress %.0f%%, duplicates %.0f%%\r",
+		progress * 100.0f, (F32)ctx.numDuplicates / (F32)m_numRootRefs * 100.0f);
+	m_progressTimer.start();
+}
+
+//------------------------------------------------------------------------
+
+BVHNode* SplitBVHBuilder::buildNode(Context& ctx, const NodeSpec& spec, int level, F32 progressStart, F32 progressEnd)
+{
+	// Display progress.
+
+	if (m_params.enablePrints)
+		printProgress(ctx, progressStart);
+	ctx.numNodes++;
 
 	// Small enough or too deep => create leaf.
 
 	if (spec.numRef <= m_platform.getMinLeafSize() || level >= MaxDepth)
 	{
-		return createLeaf(spec);
+		return createLeaf(ctx, spec);
 	}
 
 	// Find split candidates.
@@ -147,92 +250,349 @@ BVHNode* SplitBVHBuilder::buildNode(const NodeSpec& spec, int level, F32 progres
 	F32 area = spec.bounds.area();
 	F32 leafSAH = area * m_platform.getTriangleCost(spec.numRef);	
 	F32 nodeSAH = area * m_platform.getNodeCost(2);
-	ObjectSplit object = findObjectSplit(spec, nodeSAH);
+	ObjectSplit object = findObjectSplit(ctx, spec, nodeSAH);
 
 	SpatialSplit spatial;
-	if (level < MaxSpatialDepth)
+	if (m_params.builder == BVH::Builder_SBVH && level < MaxSpatialDepth)
 	{
 		AABB overlap = object.leftBounds;
 		overlap.intersect(object.rightBounds);
 		if (overlap.area() >= m_minOverlap)
-			spatial = findSpatialSplit(spec, nodeSAH);
+			spatial = findSpatialSplit(ctx, spec, nodeSAH);
 	}
 
 	// Leaf SAH is the lowest => create leaf.
 
 	F32 minSAH = min1f3(leafSAH, object.sah, spatial.sah);
 	if (minSAH == leafSAH && spec.numRef <= m_platform.getMaxLeafSize()){
-		return createLeaf(spec);
+		return createLeaf(ctx, spec);
 	}
 
 	// Leaf SAH is not the lowest => Perform spatial split.
 
 	NodeSpec left, right;
 	if (minSAH == spatial.sah){
-		performSpatialSplit(left, right, spec, spatial);
+		performSpatialSplit(ctx, left, right, spec, spatial);
 	}
 
 	if (!left.numRef || !right.numRef){ /// if either child contains no triangles/references
-		performObjectSplit(left, right, spec, object);
+		performObjectSplit(ctx, left, right, spec, object);
 	}
 
 	// Create inner node.
 
-	m_numDuplicates += left.numRef + right.numRef - spec.numRef;
+	ctx.numDuplicates += left.numRef + right.numRef - spec.numRef;
+	return buildChildren(ctx, spec, left, right, level, progressStart, progressEnd);
+}
+
+//------------------------------------------------------------------------
+
+BVHNode* SplitBVHBuilder::buildChildren(Context& ctx, const NodeSpec& spec, const NodeSpec& left, const NodeSpec& right, int level, F32 progressStart, F32 progressEnd)
+{
 	F32 progressMid = lerp(progressStart, progressEnd, (F32)right.numRef / (F32)(left.numRef + right.numRef));
-	BVHNode* rightNode = buildNode(right, level + 1, progressStart, progressMid);
-	BVHNode* leftNode = buildNode(left, level + 1, progressMid, progressEnd);
-	return new InnerNode(spec.bounds, leftNode, rightNode);
+
+	// The right child's references are on top of the stack. Build it first, as
+	// createLeaf() pops references off the top.
+
+	if (!m_pool || left.numRef < MinParallelRefs || right.numRef < MinParallelRefs)
+	{
+		BVHNode* rightNode = buildNode(ctx, right, level + 1, progressStart, progressMid);
+		int rightIndex = ctx.flatNodes.getSize() - 1;
+		BVHNode* leftNode = buildNode(ctx, left, level + 1, progressMid, progressEnd);
+		return createInner(ctx, spec.bounds, leftNode, rightNode, rightIndex);
+	}
+
+	// Parallel: move the left child's references into a context of its own and
+	// build it on another thread while this one continues with the right child.
+
+	Context leftCtx;
+	int leftStart = ctx.refStack.getSize() - left.numRef - right.numRef;
+	reserveContext(leftCtx, left.numRef);
+	leftCtx.refStack.resize(left.numRef);
+	leftCtx.refStack.setRange(0, left.numRef, ctx.refStack.getPtr(leftStart));
+	leftCtx.rightBounds.reset(max1i(left.numRef, (int)NumSpatialBins) - 1);
+	ctx.refStack.remove(leftStart, leftStart + left.numRef);
+
+	BVHNode* leftNode = NULL;
+	TaskPool::Group group;
+	m_pool->run(group, [&]() { leftNode = buildNode(leftCtx, left, level + 1, progressMid, progressEnd); });
+	BVHNode* rightNode = buildNode(ctx, right, level + 1, progressStart, progressMid);
+	int rightIndex = ctx.flatNodes.getSize() - 1;
+	m_pool->wait(group);
+
+	// Append the left triangles and flat nodes after the right ones, which is exactly
+	// where the serial build would have put them.
+
+	if (m_params.flatOutput)
+		appendFlatNodes(ctx.flatNodes, leftCtx.flatNodes, ctx.triIndices.getSize());
+	else
+		offsetLeaves(leftNode, ctx.triIndices.getSize());
+	ctx.triIndices.add(leftCtx.triIndices);
+	ctx.numNodes += leftCtx.numNodes;
+	ctx.numDuplicates += leftCtx.numDuplicates;
+	return createInner(ctx, spec.bounds, leftNode, rightNode, rightIndex);
+}
+
+//------------------------------------------------------------------------
+
+void SplitBVHBuilder::offsetLeaves(BVHNode* node, int offset)
+{
+	if (node->isLeaf())
+	{
+		LeafNode* leaf = reinterpret_cast<LeafNode*>(node);
+		leaf->m_lo += offset;
+		leaf->m_hi += offset;
+		return;
+	}
+
+	for (int i = 0; i < node->getNumChildNodes(); i++)
+		offsetLeaves(node->getChildNode(i), offset);
+}
+
+//------------------------------------------------------------------------
+
+void SplitBVHBuilder::appendFlatNodes(Array<BVH::FlatNode>& nodes, const Array<BVH::FlatNode>& subtree, int triOffset)
+{
+	int nodeOffset = nodes.getSize();
+	BVH::FlatNode* dst = nodes.add(subtree.getPtr(), subtree.getSize());
+	for (int i = 0; i < subtree.getSize(); i++)
+	{
+		int offset = dst[i].isLeaf ? triOffset : nodeOffset;
+		dst[i].left += offset;
+		dst[i].right += offset;
+	}
 }
 
 //------------------------------------------------------------------------
 
-BVHNode* SplitBVHBuilder::createLeaf(const NodeSpec& spec)
+BVHNode* SplitBVHBuilder::createLeaf(Context& ctx, const NodeSpec& spec)
 {
-	Array<S32>& tris = m_bvh.getTriIndices();
+	Array<S32>& tris = ctx.triIndices;
 	
 	for (int i = 0; i < spec.numRef; i++)
-		tris.add(m_refStack.removeLast().triIdx); // take a triangle from the stack and add it to tris array
+		tris.add(ctx.refStack.removeLast().triIdx); // take a triangle from the stack and add it to tris array
+
+	if (!m_params.flatOutput)
+		return m_bvh.getNodeArena().newLeaf(ctx.nodes, spec.bounds, tris.getSize() - spec.numRef, tris.getSize());
 
-	return new LeafNode(spec.bounds, tris.getSize() - spec.numRef, tris.getSize());
+	BVH::FlatNode& node = ctx.flatNodes.add();
+	node.bounds = spec.bounds;
+	node.left = tris.getSize() - spec.numRef;
+	node.right = tris.getSize();
+	node.isLeaf = 1;
+	return NULL;
 }
 
 //------------------------------------------------------------------------
 
-SplitBVHBuilder::ObjectSplit SplitBVHBuilder::findObjectSplit(const NodeSpec& spec, F32 nodeSAH)
+BVHNode* SplitBVHBuilder::createInner(Context& ctx, const AABB& bounds, BVHNode* left, BVHNode* right, int rightIndex)
+{
+	if (!m_params.flatOutput)
+		return m_bvh.getNodeArena().newInner(ctx.nodes, bounds, left, right);
+
+	// The left subtree was built last, its root is the node just before this one
+	BVH::FlatNode& node = ctx.flatNodes.add();
+	node.bounds = bounds;
+	node.left = ctx.flatNodes.getSize() - 2;
+	node.right = rightIndex;
+	node.isLeaf = 0;
+	return NULL;
+}
+
+//------------------------------------------------------------------------
+
+SplitBVHBuilder::ObjectSplit SplitBVHBuilder::sweepObjectSplit(const Reference* refPtr, AABB* rightBoundsPtr, int numRef, int dim, F32 nodeSAH) const
 {
 	ObjectSplit split;
-	const Reference* refPtr = m_refStack.getPtr(m_refStack.getSize() - spec.numRef);
+
+	// Sweep right to left and determine bounds.
+
+	AABB rightBounds;
+	for (int i = numRef - 1; i > 0; i--)
+	{
+		rightBounds.grow(refPtr[i].bounds);
+		rightBoundsPtr[i - 1] = rightBounds;
+	}
+
+	// Sweep left to right and select lowest SAH.
+
+	AABB leftBounds;
+	for (int i = 1; i < numRef; i++)
+	{
+		leftBounds.grow(refPtr[i - 1].bounds);
+		F32 sah = nodeSAH + leftBounds.area() * m_platform.getTriangleCost(i) + rightBoundsPtr[i - 1].area() * m_platform.getTriangleCost(numRef - i);
+		if (sah < split.sah)
+		{
+			split.sah = sah;
+			split.sortDim = dim;
+			split.numLeft = i;
+			split.leftBounds = leftBounds;
+			split.rightBounds = rightBoundsPtr[i - 1];
+		}
+	}
+	return split;
+}
+
+//------------------------------------------------------------------------
+
+SplitBVHBuilder::ObjectSplit SplitBVHBuilder::findObjectSplit(Context& ctx, const NodeSpec& spec, F32 nodeSAH)
+{
+	// Large nodes: bin centroids instead of sorting. Fall back to the full sweep if
+	// every centroid landed in the same bin.
+
+	if (m_numObjectBins > 0 && spec.numRef >= m_minBinnedRefs)
+	{
+		ObjectSplit split = findObjectSplitBinned(ctx, spec, nodeSAH);
+		if (split.sah < FW_F32_MAX)
+			return split;
+	}
+
+	if (m_pool && spec.numRef >= MinParallelSweepRefs)
+		return findObjectSplitParallel(ctx, spec, nodeSAH);
+
+	ObjectSplit split;
+	int start = ctx.refStack.getSize() - spec.numRef;
+	const Reference* refPtr = ctx.refStack.getPtr(start);
 
 	// Sort along each dimension.
 
-	for (m_sortDim = 0; m_sortDim < 3; m_sortDim++)
+	for (int dim = 0; dim < 3; dim++)
 	{
-		Sort(m_refStack.getSize() - spec.numRef, m_refStack.getSize(), this, sortCompare, sortSwap);
+		sortReferences(ctx.sortScratch, ctx.refStack.getPtr(), start, ctx.refStack.getSize(), dim);
 
-		// Sweep right to left and determine bounds.
+		ObjectSplit candidate = sweepObjectSplit(refPtr, ctx.rightBounds.getPtr(), spec.numRef, dim, nodeSAH);
+		if (candidate.sah < split.sah)
+			split = candidate;
+	}
+	return split;
+}
 
-		AABB rightBounds;
-		for (int i = spec.numRef - 1; i > 0; i--)
+//------------------------------------------------------------------------
+
+SplitBVHBuilder::ObjectSplit SplitBVHBuilder::findObjectSplitParallel(Context& ctx, const NodeSpec& spec, F32 nodeSAH)
+{
+	// Near the root a single node covers most of the scene, so sort and sweep the
+	// three axes concurrently, each on its own copy of the references.
+
+	int start = ctx.refStack.getSize() - spec.numRef;
+	Array<Reference> sorted[3];
+	Array<AABB> rightBounds[3];
+	SortScratch scratch[3];
+	ObjectSplit candidates[3];
+
+	TaskPool::Group group;
+	for (int dim = 0; dim < 3; dim++)
+	{
+		m_pool->run(group, [&, dim]()
+		{
+			sorted[dim].set(ctx.refStack.getPtr(start), spec.numRef);
+			rightBounds[dim].reset(spec.numRef);
+			sortReferences(scratch[dim], sorted[dim].getPtr(), 0, spec.numRef, dim);
+			candidates[dim] = sweepObjectSplit(sorted[dim].getPtr(), rightBounds[dim].getPtr(), spec.numRef, dim, nodeSAH);
+		});
+	}
+	m_pool->wait(group);
+
+	// Same tie breaking as the serial loop: the first axis wins.
+
+	ObjectSplit split;
+	for (int dim = 0; dim < 3; dim++)
+		if (candidates[dim].sah < split.sah)
+			split = candidates[dim];
+
+	// Leave the references sorted along the last axis like the serial version does.
+
+	ctx.refStack.setRange(start, start + spec.numRef, sorted[2].getPtr());
+	return split;
+}
+
+//------------------------------------------------------------------------
+
+int SplitBVHBuilder::getObjectBin(const Reference& ref, int dim, F32 binOrigin, F32 binScale) const
+{
+	F32 centroid = ref.bounds.min()._v[dim] + ref.bounds.max()._v[dim];  // doubled, like sortCompare
+	int bin = (int)((centroid - binOrigin) * binScale);
+	return bin < 0 ? 0 : bin >= m_numObjectBins ? m_numObjectBins - 1 : bin;
+}
+
+//------------------------------------------------------------------------
+
+SplitBVHBuilder::ObjectSplit SplitBVHBuilder::findObjectSplitBinned(Context& ctx, const NodeSpec& spec, F32 nodeSAH)
+{
+	const Reference* refs = ctx.refStack.getPtr(ctx.refStack.getSize() - spec.numRef);
+	SpatialBin (*bins)[MaxBins] = ctx.bins;
+
+	// Bounds of the (doubled) centroids determine the bin layout.
+
+	AABB centroidBounds;
+	for (int i = 0; i < spec.numRef; i++)
+		centroidBounds.grow(refs[i].bounds.min() + refs[i].bounds.max());
+
+	Vec3f origin = centroidBounds.min();
+	Vec3f extent = centroidBounds.max() - origin;
+	Vec3f binScale;
+	for (int dim = 0; dim < 3; dim++)
+	{
+		binScale._v[dim] = (extent._v[dim] > 0.0f) ? (F32)m_numObjectBins / extent._v[dim] : 0.0f;
+		for (int i = 0; i < m_numObjectBins; i++)
 		{
-			rightBounds.grow(refPtr[i].bounds);
-			m_rightBounds[i - 1] = rightBounds;
+			bins[dim][i].bounds = AABB();
+			bins[dim][i].enter = 0;
 		}
+	}
 
-		// Sweep left to right and select lowest SAH.
+	// Drop every reference into one bin per axis.
+
+	for (int i = 0; i < spec.numRef; i++)
+	{
+		for (int dim = 0; dim < 3; dim++)
+		{
+			SpatialBin& bin = bins[dim][getObjectBin(refs[i], dim, origin._v[dim], binScale._v[dim])];
+			bin.bounds.grow(refs[i].bounds);
+			bin.enter++;
+		}
+	}
+
+	// Sweep the bin boundaries like findSpatialSplit does. Empty bins are skipped
+	// when growing, an empty AABB would otherwise blow up the accumulated bounds.
+
+	ObjectSplit split;
+	for (int dim = 0; dim < 3; dim++)
+	{
+		if (binScale._v[dim] == 0.0f)
+			continue;
+
+		AABB rightBounds;
+		for (int i = m_numObjectBins - 1; i > 0; i--)
+		{
+			if (bins[dim][i].enter)
+				rightBounds.grow(bins[dim][i].bounds);
+			ctx.rightBounds[i - 1] = rightBounds;
+		}
 
 		AABB leftBounds;
-		for (int i = 1; i < spec.numRef; i++)
+		int leftNum = 0;
+		for (int i = 1; i < m_numObjectBins; i++)
 		{
-			leftBounds.grow(refPtr[i - 1].bounds);
-			F32 sah = nodeSAH + leftBounds.area() * m_platform.getTriangleCost(i) + m_rightBounds[i - 1].area() * m_platform.getTriangleCost(spec.numRef - i);
+			if (bins[dim][i - 1].enter)
+				leftBounds.grow(bins[dim][i - 1].bounds);
+			leftNum += bins[dim][i - 1].enter;
+
+			int rightNum = spec.numRef - leftNum;
+			if (!leftNum || !rightNum)
+				continue;
+
+			F32 sah = nodeSAH + leftBounds.area() * m_platform.getTriangleCost(leftNum) + ctx.rightBounds[i - 1].area() * m_platform.getTriangleCost(rightNum);
 			if (sah < split.sah)
 			{
 				split.sah = sah;
-				split.sortDim = m_sortDim;
-				split.numLeft = i;
+				split.sortDim = dim;
+				split.numLeft = leftNum;
 				split.leftBounds = leftBounds;
-				split.rightBounds = m_rightBounds[i - 1];
+				split.rightBounds = ctx.rightBounds[i - 1];
+				split.splitBin = i;
+				split.binOrigin = origin._v[dim];
+				split.binScale = binScale._v[dim];
 			}
 		}
 	}
@@ -241,10 +601,26 @@ SplitBVHBuilder::ObjectSplit SplitBVHBuilder::findObjectSplit(const NodeSpec& sp
 
 //------------------------------------------------------------------------
 
-void SplitBVHBuilder::performObjectSplit(NodeSpec& left, NodeSpec& right, const NodeSpec& spec, const ObjectSplit& split)
+void SplitBVHBuilder::performObjectSplit(Context& ctx, NodeSpec& left, NodeSpec& right, const NodeSpec& spec, const ObjectSplit& split)
 {
-	m_sortDim = split.sortDim;
-	Sort(m_refStack.getSize() - spec.numRef, m_refStack.getSize(), this, sortCompare, sortSwap);
+	if (split.splitBin >= 0)
+	{
+		// Binned split: partition in place, no sorting needed.
+
+		Reference* refs = ctx.refStack.getPtr(ctx.refStack.getSize() - spec.numRef);
+		int leftEnd = 0;
+		int rightStart = spec.numRef;
+		while (leftEnd < rightStart)
+		{
+			if (getObjectBin(refs[leftEnd], split.sortDim, split.binOrigin, split.binScale) < split.splitBin)
+				leftEnd++;
+			else
+				swap(refs[leftEnd], refs[--rightStart]);
+		}
+		FW_ASSERT(leftEnd == split.numLeft);
+	}
+	else
+		sortReferences(ctx.sortScratch, ctx.refStack.getPtr(), ctx.refStack.getSize() - spec.numRef, ctx.refStack.getSize(), split.sortDim);
 
 	left.numRef = split.numLeft;
 	left.bounds = split.leftBounds;
@@ -262,19 +638,20 @@ inline Vec3i clamp3i(const Vec3i& v, const Vec3i& lo, const Vec3i& hi){
 	return Vec3i(clamp1i(v.x, lo.x, hi.x), clamp1i(v.y, lo.y, hi.y), clamp1i(v.z, lo.z, hi.z));}
 
 
-SplitBVHBuilder::SpatialSplit SplitBVHBuilder::findSpatialSplit(const NodeSpec& spec, F32 nodeSAH)
+SplitBVHBuilder::SpatialSplit SplitBVHBuilder::findSpatialSplit(Context& ctx, const NodeSpec& spec, F32 nodeSAH)
 {
 	// Initialize bins.
 
 	Vec3f origin = spec.bounds.min();
 	Vec3f binSize = (spec.bounds.max() - origin) * (1.0f / (F32)NumSpatialBins);
 	Vec3f invBinSize = Vec3f(1.0f / binSize.x, 1.0f / binSize.y, 1.0f / binSize.z);
+	SpatialBin (*bins)[MaxBins] = ctx.bins;
 
 	for (int dim = 0; dim < 3; dim++)
 	{
 		for (int i = 0; i < NumSpatialBins; i++)
 		{
-			SpatialBin& bin = m_bins[dim][i];
+			SpatialBin& bin = bins[dim][i];
 			bin.bounds = AABB();
 			bin.enter = 0;
 			bin.exit = 0;
@@ -283,26 +660,52 @@ SplitBVHBuilder::SpatialSplit SplitBVHBuilder::findSpatialSplit(const NodeSpec&
 
 	// Chop references into bins.
 
-	for (int refIdx = m_refStack.getSize() - spec.numRef; refIdx < m_refStack.getSize(); refIdx++)
+	const Reference* refs = ctx.refStack.getPtr(ctx.refStack.getSize() - spec.numRef);
+	if (!m_pool || spec.numRef < MinParallelSweepRefs)
+		binReferences(bins, refs, spec.numRef, origin, binSize, invBinSize);
+	else
 	{
-		const Reference& ref = m_refStack[refIdx];
+		// One set of bins per chunk, merged afterwards. Growing bounds and summing
+		// counters is exact, so the result does not depend on the chunk count.
 
-		Vec3i firstBin = clamp3i(Vec3i((ref.bounds.min() - origin) * invBinSize), Vec3i(0, 0, 0), Vec3i(NumSpatialBins - 1, NumSpatialBins - 1, NumSpatialBins - 1));
-		Vec3i lastBin = clamp3i(Vec3i((ref.bounds.max() - origin) * invBinSize), firstBin, Vec3i(NumSpatialBins - 1, NumSpatialBins - 1, NumSpatialBins - 1));
+		int numChunks = m_pool->getNumThreads();
+		int chunkSize = (spec.numRef + numChunks - 1) / numChunks;
+		Array<SpatialBin> chunkBins(NULL, numChunks * 3 * MaxBins);
 
-		for (int dim = 0; dim < 3; dim++)
+		TaskPool::Group group;
+		for (int c = 0; c < numChunks; c++)
 		{
-			Reference currRef = ref;
-			for (int i = firstBin._v[dim]; i < lastBin._v[dim]; i++)
+			m_pool->run(group, [&, c]()
 			{
-				Reference leftRef, rightRef;
-				splitReference(leftRef, rightRef, currRef, dim, origin._v[dim] + binSize._v[dim] * (F32)(i + 1));
-				m_bins[dim][i].bounds.grow(leftRef.bounds);
-				currRef = rightRef;
+				SpatialBin (*local)[MaxBins] = (SpatialBin (*)[MaxBins])chunkBins.getPtr(c * 3 * MaxBins);
+				for (int dim = 0; dim < 3; dim++)
+				{
+					for (int i = 0; i < NumSpatialBins; i++)
+					{
+						local[dim][i].enter = 0;
+						local[dim][i].exit = 0;
+					}
+				}
+				int lo = min1i(c * chunkSize, spec.numRef);
+				int hi = min1i(lo + chunkSize, spec.numRef);
+				binReferences(local, refs + lo, hi - lo, origin, binSize, invBinSize);
+			});
+		}
+		m_pool->wait(group);
+
+		for (int c = 0; c < numChunks; c++)
+		{
+			const SpatialBin (*local)[MaxBins] = (const SpatialBin (*)[MaxBins])chunkBins.getPtr(c * 3 * MaxBins);
+			for (int dim = 0; dim < 3; dim++)
+			{
+				for (int i = 0; i < NumSpatialBins; i++)
+				{
+					if (local[dim][i].bounds.valid()) // growing by an empty box would blow up the bounds
+						bins[dim][i].bounds.grow(local[dim][i].bounds);
+					bins[dim][i].enter += local[dim][i].enter;
+					bins[dim][i].exit += local[dim][i].exit;
+				}
 			}
-			m_bins[dim][lastBin._v[dim]].bounds.grow(currRef.bounds);
-			m_bins[dim][firstBin._v[dim]].enter++;
-			m_bins[dim][lastBin._v[dim]].exit++;
 		}
 	}
 
@@ -316,8 +719,8 @@ SplitBVHBuilder::SpatialSplit SplitBVHBuilder::findSpatialSplit(const NodeSpec&
 		AABB rightBounds;
 		for (int i = NumSpatialBins - 1; i > 0; i--)
 		{
-			rightBounds.grow(m_bins[dim][i].bounds);
-			m_rightBounds[i - 1] = rightBounds;
+			rightBounds.grow(bins[dim][i].bounds);
+			ctx.rightBounds[i - 1] = rightBounds;
 		}
 
 		// Sweep left to right and select lowest SAH.
@@ -328,11 +731,11 @@ SplitBVHBuilder::SpatialSplit SplitBVHBuilder::findSpatialSplit(const NodeSpec&
 
 		for (int i = 1; i < NumSpatialBins; i++)
 		{
-			leftBounds.grow(m_bins[dim][i - 1].bounds);
-			leftNum += m_bins[dim][i - 1].enter;
-			rightNum -= m_bins[dim][i - 1].exit;
+			leftBounds.grow(bins[dim][i - 1].bounds);
+			leftNum += bins[dim][i - 1].enter;
+			rightNum -= bins[dim][i - 1].exit;
 
-			F32 sah = nodeSAH + leftBounds.area() * m_platform.getTriangleCost(leftNum) + m_rightBounds[i - 1].area() * m_platform.getTriangleCost(rightNum);
+			F32 sah = nodeSAH + leftBounds.area() * m_platform.getTriangleCost(leftNum) + ctx.rightBounds[i - 1].area() * m_platform.getTriangleCost(rightNum);
 			if (sah < split.sah)
 			{
 				split.sah = sah;
@@ -346,7 +749,35 @@ SplitBVHBuilder::SpatialSplit SplitBVHBuilder::findSpatialSplit(const NodeSpec&
 
 //------------------------------------------------------------------------
 
-void SplitBVHBuilder::performSpatialSplit(NodeSpec& left, NodeSpec& right, const NodeSpec& spec, const SpatialSplit& split)
+void SplitBVHBuilder::binReferences(SpatialBin (*bins)[MaxBins], const Reference* refs, int numRef, const Vec3f& origin, const Vec3f& binSize, const Vec3f& invBinSize) const
+{
+	for (int refIdx = 0; refIdx < numRef; refIdx++)
+	{
+		const Reference& ref = refs[refIdx];
+
+		Vec3i firstBin = clamp3i(Vec3i((ref.bounds.min() - origin) * invBinSize), Vec3i(0, 0, 0), Vec3i(NumSpatialBins - 1, NumSpatialBins - 1, NumSpatialBins - 1));
+		Vec3i lastBin = clamp3i(Vec3i((ref.bounds.max() - origin) * invBinSize), firstBin, Vec3i(NumSpatialBins - 1, NumSpatialBins - 1, NumSpatialBins - 1));
+
+		for (int dim = 0; dim < 3; dim++)
+		{
+			Reference currRef = ref;
+			for (int i = firstBin._v[dim]; i < lastBin._v[dim]; i++)
+			{
+				Reference leftRef, rightRef;
+				splitReference(leftRef, rightRef, currRef, dim, origin._v[dim] + binSize._v[dim] * (F32)(i + 1));
+				bins[dim][i].bounds.grow(leftRef.bounds);
+				currRef = rightRef;
+			}
+			bins[dim][lastBin._v[dim]].bounds.grow(currRef.bounds);
+			bins[dim][firstBin._v[dim]].enter++;
+			bins[dim][lastBin._v[dim]].exit++;
+		}
+	}
+}
+
+//------------------------------------------------------------------------
+
+void SplitBVHBuilder::performSpatialSplit(Context& ctx, NodeSpec& left, NodeSpec& right, const NodeSpec& spec, const SpatialSplit& split)
 {
 	// Categorize references and compute bounds.
 	//
@@ -354,7 +785,7 @@ void SplitBVHBuilder::performSpatialSplit(NodeSpec& left, NodeSpec& right, const
 	// Uncategorized/split: [leftEnd, rightStart[
 	// Right-hand side:     [rightStart, refs.getSize()[
 
-	Array<Reference>& refs = m_refStack;
+	Array<Reference>& refs = ctx.refStack;
 	int leftStart = refs.getSize() - spec.numRef;
 	int leftEnd = leftStart;
 	int rightStart = refs.getSize();
@@ -442,7 +873,7 @@ void SplitBVHBuilder::performSpatialSplit(NodeSpec& left, NodeSpec& right, const
 
 //------------------------------------------------------------------------
 
-void SplitBVHBuilder::splitReference(Reference& left, Reference& right, const Reference& ref, int dim, F32 pos)
+void SplitBVHBuilder::splitReference(Reference& left, Reference& right, const Reference& ref, int dim, F32 pos) const
 {
 	// Initialize references.
 
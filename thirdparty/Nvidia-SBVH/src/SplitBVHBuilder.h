@@ -28,6 +28,8 @@
 #pragma once
 #include "BVH.h"
 #include "Timer.h"
+#include "TaskPool.h"
+#include <mutex>
 
 class SplitBVHBuilder
 {
@@ -37,6 +39,13 @@ private:
 		MaxDepth = 64,
 		MaxSpatialDepth = 48,
 		NumSpatialBins = 32,
+		MaxObjectBins = 128,
+		MaxBins = MaxObjectBins,        // bins are shared by the spatial and the binned object split search
+		MinParallelRefs = 2048,         // smallest subtree that is handed to another thread
+		MinParallelSweepRefs = 65536,   // smallest node whose split search is itself parallelized
+		MinRadixSortRefs = 256,         // smaller ranges use the comparison sort
+		DuplicatePercent = 25,          // reference stack headroom for spatial split duplicates
+		NodesPerTenRefs = 7,            // node count estimate for the arena, a little over what the default platform builds
 	};
 
 	struct Reference   /// a AABB bounding box enclosing 1 triangle, a reference can be duplicated by a split to be contained in 2 AABB boxes
@@ -62,8 +71,11 @@ private:
 		S32                 numLeft;  // number of triangles (references) in left child
 		AABB                leftBounds;
 		AABB                rightBounds;
+		S32                 splitBin;   // binned splits only: first centroid bin of the right child, -1 for sorted splits
+		F32                 binOrigin;
+		F32                 binScale;
 
-		ObjectSplit(void) : sah(FW_F32_MAX), sortDim(0), numLeft(0) {}
+		ObjectSplit(void) : sah(FW_F32_MAX), sortDim(0), numLeft(0), splitBin(-1), binOrigin(0.0f), binScale(0.0f) {}
 	};
 
 	struct SpatialSplit
@@ -82,6 +94,36 @@ private:
 		S32                 exit;
 	};
 
+	struct SortScratch   /// radix sort buffers, only ever grow so that sorting does not allocate per node
+	{
+		Array<U32>          keys;
+		Array<U32>          tmpKeys;
+		Array<S32>          order;
+		Array<S32>          tmpOrder;
+		Array<Reference>    sorted;
+	};
+
+	struct Context   /// per-subtree state, every task owns one so that subtrees can be built concurrently
+	{
+		Array<Reference>    refStack;
+		Array<S32>          triIndices;   // leaf triangle list, leaves index it locally until merged into the parent
+		Array<BVH::FlatNode> flatNodes;   // flat output: every node after its subtrees, indexed locally like triIndices
+		Array<AABB>         rightBounds;
+		SortScratch         sortScratch;
+		NodeArena::Cursor   nodes;
+		SpatialBin          bins[3][MaxBins];
+		S32                 numDuplicates;
+		S32                 numNodes;
+
+		Context(void) : numDuplicates(0), numNodes(0) {}
+	};
+
+	struct SortData
+	{
+		Reference*          refs;
+		S32                 dim;
+	};
+
 public:
 	SplitBVHBuilder(BVH& bvh, const BVH::BuildParams& params);
 	~SplitBVHBuilder(void);
@@ -92,15 +134,29 @@ private:
 	static int              sortCompare(void* data, int idxA, int idxB);
 	static void             sortSwap(void* data, int idxA, int idxB);
 
-	BVHNode*                buildNode(const NodeSpec& spec, int level, F32 progressStart, F32 progressEnd);
-	BVHNode*                createLeaf(const NodeSpec& spec);
+	void                    sortReferences(SortScratch& scratch, Reference* refs, int start, int end, int dim);
+	void                    reserveContext(Context& ctx, int numRef) const;
+
+	BVHNode*                buildNode(Context& ctx, const NodeSpec& spec, int level, F32 progressStart, F32 progressEnd);
+	BVHNode*                buildChildren(Context& ctx, const NodeSpec& spec, const NodeSpec& left, const NodeSpec& right, int level, F32 progressStart, F32 progressEnd);
+	BVHNode*                createLeaf(Context& ctx, const NodeSpec& spec);
+	BVHNode*                createInner(Context& ctx, const AABB& bounds, BVHNode* left, BVHNode* right, int rightIndex);
+	void                    printProgress(const Context& ctx, F32 progress);
+
+	ObjectSplit             findObjectSplit(Context& ctx, const NodeSpec& spec, F32 nodeSAH);
+	ObjectSplit             findObjectSplitParallel(Context& ctx, const NodeSpec& spec, F32 nodeSAH);
+	ObjectSplit             sweepObjectSplit(const Reference* refPtr, AABB* rightBoundsPtr, int numRef, int dim, F32 nodeSAH) const;
+	ObjectSplit             findObjectSplitBinned(Context& ctx, const NodeSpec& spec, F32 nodeSAH);
+	int                     getObjectBin(const Reference& ref, int dim, F32 binOrigin, F32 binScale) const;
+	void                    performObjectSplit(Context& ctx, NodeSpec& left, NodeSpec& right, const NodeSpec& spec, const ObjectSplit& split);
 
-	ObjectSplit             findObjectSplit(const NodeSpec& spec, F32 nodeSAH);
-	void                    performObjectSplit(NodeSpec& left, NodeSpec& right, const NodeSpec& spec, const ObjectSplit& split);
+	SpatialSplit            findSpatialSplit(Context& ctx, const NodeSpec& spec, F32 nodeSAH);
+	void                    binReferences(SpatialBin (*bins)[MaxBins], const Reference* refs, int numRef, const Vec3f& origin, const Vec3f& binSize, const Vec3f& invBinSize) const;
+	void                    performSpatialSplit(Context& ctx, NodeSpec& left, NodeSpec& right, const NodeSpec& spec, const SpatialSplit& split);
+	void                    splitReference(Reference& left, Reference& right, const Reference& ref, int dim, F32 pos) const;
 
-	SpatialSplit            findSpatialSplit(const NodeSpec& spec, F32 nodeSAH);
-	void                    performSpatialSplit(NodeSpec& left, NodeSpec& right, const NodeSpec& spec, const SpatialSplit& split);
-	void                    splitReference(Reference& left, Reference& right, const Reference& ref, int dim, F32 pos);
+	static void             offsetLeaves(BVHNode* node, int offset);
+	static void             appendFlatNodes(Array<BVH::FlatNode>& nodes, const Array<BVH::FlatNode>& subtree, int triOffset);
 
 private:
 	SplitBVHBuilder(const SplitBVHBuilder&); // forbidden
@@ -111,15 +167,14 @@ private:
 	const Platform&         m_platform;
 	const BVH::BuildParams& m_params;
 
-	Array<Reference>      m_refStack;
 	F32                     m_minOverlap;
-	Array<AABB>           m_rightBounds;
-	S32                     m_sortDim;
-	SpatialBin              m_bins[3][NumSpatialBins];
+	S32                     m_numRootRefs;
+	S32                     m_numObjectBins;   // 0 = always sweep over sorted references
+	S32                     m_minBinnedRefs;
 
+	TaskPool*               m_pool;         // NULL when building on a single thread
+	std::mutex              m_progressLock;
 	FW::Timer               m_progressTimer;
-	S32                     m_numDuplicates;
-	int						m_numNodes;
 };
 
 	
\ No newline at end of file
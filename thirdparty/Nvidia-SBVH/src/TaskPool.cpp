@@ -0,0 +1,159 @@
+#include "TaskPool.h"
+
+TaskPool::TaskPool(int numThreads)
+	: m_numQueued(0),
+	m_stop(false)
+{
+	if (numThreads <= 0)
+		numThreads = getHardwareThreads();
+
+	for (int i = 0; i < numThreads; i++)
+		m_queues.push_back(new Queue);
+
+	// Slot 0 belongs to the thread that owns the pool.
+	m_threadIds.resize(numThreads);
+	m_threadIds[0] = std::this_thread::get_id();
+
+	for (int i = 1; i < numThreads; i++)
+	{
+		m_workers.push_back(std::thread(&TaskPool::workerLoop, this, i));
+		m_threadIds[i] = m_workers.back().get_id();
+	}
+}
+
+//------------------------------------------------------------------------
+
+TaskPool::~TaskPool(void)
+{
+	{
+		std::lock_guard<std::mutex> guard(m_sleepLock);
+		m_stop = true;
+	}
+	m_wakeUp.notify_all();
+
+	for (size_t i = 0; i < m_workers.size(); i++)
+		m_workers[i].join();
+
+	for (size_t i = 0; i < m_queues.size(); i++)
+		delete m_queues[i];
+}
+
+//------------------------------------------------------------------------
+
+int TaskPool::getHardwareThreads(void)
+{
+	int n = (int)std::thread::hardware_concurrency();
+	return n > 0 ? n : 1;
+}
+
+//------------------------------------------------------------------------
+
+int TaskPool::getThreadIndex(void) const
+{
+	std::thread::id id = std::this_thread::get_id();
+	for (size_t i = 0; i < m_threadIds.size(); i++)
+		if (m_threadIds[i] == id)
+			return (int)i;
+	return 0;
+}
+
+//------------------------------------------------------------------------
+
+void TaskPool::run(Group& group, const Task& task)
+{
+	Entry entry;
+	entry.task = task;
+	entry.group = &group;
+	group.m_pending++;
+
+	Queue* queue = m_queues[getThreadIndex()];
+	{
+		std::lock_guard<std::mutex> guard(queue->lock);
+		queue->tasks.push_back(entry);
+	}
+
+	{
+		std::lock_guard<std::mutex> guard(m_sleepLock);
+		m_numQueued++;
+	}
+	m_wakeUp.notify_one();
+}
+
+//------------------------------------------------------------------------
+
+void TaskPool::wait(Group& group)
+{
+	int self = getThreadIndex();
+	while (group.m_pending > 0)
+	{
+		Entry entry;
+		if (popOrSteal(self, entry))
+			execute(entry);
+		else
+			std::this_thread::yield();
+	}
+}
+
+//------------------------------------------------------------------------
+
+bool TaskPool::popOrSteal(int self, Entry& entry)
+{
+	// Newest task from our own queue first (depth first, cache warm)...
+
+	Queue* own = m_queues[self];
+	{
+		std::lock_guard<std::mutex> guard(own->lock);
+		if (!own->tasks.empty())
+		{
+			entry = own->tasks.back();
+			own->tasks.pop_back();
+			m_numQueued--;
+			return true;
+		}
+	}
+
+	// ...otherwise steal the oldest (largest) task from someone else.
+
+	int numQueues = (int)m_queues.size();
+	for (int i = 1; i < numQueues; i++)
+	{
+		Queue* victim = m_queues[(self + i) % numQueues];
+		std::lock_guard<std::mutex> guard(victim->lock);
+		if (!victim->tasks.empty())
+		{
+			entry = victim->tasks.front();
+			victim->tasks.pop_front();
+			m_numQueued--;
+			return true;
+		}
+	}
+	return false;
+}
+
+//------------------------------------------------------------------------
+
+void TaskPool::execute(Entry& entry)
+{
+	entry.task();
+	entry.group->m_pending--;
+}
+
+//------------------------------------------------------------------------
+
+void TaskPool::workerLoop(int self)
+{
+	for (;;)
+	{
+		Entry entry;
+		if (popOrSteal(self, entry))
+		{
+			execute(entry);
+			continue;
+		}
+
+		std::unique_lock<std::mutex> guard(m_sleepLock);
+		m_wakeUp.wait(guard, [this] { return m_stop || m_numQueued > 0; });
+		if (m_stop)
+			return;
+	}
+}
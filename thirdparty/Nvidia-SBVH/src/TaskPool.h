@@ -0,0 +1,73 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Small work-stealing task pool used by the BVH builders.
+// Every thread (including the one that created the pool) owns a deque. Tasks
+// are pushed and popped LIFO on the owner's deque and stolen FIFO by idle threads.
+// wait() never blocks: the calling thread keeps executing pending tasks until
+// the group is done, so tasks may spawn and wait on nested groups freely.
+
+class TaskPool
+{
+public:
+	typedef std::function<void(void)> Task;
+
+	class Group
+	{
+	public:
+		Group(void) : m_pending(0) {}
+
+	private:
+		friend class TaskPool;
+		std::atomic<int>    m_pending;
+	};
+
+public:
+	explicit TaskPool(int numThreads);   // numThreads includes the calling thread, 0 = hardware concurrency
+	~TaskPool(void);
+
+	int                     getNumThreads(void) const   { return (int)m_queues.size(); }
+
+	void                    run(Group& group, const Task& task);
+	void                    wait(Group& group);
+
+	static int              getHardwareThreads(void);
+
+private:
+	struct Entry
+	{
+		Task                task;
+		Group*              group;
+	};
+
+	struct Queue
+	{
+		std::mutex          lock;
+		std::deque<Entry>   tasks;
+	};
+
+	int                     getThreadIndex(void) const;
+	bool                    popOrSteal(int self, Entry& entry);
+	void                    execute(Entry& entry);
+	void                    workerLoop(int self);
+
+private:
+	TaskPool(const TaskPool&); // forbidden
+	TaskPool&               operator=(const TaskPool&); // forbidden
+
+private:
+	std::vector<Queue*>         m_queues;
+	std::vector<std::thread>    m_workers;
+	std::vector<std::thread::id> m_threadIds;
+
+	std::mutex                  m_sleepLock;
+	std::condition_variable     m_wakeUp;
+	std::atomic<int>            m_numQueued;
+	bool                        m_stop;
+};
@@ -0,0 +1,221 @@
+#include "TreeletOptimizer.h"
+
+TreeletOptimizer::TreeletOptimizer(BVH& bvh, const BVH::BuildParams& params)
+	: m_platform(bvh.getPlatform()),
+	m_params(params),
+	m_pool(NULL),
+	m_numRestructured(0)
+{
+	int numThreads = (params.numThreads > 0) ? params.numThreads : TaskPool::getHardwareThreads();
+	if (numThreads > 1)
+		m_pool = new TaskPool(numThreads);
+}
+
+//------------------------------------------------------------------------
+
+TreeletOptimizer::~TreeletOptimizer(void)
+{
+	delete m_pool;
+}
+
+//------------------------------------------------------------------------
+
+void TreeletOptimizer::run(BVHNode* root, int numPasses)
+{
+	// Node indices address the per-node cost and triangle count. Restructuring
+	// reuses nodes, so they stay valid across passes.
+
+	int numNodes = root->getSubtreeSize(BVH_STAT_NODE_COUNT);
+	root->assignIndicesDepthFirst(0, true);
+	m_cost.reset(numNodes);
+	m_numTris.reset(numNodes);
+	initNode(root);
+
+	for (int pass = 0; pass < numPasses; pass++)
+	{
+		F32 oldCost = m_cost[root->m_index];
+		m_numRestructured = 0;
+		optimizeSubtree(root);
+
+		if (m_params.enablePrints)
+			printf("TreeletOptimizer: pass %d, %d treelets restructured, SAH %.2f%%\n", pass + 1, (int)m_numRestructured, 100.0f * (m_cost[root->m_index] - oldCost) / oldCost);
+		if (!m_numRestructured)
+			break;
+	}
+}
+
+//------------------------------------------------------------------------
+
+F32 TreeletOptimizer::getNodeCost(const BVHNode* node) const
+{
+	return node->m_bounds.area() * m_platform.getCost(node->getNumChildNodes(), node->getNumTriangles());
+}
+
+//------------------------------------------------------------------------
+
+void TreeletOptimizer::initNode(BVHNode* node)
+{
+	F32 cost = getNodeCost(node);
+	int numTris = node->getNumTriangles();
+	for (int i = 0; i < node->getNumChildNodes(); i++)
+	{
+		BVHNode* child = node->getChildNode(i);
+		initNode(child);
+		cost += m_cost[child->m_index];
+		numTris += m_numTris[child->m_index];
+	}
+	m_cost[node->m_index] = cost;
+	m_numTris[node->m_index] = numTris;
+}
+
+//------------------------------------------------------------------------
+
+void TreeletOptimizer::optimizeSubtree(BVHNode* node)
+{
+	if (node->isLeaf())
+		return;
+
+	// Children first, large subtrees in parallel. Restructuring a child's treelet
+	// keeps the child itself as the treelet root, so the pointers stay valid.
+
+	InnerNode* inner = (InnerNode*)node;
+	if (m_pool && m_numTris[node->m_index] >= MinParallelTris)
+	{
+		TaskPool::Group group;
+		m_pool->run(group, [this, inner]() { optimizeSubtree(inner->m_children[0]); });
+		optimizeSubtree(inner->m_children[1]);
+		m_pool->wait(group);
+	}
+	else
+	{
+		optimizeSubtree(inner->m_children[0]);
+		optimizeSubtree(inner->m_children[1]);
+	}
+
+	if (restructureTreelet(inner))
+		m_numRestructured++;
+}
+
+//------------------------------------------------------------------------
+
+bool TreeletOptimizer::restructureTreelet(InnerNode* root)
+{
+	// Grow the treelet by expanding the leaf with the largest surface area.
+
+	BVHNode* leaves[MaxTreeletLeaves];
+	InnerNode* inners[MaxTreeletLeaves - 2];
+	int numLeaves = 2;
+	int numInners = 0;
+	leaves[0] = root->m_children[0];
+	leaves[1] = root->m_children[1];
+
+	while (numLeaves < MaxTreeletLeaves)
+	{
+		int largest = -1;
+		for (int i = 0; i < numLeaves; i++)
+			if (!leaves[i]->isLeaf() && (largest < 0 || leaves[i]->m_bounds.area() > leaves[largest]->m_bounds.area()))
+				largest = i;
+		if (largest < 0)
+			break;
+
+		InnerNode* expand = (InnerNode*)leaves[largest];
+		inners[numInners++] = expand;
+		leaves[largest] = expand->m_children[0];
+		leaves[numLeaves++] = expand->m_children[1];
+	}
+
+	if (numLeaves < 3)
+		return false;
+
+	// Optimal cost of every leaf subset. Subsets are numerically smaller than
+	// their supersets, so increasing order visits partitions before their union.
+
+	const int numSubsets = 1 << MaxTreeletLeaves;
+	AABB bounds[numSubsets];
+	F32 cost[numSubsets];
+	U8 partition[numSubsets];
+
+	int full = (1 << numLeaves) - 1;
+	for (int mask = 1; mask <= full; mask++)
+	{
+		int lowest = mask & -mask;
+		if (mask == lowest)
+		{
+			int leaf = 0;
+			while ((1 << leaf) != mask)
+				leaf++;
+			bounds[mask] = leaves[leaf]->m_bounds;
+			cost[mask] = m_cost[leaves[leaf]->m_index];
+			partition[mask] = 0;
+			continue;
+		}
+
+		bounds[mask] = bounds[mask ^ lowest] + bounds[lowest];
+
+		// Only partitions containing the lowest leaf, the others are mirror images.
+
+		F32 best = FW_F32_MAX;
+		int bestPart = 0;
+		for (int part = (mask - 1) & mask; part; part = (part - 1) & mask)
+		{
+			if (!(part & lowest))
+				continue;
+			F32 c = cost[part] + cost[mask ^ part];
+			if (c < best)
+			{
+				best = c;
+				bestPart = part;
+			}
+		}
+		cost[mask] = bounds[mask].area() * m_platform.getNodeCost(2) + best;
+		partition[mask] = (U8)bestPart;
+	}
+
+	// Keep the current topology unless the new one is measurably cheaper.
+
+	F32 oldCost = m_cost[root->m_index];
+	if (!(cost[full] < oldCost * (1.0f - 1.0e-5f)))
+		return false;
+
+	// Rewire: the treelet root stays in place, the other inner nodes are reused.
+
+	struct Rebuild
+	{
+		TreeletOptimizer* self;
+		BVHNode** leaves;
+		InnerNode** inners;
+		int numInners;
+		const AABB* bounds;
+		const F32* cost;
+		const U8* partition;
+
+		BVHNode* build(int mask, InnerNode* node)
+		{
+			int lowest = mask & -mask;
+			if (mask == lowest)
+			{
+				int leaf = 0;
+				while ((1 << leaf) != mask)
+					leaf++;
+				return leaves[leaf];
+			}
+
+			if (!node)
+				node = inners[--numInners];
+			int part = partition[mask];
+			node->m_children[0] = build(part, NULL);
+			node->m_children[1] = build(mask ^ part, NULL);
+			node->m_bounds = bounds[mask];
+			self->m_cost[node->m_index] = cost[mask];
+			self->m_numTris[node->m_index] = self->m_numTris[node->m_children[0]->m_index] + self->m_numTris[node->m_children[1]->m_index];
+			return node;
+		}
+	};
+
+	Rebuild rebuild = { this, leaves, inners, numInners, bounds, cost, partition };
+	rebuild.build(full, root);
+	FW_ASSERT(rebuild.numInners == 0);
+	return true;
+}
+
+//------------------------------------------------------------------------
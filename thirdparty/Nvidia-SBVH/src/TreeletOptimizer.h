@@ -0,0 +1,46 @@
+#pragma once
+#include "BVH.h"
+#include "TaskPool.h"
+#include <atomic>
+
+// SAH optimization of a finished BVH by treelet restructuring
+// (Karras & Aila 2013, "Fast Parallel Construction of High-Quality Bounding Volume Hierarchies").
+// Bottom-up, every inner node grows a treelet of up to 7 leaves by repeatedly expanding the
+// largest one, finds the SAH-optimal topology over those leaves by dynamic programming over all
+// leaf subsets and rewires the treelet's inner nodes if that is cheaper. Nodes are reused, so the
+// node count and the leaves' triangle ranges stay valid.
+
+class TreeletOptimizer
+{
+private:
+	enum
+	{
+		MaxTreeletLeaves = 7,
+		MinParallelTris = 4096,         // smallest subtree that is handed to another thread
+	};
+
+public:
+	TreeletOptimizer(BVH& bvh, const BVH::BuildParams& params);
+	~TreeletOptimizer(void);
+
+	void                    run(BVHNode* root, int numPasses);
+
+private:
+	void                    initNode(BVHNode* node);
+	void                    optimizeSubtree(BVHNode* node);
+	bool                    restructureTreelet(InnerNode* root);
+	F32                     getNodeCost(const BVHNode* node) const;
+
+private:
+	TreeletOptimizer(const TreeletOptimizer&); // forbidden
+	TreeletOptimizer&       operator=(const TreeletOptimizer&); // forbidden
+
+private:
+	const Platform&         m_platform;
+	const BVH::BuildParams& m_params;
+	TaskPool*               m_pool;
+
+	Array<F32>              m_cost;         // subtree SAH cost per node index, not normalized by the root area
+	Array<S32>              m_numTris;      // triangles below each node index
+	std::atomic<int>        m_numRestructured;
+};